@@ -0,0 +1,211 @@
+#ifndef AISDI_MAPS_BENCHMARK_H
+#define AISDI_MAPS_BENCHMARK_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "BufferedTreeMap.h"
+#include "ConcurrentSkipListMap.h"
+#include "HashMap.h"
+#include "RadixTreeMap.h"
+#include "SpillableHashMap.h"
+#include "StringHashMap.h"
+#include "TreeMap.h"
+
+namespace aisdi
+{
+namespace benchmark
+{
+	using Clock = std::chrono::steady_clock;
+
+	class LatencyRecorder
+	{
+		std::vector<std::uint64_t> samples;
+		std::size_t ops = 0;
+		Clock::duration total{};
+
+	public:
+		void reserve(std::size_t count)
+		{
+			samples.reserve(samples.size() + count);
+		}
+
+		// one sample covering opsInSample operations; latency is stored per operation
+		void record(Clock::duration elapsed, std::size_t opsInSample = 1)
+		{
+			auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+			samples.push_back(static_cast<std::uint64_t>(ns) / (opsInSample ? opsInSample : 1));
+			ops += opsInSample;
+			total += elapsed;
+		}
+
+		double percentile(double p)
+		{
+			if(samples.empty())
+				return 0;
+			std::size_t index = static_cast<std::size_t>(p * samples.size());
+			if(index >= samples.size())
+				index = samples.size() - 1;
+			std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+			return static_cast<double>(samples[index]);
+		}
+
+		std::size_t operations() const
+		{
+			return ops;
+		}
+
+		double seconds() const
+		{
+			return std::chrono::duration<double>(total).count();
+		}
+	};
+
+	// uniform interface over the maps being compared
+
+	template<typename K, typename V, bool Flat>
+	void insertKey(HashMap<K, V, Flat> &map, const K &key, const V &value) { map[key] = value; }
+	template<typename K, typename V>
+	void insertKey(TreeMap<K, V> &map, const K &key, const V &value) { map[key] = value; }
+	template<typename K, typename V>
+	void insertKey(std::map<K, V> &map, const K &key, const V &value) { map[key] = value; }
+	template<typename K, typename V>
+	void insertKey(std::unordered_map<K, V> &map, const K &key, const V &value) { map[key] = value; }
+	template<typename V>
+	void insertKey(StringHashMap<V> &map, const std::string &key, const V &value) { map[key] = value; }
+	template<typename K, typename V>
+	void insertKey(RadixTreeMap<K, V> &map, const K &key, const V &value) { map[key] = value; }
+	template<typename K, typename V>
+	void insertKey(BufferedTreeMap<K, V> &map, const K &key, const V &value) { map.put(key, value); }
+	template<typename K, typename V>
+	void insertKey(SpillableHashMap<K, V> &map, const K &key, const V &value) { map[key] = value; }
+	template<typename K, typename V>
+	void insertKey(ConcurrentSkipListMap<K, V> &map, const K &key, const V &value) { map.assign(key, value); }
+
+	template<typename K, typename V, bool Flat>
+	void eraseKey(HashMap<K, V, Flat> &map, const K &key) { map.remove(key); }
+	template<typename K, typename V>
+	void eraseKey(TreeMap<K, V> &map, const K &key) { map.remove(key); }
+	template<typename K, typename V>
+	void eraseKey(std::map<K, V> &map, const K &key) { map.erase(key); }
+	template<typename K, typename V>
+	void eraseKey(std::unordered_map<K, V> &map, const K &key) { map.erase(key); }
+	template<typename V>
+	void eraseKey(StringHashMap<V> &map, const std::string &key) { map.remove(key); }
+	template<typename K, typename V>
+	void eraseKey(RadixTreeMap<K, V> &map, const K &key) { map.remove(key); }
+	template<typename K, typename V>
+	void eraseKey(BufferedTreeMap<K, V> &map, const K &key) { map.discard(key); }
+	template<typename K, typename V>
+	void eraseKey(SpillableHashMap<K, V> &map, const K &key) { map.remove(key); }
+	template<typename K, typename V>
+	void eraseKey(ConcurrentSkipListMap<K, V> &map, const K &key) { map.remove(key); }
+
+	template<typename MapType, typename K>
+	bool containsKey(const MapType &map, const K &key)
+	{
+		return map.find(key) != map.end();
+	}
+
+	template<typename MapType>
+	std::size_t scan(const MapType &map, std::size_t limit)
+	{
+		std::size_t visited = 0;
+		for(auto it = map.begin(); it != map.end() && visited < limit; ++it)
+			++visited;
+		return visited;
+	}
+
+	template<typename K>
+	K makeKey(std::uint64_t id);
+
+	template<>
+	inline int makeKey<int>(std::uint64_t id)
+	{
+		return static_cast<int>(id);
+	}
+
+	template<>
+	inline long makeKey<long>(std::uint64_t id)
+	{
+		return static_cast<long>(id);
+	}
+
+	// long enough to defeat the small string optimization, like real route/URL keys
+	template<>
+	inline std::string makeKey<std::string>(std::uint64_t id)
+	{
+		std::ostringstream out;
+		out << "/api/v1/users/" << std::setw(10) << std::setfill('0') << id << "/profile";
+		return out.str();
+	}
+
+	template<typename MapType>
+	struct Backend
+	{
+		using Map = MapType;
+	};
+
+	template<typename K, typename Run>
+	void runStringHashMap(Run &, std::false_type)
+	{}
+
+	template<typename K, typename Run>
+	void runStringHashMap(Run &run, std::true_type)
+	{
+		run(Backend<StringHashMap<int>>());
+	}
+
+	template<typename K, typename Run>
+	void runFlatHashMap(Run &, std::false_type)
+	{}
+
+	template<typename K, typename Run>
+	void runFlatHashMap(Run &run, std::true_type)
+	{
+		run(Backend<FlatHashMap<K, int>>());
+	}
+
+	// Calls run(Backend<MapType>()) with the int valued map named, keyed by K.
+	// StringHashMap only takes string keys and FlatHashMap only integer ones, other
+	// key types skip them.
+	template<typename K, typename Run>
+	void withBackend(const std::string &name, Run run)
+	{
+		if(name == "HashMap")
+			run(Backend<HashMap<K, int>>());
+		else if(name == "TreeMap")
+			run(Backend<TreeMap<K, int>>());
+		else if(name == "std::map")
+			run(Backend<std::map<K, int>>());
+		else if(name == "std::unordered_map")
+			run(Backend<std::unordered_map<K, int>>());
+		else if(name == "FlatHashMap")
+			runFlatHashMap<K>(run, UseFlatStorage<K, int>());
+		else if(name == "StringHashMap")
+			runStringHashMap<K>(run, std::is_same<K, std::string>());
+		else if(name == "RadixTreeMap")
+			run(Backend<RadixTreeMap<K, int>>());
+		else if(name == "BufferedTreeMap")
+			run(Backend<BufferedTreeMap<K, int>>());
+		else if(name == "SpillableHashMap")
+			run(Backend<SpillableHashMap<K, int>>());
+		else if(name == "ConcurrentSkipListMap")
+			run(Backend<ConcurrentSkipListMap<K, int>>());
+		else
+			throw std::invalid_argument("unknown backend: " + name);
+	}
+}
+}
+
+#endif /* AISDI_MAPS_BENCHMARK_H */
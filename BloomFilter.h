@@ -0,0 +1,308 @@
+#ifndef AISDI_MAPS_BLOOMFILTER_H
+#define AISDI_MAPS_BLOOMFILTER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+
+#include "MapStats.h"
+
+#define BLOOM_COUNTERS_PER_KEY 16
+#define BLOOM_BITS_PER_KEY 10
+#define BLOOM_PROBES 4
+
+namespace aisdi
+{
+
+// spreads std::hash values, which are the key itself for integers, over all 64 bits
+inline uint64_t bloomMix(uint64_t hash)
+{
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCDull;
+	hash ^= hash >> 33;
+	hash *= 0xC4CEB9FE1A85EC53ull;
+	return hash ^ (hash >> 33);
+}
+
+// Counting Bloom filter whose counters for one key all sit in a single 64 byte block,
+// so a query reads one cache line. A block is 128 four-bit counters; a key's hash
+// picks the block and BLOOM_PROBES counters inside it. Counters saturate at 15 and
+// then stay there, which keeps deletes safe: the filter may only err towards "maybe".
+class CountingBloomFilter
+{
+	static const size_t BLOCK_WORDS = 8;
+
+	size_t expectedKeys;
+	size_t blockMask;
+	std::unique_ptr<uint64_t[]> storage;
+	uint64_t *blocks; // storage rounded up to a cache line
+
+	uint64_t *blockFor(uint64_t mixed) const
+	{
+		return blocks + (mixed & blockMask) * BLOCK_WORDS;
+	}
+
+	// counter i of the key lives at word counter / 16, bits 4 * (counter % 16)
+	static unsigned counterOf(uint64_t mixed, int i)
+	{
+		return static_cast<unsigned>(mixed >> (64 - 7 * (i + 1))) & 127;
+	}
+
+	static unsigned get(const uint64_t *block, unsigned counter)
+	{
+		return static_cast<unsigned>(block[counter >> 4] >> ((counter & 15) * 4)) & 15;
+	}
+
+	void allocate(size_t blockCount)
+	{
+		storage.reset(new uint64_t[(blockCount + 1) * BLOCK_WORDS]());
+		uintptr_t address = reinterpret_cast<uintptr_t>(storage.get());
+		blocks = reinterpret_cast<uint64_t *>((address + 63) & ~uintptr_t(63));
+		blockMask = blockCount - 1;
+	}
+
+public:
+	explicit CountingBloomFilter(size_t expectedKeys) : expectedKeys(expectedKeys > 0 ? expectedKeys : 1)
+	{
+		size_t blockCount = 1;
+		while(blockCount * 128 < this->expectedKeys * BLOOM_COUNTERS_PER_KEY)
+			blockCount *= 2;
+		allocate(blockCount);
+	}
+
+	CountingBloomFilter(const CountingBloomFilter &other) : expectedKeys(other.expectedKeys)
+	{
+		allocate(other.blockMask + 1);
+		std::memcpy(blocks, other.blocks, (blockMask + 1) * BLOCK_WORDS * sizeof(uint64_t));
+	}
+
+	CountingBloomFilter &operator=(const CountingBloomFilter &) = delete;
+
+	void add(uint64_t hash)
+	{
+		uint64_t mixed = bloomMix(hash);
+		uint64_t *block = blockFor(mixed);
+		for(int i = 0; i < BLOOM_PROBES; ++i)
+		{
+			unsigned counter = counterOf(mixed, i);
+			if(get(block, counter) != 15)
+				block[counter >> 4] += uint64_t(1) << ((counter & 15) * 4);
+		}
+	}
+
+	// the key has to have been added before
+	void remove(uint64_t hash)
+	{
+		uint64_t mixed = bloomMix(hash);
+		uint64_t *block = blockFor(mixed);
+		for(int i = 0; i < BLOOM_PROBES; ++i)
+		{
+			unsigned counter = counterOf(mixed, i);
+			unsigned value = get(block, counter);
+			if(value != 15 && value != 0)
+				block[counter >> 4] -= uint64_t(1) << ((counter & 15) * 4);
+		}
+	}
+
+	// false means the key was certainly never added (or was removed since)
+	bool mayContain(uint64_t hash) const
+	{
+		uint64_t mixed = bloomMix(hash);
+		const uint64_t *block = blockFor(mixed);
+		for(int i = 0; i < BLOOM_PROBES; ++i)
+		{
+			if(get(block, counterOf(mixed, i)) == 0)
+				return false;
+		}
+		return true;
+	}
+
+	void clear()
+	{
+		std::memset(blocks, 0, (blockMask + 1) * BLOCK_WORDS * sizeof(uint64_t));
+	}
+
+	// number of keys the filter was sized for; past about twice as many the false
+	// positive rate climbs quickly
+	size_t capacity() const
+	{
+		return expectedKeys;
+	}
+
+	// heap bytes of the counters
+	size_t memoryUsage() const
+	{
+		return heapBlockSize((blockMask + 2) * BLOCK_WORDS * sizeof(uint64_t));
+	}
+};
+
+// Bloom filter for a key set that is built once and only queried after that: a bit
+// where CountingBloomFilter has a counter, so a key costs BLOOM_BITS_PER_KEY bits
+// instead of BLOOM_COUNTERS_PER_KEY counters. The blocks are 512 bits, one cache line.
+class BloomFilter
+{
+	static const size_t BLOCK_WORDS = 8;
+
+	size_t blockMask;
+	std::unique_ptr<uint64_t[]> storage;
+	uint64_t *blocks; // storage rounded up to a cache line
+
+	uint64_t *blockFor(uint64_t mixed) const
+	{
+		return blocks + (mixed & blockMask) * BLOCK_WORDS;
+	}
+
+	static unsigned bitOf(uint64_t mixed, int i)
+	{
+		return static_cast<unsigned>(mixed >> (64 - 9 * (i + 1))) & 511;
+	}
+
+public:
+	explicit BloomFilter(size_t expectedKeys)
+	{
+		size_t blockCount = 1;
+		while(blockCount * 512 < expectedKeys * BLOOM_BITS_PER_KEY)
+			blockCount *= 2;
+		storage.reset(new uint64_t[(blockCount + 1) * BLOCK_WORDS]());
+		uintptr_t address = reinterpret_cast<uintptr_t>(storage.get());
+		blocks = reinterpret_cast<uint64_t *>((address + 63) & ~uintptr_t(63));
+		blockMask = blockCount - 1;
+	}
+
+	BloomFilter(const BloomFilter &) = delete;
+	BloomFilter &operator=(const BloomFilter &) = delete;
+
+	void add(uint64_t hash)
+	{
+		uint64_t mixed = bloomMix(hash);
+		uint64_t *block = blockFor(mixed);
+		for(int i = 0; i < BLOOM_PROBES; ++i)
+		{
+			unsigned bit = bitOf(mixed, i);
+			block[bit >> 6] |= uint64_t(1) << (bit & 63);
+		}
+	}
+
+	// false means the key was certainly never added
+	bool mayContain(uint64_t hash) const
+	{
+		uint64_t mixed = bloomMix(hash);
+		const uint64_t *block = blockFor(mixed);
+		for(int i = 0; i < BLOOM_PROBES; ++i)
+		{
+			unsigned bit = bitOf(mixed, i);
+			if( (block[bit >> 6] & (uint64_t(1) << (bit & 63))) == 0)
+				return false;
+		}
+		return true;
+	}
+
+	// heap bytes of the bits
+	size_t memoryUsage() const
+	{
+		return heapBlockSize((blockMask + 2) * BLOCK_WORDS * sizeof(uint64_t));
+	}
+};
+
+// What a map keeps to use a filter: nothing but a null pointer until enable() is
+// called. Maps that already hash their keys feed those hashes in; others (TreeMap)
+// hash with the function given to enable(), so their keys needn't be hashable
+// unless the filter is used.
+template<typename KeyType>
+class Prefilter
+{
+	std::unique_ptr<CountingBloomFilter> filter;
+	size_t (*hashKey)(const KeyType &) = nullptr;
+
+	template<typename Hash>
+	static size_t callHash(const KeyType &key)
+	{
+		return Hash{}(key);
+	}
+
+public:
+	Prefilter() = default;
+
+	Prefilter(const Prefilter &other) : hashKey(other.hashKey)
+	{
+		if(other.filter != nullptr)
+			filter.reset(new CountingBloomFilter(*other.filter));
+	}
+
+	Prefilter(Prefilter &&other) = default;
+
+	Prefilter &operator=(const Prefilter &other)
+	{
+		if(this != &other)
+			*this = Prefilter(other);
+		return *this;
+	}
+
+	Prefilter &operator=(Prefilter &&other) = default;
+
+	// an empty filter for expectedKeys keys; the owner adds its elements
+	template<typename Hash = std::hash<KeyType>>
+	void enable(size_t expectedKeys)
+	{
+		filter.reset(new CountingBloomFilter(expectedKeys));
+		hashKey = &callHash<Hash>;
+	}
+
+	// a new empty filter, hashing keys as before
+	void resize(size_t expectedKeys)
+	{
+		filter.reset(new CountingBloomFilter(expectedKeys));
+	}
+
+	void disable()
+	{
+		filter.reset();
+	}
+
+	bool enabled() const
+	{
+		return filter != nullptr;
+	}
+
+	size_t hash(const KeyType &key) const
+	{
+		return hashKey(key);
+	}
+
+	void add(size_t hash)
+	{
+		filter->add(hash);
+	}
+
+	void remove(size_t hash)
+	{
+		filter->remove(hash);
+	}
+
+	bool mayContain(size_t hash) const
+	{
+		return filter->mayContain(hash);
+	}
+
+	// a filter holding more than twice the keys it was sized for should be rebuilt
+	bool overloaded(size_t keys) const
+	{
+		return keys > 2 * filter->capacity();
+	}
+
+	size_t capacity() const
+	{
+		return filter->capacity();
+	}
+
+	size_t memoryUsage() const
+	{
+		return filter == nullptr ? 0 : heapBlockSize(sizeof(CountingBloomFilter)) + filter->memoryUsage();
+	}
+};
+
+}
+
+#endif /* AISDI_MAPS_BLOOMFILTER_H */
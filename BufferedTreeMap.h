@@ -0,0 +1,739 @@
+#ifndef AISDI_MAPS_BUFFEREDTREEMAP_H
+#define AISDI_MAPS_BUFFEREDTREEMAP_H
+
+#include <algorithm>
+#include <cstddef>
+#include <initializer_list>
+#include <iterator>
+#include <ostream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "MapStats.h"
+#include "TreeMap.h"
+
+// writes buffered before they are merged into the tree
+#define BUFFERED_TREE_LIMIT 128
+
+namespace aisdi
+{
+
+// TreeMap with a write buffer in front, the way an LSM tree keeps a memtable:
+// writes land in a small sorted run of upserts and tombstones, and once it holds
+// bufferLimit entries the whole run is merged into the tree in key order. Reads
+// look at the run first and iterators walk the run and the tree together, so the
+// buffer is invisible apart from timing. put() and discard() never read the tree
+// at all. It pays off once the tree no longer fits in cache: a merge keeps many
+// descents in flight at once where single writes wait for each miss in turn.
+//
+// Merges relink the buffered nodes and keep the tree's, so references returned by
+// operator[] and valueOf() stay valid until their element is removed, as in
+// TreeMap. Those two first move a value written blind over a key the tree holds
+// into the tree's node, since that is the node a merge keeps; references reached
+// through iterators or const lookups may point at such a buffered value, which
+// the next merge frees. Iterators are invalidated by every write, like TreeMap's.
+template<typename KeyType, typename ValueType>
+class BufferedTreeMap
+{
+public:
+	using key_type = KeyType;
+	using mapped_type = ValueType;
+	using value_type = std::pair<const key_type, mapped_type>;
+	using size_type = std::size_t;
+	using reference = value_type &;
+	using const_reference = const value_type &;
+
+	class ConstIterator;
+
+	class Iterator;
+
+	using iterator = Iterator;
+	using const_iterator = ConstIterator;
+
+private:
+	using Tree = TreeMap<key_type, mapped_type>;
+	using NodeHandle = typename Tree::NodeHandle;
+
+	// whether a buffered key is also in the tree; blind writes don't look
+	enum Presence
+	{
+		UNKNOWN,
+		IN_TREE,
+		NOT_IN_TREE
+	};
+
+	// The element is already a tree node, so merging relinks it instead of copying.
+	// The key is kept next to it too: the run is searched without touching the heap.
+	struct Entry
+	{
+		key_type key;
+		NodeHandle node; // empty for a tombstone
+		bool removed;
+		Presence inTree;
+	};
+
+	Tree tree;
+	std::vector<Entry> buffer; // sorted by key, one entry per key
+	size_t limit;
+	// getSize() is tree.getSize() + sizeDelta, plus what the unresolved entries
+	// turn out to add or remove
+	std::ptrdiff_t sizeDelta{0};
+	size_t unresolved{0};
+
+	size_t bufferSlot(const key_type &key) const
+	{
+		auto slot = std::lower_bound(buffer.begin(), buffer.end(), key, [](const Entry &entry, const key_type &k)
+		{
+			return entry.key < k;
+		});
+		return static_cast<size_t>(slot - buffer.begin());
+	}
+
+	bool holds(size_t slot, const key_type &key) const
+	{
+		return slot < buffer.size() && !(key < buffer[slot].key);
+	}
+
+	// adds (sign 1) or takes back (sign -1) the entry's share of getSize()
+	void account(const Entry &entry, int sign)
+	{
+		if(entry.inTree == UNKNOWN)
+			unresolved += sign;
+		else if(entry.removed && entry.inTree == IN_TREE)
+			sizeDelta -= sign;
+		else if(!entry.removed && entry.inTree == NOT_IN_TREE)
+			sizeDelta += sign;
+	}
+
+	Entry &addEntry(size_t slot, const key_type &key, NodeHandle &&node, Presence inTree)
+	{
+		bool removed = node.empty();
+		auto it = buffer.insert(buffer.begin() + slot, Entry{key, std::move(node), removed, inTree});
+		account(*it, 1);
+		return *it;
+	}
+
+	// an empty node turns the entry into a tombstone
+	void setNode(Entry &entry, NodeHandle &&node)
+	{
+		account(entry, -1);
+		entry.node = std::move(node);
+		entry.removed = entry.node.empty();
+		account(entry, 1);
+	}
+
+	// A full run is merged before a write, not after, so the reference a write
+	// hands out is never to a node the merge frees. The write's arguments may live
+	// in the elements the merge frees, the callers copy them first.
+	bool full() const
+	{
+		return buffer.size() >= limit;
+	}
+
+	// The buffered upsert at slot, before a reference to its value is handed out: if
+	// the tree holds the key its value moves into the tree's node and the entry is
+	// dropped, otherwise the entry is known to be new and merging will relink it.
+	value_type &resolve(size_t slot)
+	{
+		Entry &entry = buffer[slot];
+		if(entry.inTree != NOT_IN_TREE)
+		{
+			auto it = tree.find(entry.key);
+			if(it != tree.end())
+			{
+				it->second = std::move(entry.node.mapped());
+				account(entry, -1);
+				buffer.erase(buffer.begin() + slot);
+				return *it;
+			}
+			account(entry, -1);
+			entry.inTree = NOT_IN_TREE;
+			account(entry, 1);
+		}
+		return entry.node.value();
+	}
+
+	// The run's keys are looked up in the tree as one batch first, which overlaps
+	// their cache misses and leaves their paths cached. Present keys then get their
+	// values assigned in place; only new keys and removals change the tree, each
+	// from the previous one's finger. merged counts the entries applied so far, so
+	// a throwing merge knows which ones are done.
+	void mergeByFinger(size_t &merged)
+	{
+		std::vector<key_type> keys;
+		keys.reserve(buffer.size());
+		for(const Entry &entry : buffer)
+			keys.push_back(entry.key);
+		std::vector<value_type *> present;
+		tree.findMany(keys, present);
+
+		auto hint = tree.end();
+		for(size_t i = 0; i < buffer.size(); ++i, ++merged)
+		{
+			Entry &entry = buffer[i];
+			if(present[i] == nullptr)
+			{
+				if(!entry.removed)
+					hint = tree.insert(hint, std::move(entry.node));
+			}
+			else if(entry.removed)
+				hint = tree.erase(tree.find(entry.key, hint));
+			else
+				present[i]->second = entry.node.mapped();
+		}
+	}
+
+public:
+
+	explicit BufferedTreeMap(size_t bufferLimit = BUFFERED_TREE_LIMIT) : limit(bufferLimit > 0 ? bufferLimit : 1)
+	{}
+
+	BufferedTreeMap(std::initializer_list<value_type> list) : BufferedTreeMap()
+	{
+		for(auto &elem : list)
+			put(elem.first, elem.second);
+	}
+
+	BufferedTreeMap(const BufferedTreeMap &other)
+		: tree(other.tree), limit(other.limit), sizeDelta(other.sizeDelta), unresolved(other.unresolved)
+	{
+		buffer.reserve(other.buffer.size());
+		for(const Entry &entry : other.buffer)
+		{
+			NodeHandle node = entry.removed ? NodeHandle() : NodeHandle(entry.node.value());
+			buffer.push_back(Entry{entry.key, std::move(node), entry.removed, entry.inTree});
+		}
+	}
+
+	BufferedTreeMap(BufferedTreeMap &&other) = default;
+
+	BufferedTreeMap &operator=(const BufferedTreeMap &other)
+	{
+		if(this != &other)
+			*this = BufferedTreeMap(other);
+		return *this;
+	}
+
+	BufferedTreeMap &operator=(BufferedTreeMap &&other) = default;
+
+	// Merges the buffered writes into the tree, relinking the buffered nodes by
+	// finger inserts in key order.
+	void flush()
+	{
+		if(buffer.empty())
+			return;
+
+		size_t merged = 0;
+		try
+		{
+			mergeByFinger(merged);
+		}
+		catch(...)
+		{
+			// the entries merged so far are dropped (a node the tree took over may
+			// leave its entry just past them), the rest stay buffered and only their
+			// size bookkeeping has to be redone
+			buffer.erase(buffer.begin(), buffer.begin() + merged);
+			if(!buffer.empty() && !buffer.front().removed && buffer.front().node.empty())
+				buffer.erase(buffer.begin());
+			for(Entry &entry : buffer)
+				entry.inTree = UNKNOWN;
+			sizeDelta = 0;
+			unresolved = buffer.size();
+			throw;
+		}
+
+		buffer.clear();
+		sizeDelta = 0;
+		unresolved = 0;
+	}
+
+	size_t pendingWrites() const
+	{
+		return buffer.size();
+	}
+
+	size_t bufferLimit() const
+	{
+		return limit;
+	}
+
+	// Blind upsert: buffered without looking the key up in the tree.
+	void put(const key_type &key, const mapped_type &value)
+	{
+		if(full())
+		{
+			std::pair<key_type, mapped_type> saved(key, value);
+			flush();
+			put(saved.first, saved.second);
+			return;
+		}
+
+		size_t slot = bufferSlot(key);
+		if(!holds(slot, key))
+			addEntry(slot, key, NodeHandle(value_type(key, value)), UNKNOWN);
+		else if(buffer[slot].removed)
+			setNode(buffer[slot], NodeHandle(value_type(key, value)));
+		else
+			buffer[slot].node.mapped() = value;
+	}
+
+	// Blind delete: removes the key if it is there, without looking it up.
+	void discard(const key_type &key)
+	{
+		if(full())
+		{
+			key_type saved = key;
+			flush();
+			discard(saved);
+			return;
+		}
+
+		size_t slot = bufferSlot(key);
+		if(!holds(slot, key))
+		{
+			addEntry(slot, key, NodeHandle(), UNKNOWN);
+			return;
+		}
+
+		Entry &entry = buffer[slot];
+		if(entry.removed)
+			return;
+		if(entry.inTree == NOT_IN_TREE)
+		{
+			account(entry, -1);
+			buffer.erase(buffer.begin() + slot);
+		}
+		else
+			setNode(entry, NodeHandle());
+	}
+
+	// Reads the tree for keys that aren't buffered, since an existing value has to
+	// be returned; a missing key is buffered with a default value.
+	mapped_type &operator[](const key_type &key)
+	{
+		if(full())
+		{
+			key_type saved = key;
+			flush();
+			return (*this)[saved];
+		}
+
+		size_t slot = bufferSlot(key);
+		if(holds(slot, key))
+		{
+			Entry &entry = buffer[slot];
+			if(entry.removed)
+				setNode(entry, NodeHandle(value_type(key, mapped_type{})));
+			return resolve(slot).second;
+		}
+
+		auto it = tree.find(key);
+		if(it != tree.end())
+			return it->second;
+		return addEntry(slot, key, NodeHandle(value_type(key, mapped_type{})), NOT_IN_TREE).node.mapped();
+	}
+
+	const mapped_type &valueOf(const key_type &key) const
+	{
+		auto it = find(key);
+		if(it == end())
+			throw std::out_of_range("Key doesn't exist");
+		return it->second;
+	}
+
+	mapped_type &valueOf(const key_type &key)
+	{
+		size_t slot = bufferSlot(key);
+		if(holds(slot, key) && !buffer[slot].removed)
+			return resolve(slot).second;
+		// ugly cast, yet reduces code duplication.
+		return const_cast<mapped_type &>( (const_cast<const BufferedTreeMap *>(this))->valueOf(key));
+	}
+
+	const_iterator find(const key_type &key) const
+	{
+		size_t slot = bufferSlot(key);
+		if(holds(slot, key))
+		{
+			if(buffer[slot].removed)
+				return cend();
+			return ConstIterator(this, tree.lowerBound(key), slot);
+		}
+
+		auto it = tree.find(key);
+		if(it == tree.end())
+			return cend();
+		return ConstIterator(this, it, slot);
+	}
+
+	iterator find(const key_type &key)
+	{
+		return Iterator( (const_cast<const BufferedTreeMap *>(this))->find(key));
+	}
+
+	void remove(const key_type &key)
+	{
+		if(full())
+		{
+			key_type saved = key;
+			flush();
+			remove(saved);
+			return;
+		}
+
+		size_t slot = bufferSlot(key);
+		if(holds(slot, key))
+		{
+			if(buffer[slot].removed)
+				throw std::out_of_range("there isn't element with that key");
+			discard(key);
+			return;
+		}
+
+		if(tree.find(key) == tree.end())
+			throw std::out_of_range("there isn't element with that key");
+		addEntry(slot, key, NodeHandle(), IN_TREE);
+	}
+
+	void remove(const const_iterator &it)
+	{
+		remove(it->first);
+	}
+
+	// the removal may merge the buffer, so the successor is looked up again by key
+	iterator erase(const const_iterator &it)
+	{
+		if(it == end())
+			throw std::out_of_range("out of range");
+
+		auto next = it;
+		++next;
+		if(next == end())
+		{
+			remove(it->first);
+			return end();
+		}
+
+		key_type nextKey = next->first;
+		remove(it->first);
+		return find(nextKey);
+	}
+
+	bool isEmpty() const
+	{
+		return getSize() == 0;
+	}
+
+	// exact; every blind write not merged yet costs a tree lookup
+	size_type getSize() const
+	{
+		size_t result = static_cast<size_t>(static_cast<std::ptrdiff_t>(tree.getSize()) + sizeDelta);
+		if(unresolved == 0)
+			return result;
+
+		for(const Entry &entry : buffer)
+		{
+			if(entry.inTree != UNKNOWN)
+				continue;
+			bool present = tree.find(entry.key) != tree.end();
+			if(entry.removed && present)
+				--result;
+			else if(!entry.removed && !present)
+				++result;
+		}
+		return result;
+	}
+
+	bool operator==(const BufferedTreeMap &other) const
+	{
+		if(getSize() != other.getSize())
+			return false;
+
+		for(auto &elem : other)
+		{
+			auto it = find(elem.first);
+			if(it == end() || !(it->second == elem.second))
+				return false;
+		}
+		return true;
+	}
+
+	bool operator!=(const BufferedTreeMap &other) const
+	{
+		return !(*this == other);
+	}
+
+	// of the tree alone, buffered writes aren't in it yet
+	TreeMapStats stats() const
+	{
+		return tree.stats();
+	}
+
+	void dumpStats(std::ostream &out) const
+	{
+		stats().writeJson(out);
+	}
+
+	void resetStats()
+	{
+		tree.resetStats();
+	}
+
+	size_t memoryUsage() const
+	{
+		size_t bytes = sizeof(*this) - sizeof(tree) + tree.memoryUsage();
+		if(buffer.capacity() > 0)
+			bytes += heapBlockSize(buffer.capacity() * sizeof(Entry));
+
+		for(const Entry &entry : buffer)
+		{
+			bytes += entry.node.memoryUsage();
+			if(MayOwnHeap<key_type, mapped_type>::value)
+			{
+				bytes += ownedBytes(entry.key);
+				if(!entry.removed)
+					bytes += ownedBytes(entry.node.key()) + ownedBytes(entry.node.mapped());
+			}
+		}
+		return bytes;
+	}
+
+	iterator begin()
+	{
+		return Iterator(cbegin());
+	}
+
+	iterator end()
+	{
+		return Iterator(cend());
+	}
+
+	const_iterator cbegin() const
+	{
+		return ConstIterator(this, tree.cbegin(), 0);
+	}
+
+	const_iterator cend() const
+	{
+		return ConstIterator(this, tree.cend(), buffer.size());
+	}
+
+	const_iterator begin() const
+	{
+		return cbegin();
+	}
+
+	const_iterator end() const
+	{
+		return cend();
+	}
+};
+
+// Walks the tree and the buffer side by side. Both positions are at the first
+// element not less than the current key; the buffer's entry wins a tie and
+// tombstones are stepped over together with the tree element they hide.
+template<typename KeyType, typename ValueType>
+class BufferedTreeMap<KeyType, ValueType>::ConstIterator
+{
+public:
+	using reference = typename BufferedTreeMap::const_reference;
+	using iterator_category = std::bidirectional_iterator_tag;
+	using value_type = typename BufferedTreeMap::value_type;
+	using pointer = const typename BufferedTreeMap::value_type *;
+
+	friend class BufferedTreeMap;
+
+private:
+	using TreeIterator = typename Tree::const_iterator;
+
+	const BufferedTreeMap *map = nullptr;
+	TreeIterator tree;
+	size_t buffered = 0;
+	bool inBuffer = false; // the current element is buffer[buffered]
+
+	// moves past tombstones and decides which side the current element is on
+	void settle()
+	{
+		const auto &buffer = map->buffer;
+		TreeIterator treeEnd = map->tree.cend();
+		inBuffer = false;
+		while(buffered < buffer.size())
+		{
+			const key_type &key = buffer[buffered].key;
+			bool treeFirst = tree != treeEnd && tree->first < key;
+			if(treeFirst)
+				return;
+			if(!buffer[buffered].removed)
+			{
+				inBuffer = true;
+				return;
+			}
+			if(tree != treeEnd && !(key < tree->first))
+				++tree;
+			++buffered;
+		}
+	}
+
+public:
+
+	explicit ConstIterator() : tree()
+	{}
+
+	ConstIterator(const BufferedTreeMap *map, const TreeIterator &tree, size_t buffered)
+		: map(map), tree(tree), buffered(buffered)
+	{
+		settle();
+	}
+
+	ConstIterator &operator++()
+	{
+		if(map == nullptr)
+			throw std::logic_error("collection not given to iterator");
+		if(!inBuffer && tree == map->tree.cend())
+			throw std::out_of_range("out of range incrementing");
+
+		if(inBuffer)
+		{
+			const key_type &key = map->buffer[buffered].key;
+			if(tree != map->tree.cend() && !(key < tree->first))
+				++tree;
+			++buffered;
+		}
+		else
+			++tree;
+		settle();
+		return *this;
+	}
+
+	ConstIterator operator++(int)
+	{
+		auto it = *this;
+		this->operator++();
+		return it;
+	}
+
+	ConstIterator &operator--()
+	{
+		if(map == nullptr)
+			throw std::logic_error("collection not given to iterator");
+
+		const auto &buffer = map->buffer;
+		TreeIterator treeBegin = map->tree.cbegin();
+		while(true)
+		{
+			bool hasTree = tree != treeBegin;
+			bool hasBuffer = buffered > 0;
+			if(!hasTree && !hasBuffer)
+				throw std::out_of_range("out of range decrementing");
+
+			TreeIterator previous = tree;
+			if(hasTree)
+				--previous;
+			const key_type *key = hasBuffer ? &buffer[buffered - 1].key : &previous->first;
+			if(hasTree && hasBuffer && *key < previous->first)
+				key = &previous->first;
+
+			bool moveBuffer = hasBuffer && !(buffer[buffered - 1].key < *key);
+			if(hasTree && !(previous->first < *key))
+				tree = previous;
+			if(!moveBuffer)
+			{
+				inBuffer = false;
+				return *this;
+			}
+			--buffered;
+			if(!buffer[buffered].removed)
+			{
+				inBuffer = true;
+				return *this;
+			}
+		}
+	}
+
+	ConstIterator operator--(int)
+	{
+		auto it = *this;
+		this->operator--();
+		return it;
+	}
+
+	reference operator*() const
+	{
+		if(map == nullptr)
+			throw std::out_of_range("out of range");
+		if(inBuffer)
+			return map->buffer[buffered].node.value();
+		return *tree;
+	}
+
+	pointer operator->() const
+	{
+		return &this->operator*();
+	}
+
+	bool operator==(const ConstIterator &other) const
+	{
+		return map == other.map && buffered == other.buffered && tree == other.tree;
+	}
+
+	bool operator!=(const ConstIterator &other) const
+	{
+		return !(*this == other);
+	}
+};
+
+template<typename KeyType, typename ValueType>
+class BufferedTreeMap<KeyType, ValueType>::Iterator : public BufferedTreeMap<KeyType, ValueType>::ConstIterator
+{
+public:
+	using reference = typename BufferedTreeMap::reference;
+	using pointer = typename BufferedTreeMap::value_type *;
+
+	explicit Iterator() = default;
+
+	explicit Iterator(const ConstIterator &other) : ConstIterator(other)
+	{}
+
+	Iterator &operator++()
+	{
+		ConstIterator::operator++();
+		return *this;
+	}
+
+	Iterator operator++(int)
+	{
+		auto result = *this;
+		ConstIterator::operator++();
+		return result;
+	}
+
+	Iterator &operator--()
+	{
+		ConstIterator::operator--();
+		return *this;
+	}
+
+	Iterator operator--(int)
+	{
+		auto result = *this;
+		ConstIterator::operator--();
+		return result;
+	}
+
+	pointer operator->() const
+	{
+		return &this->operator*();
+	}
+
+	reference operator*() const
+	{
+		// ugly cast, yet reduces code duplication.
+		return const_cast<reference>(ConstIterator::operator*());
+	}
+};
+
+}
+
+#endif /* AISDI_MAPS_BUFFEREDTREEMAP_H */
@@ -0,0 +1,903 @@
+#ifndef AISDI_MAPS_CONCURRENTSKIPLISTMAP_H
+#define AISDI_MAPS_CONCURRENTSKIPLISTMAP_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "MapStats.h"
+
+#define SKIPLIST_MAX_LEVEL 20
+#define EPOCH_SLOTS_PER_THREAD 4
+#define EPOCH_RETIRE_BATCH 64
+
+namespace aisdi
+{
+
+// the calling thread's id, mixed so that consecutive ids spread over the whole word
+inline uint64_t threadHash()
+{
+	thread_local uint64_t hash = static_cast<uint64_t>(std::hash<std::thread::id>{}(std::this_thread::get_id()))
+	                             * 0x9E3779B97F4A7C15ull;
+	return hash;
+}
+
+// Epoch based reclamation of memory unlinked from a concurrent structure. Whoever
+// follows pointers into the structure holds a Pin on the epoch current when it
+// started; memory retired in epoch e is freed once the epoch is e + 2, which it
+// can only reach after every pin has seen e + 1. Pins claim one of a fixed array
+// of slots rather than living in thread locals, so an iterator holding one may
+// move to another thread, and the slots also stripe an element counter, so that
+// writers on different threads don't all bump one cache line.
+class EpochDomain
+{
+	static const uint64_t IDLE = ~uint64_t(0);
+
+	struct Retired
+	{
+		void *object;
+		void (*destroy)(void *);
+		uint64_t epoch;
+	};
+
+	struct Fields
+	{
+		std::atomic<uint64_t> pinned{IDLE};
+		std::atomic<long> count{0};
+		std::vector<Retired> retired; // only touched by the slot's holder
+	};
+
+	// 128 bytes apart, so neither a slot's line nor its prefetched pair is shared
+	struct Slot : Fields
+	{
+		char padding[128 - sizeof(Fields) % 128];
+	};
+
+	std::atomic<uint64_t> epoch{2};
+	std::unique_ptr<Slot[]> slots;
+	size_t slotMask;
+	// pins that found every slot taken; while there are any the epoch stays
+	std::atomic<size_t> unslotted{0};
+	std::atomic<long> unslottedCount{0};
+	std::mutex unslottedLock;
+	std::vector<Retired> unslottedRetired;
+
+	void tryAdvance()
+	{
+		uint64_t current = epoch.load();
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(unslotted.load() != 0)
+			return;
+		for(size_t i = 0; i <= slotMask; ++i)
+		{
+			uint64_t pinned = slots[i].pinned.load();
+			if(pinned != IDLE && pinned != current)
+				return;
+		}
+		epoch.compare_exchange_strong(current, current + 1);
+	}
+
+	void collect(std::vector<Retired> &retired)
+	{
+		tryAdvance();
+		uint64_t current = epoch.load();
+		auto kept = std::partition(retired.begin(), retired.end(),
+		                           [current](const Retired &entry) { return entry.epoch + 2 > current; });
+		for(auto it = kept; it != retired.end(); ++it)
+			it->destroy(it->object);
+		retired.erase(kept, retired.end());
+	}
+
+	static void destroyAll(std::vector<Retired> &retired)
+	{
+		for(const Retired &entry : retired)
+			entry.destroy(entry.object);
+		retired.clear();
+	}
+
+public:
+	class Pin;
+
+	EpochDomain()
+	{
+		size_t wanted = std::max<size_t>(std::thread::hardware_concurrency(), 1) * EPOCH_SLOTS_PER_THREAD;
+		size_t count = 16;
+		while(count < wanted)
+			count *= 2;
+		slots.reset(new Slot[count]);
+		slotMask = count - 1;
+	}
+
+	EpochDomain(const EpochDomain &) = delete;
+	EpochDomain &operator=(const EpochDomain &) = delete;
+
+	// nothing may hold a pin any more
+	~EpochDomain()
+	{
+		for(size_t i = 0; i <= slotMask; ++i)
+			destroyAll(slots[i].retired);
+		destroyAll(unslottedRetired);
+	}
+
+	// sum of what pins added to the counter; exact only while nobody adds
+	long count() const
+	{
+		long sum = unslottedCount.load(std::memory_order_relaxed);
+		for(size_t i = 0; i <= slotMask; ++i)
+			sum += slots[i].count.load(std::memory_order_relaxed);
+		return sum;
+	}
+
+	size_t memoryUsage() const
+	{
+		size_t bytes = heapBlockSize((slotMask + 1) * sizeof(Slot));
+		for(size_t i = 0; i <= slotMask; ++i)
+		{
+			if(slots[i].retired.capacity() > 0)
+				bytes += heapBlockSize(slots[i].retired.capacity() * sizeof(Retired));
+		}
+		return bytes;
+	}
+};
+
+// Keeps what the domain's structure pointed to at pinning time from being freed
+// while it lives. Copies pin anew.
+class EpochDomain::Pin
+{
+	static const size_t NO_SLOT = ~size_t(0);
+
+	EpochDomain *domain = nullptr;
+	size_t slot = NO_SLOT;
+
+	void acquire()
+	{
+		size_t start = static_cast<size_t>(threadHash() >> 32);
+		for(size_t i = 0; i <= domain->slotMask; ++i)
+		{
+			size_t index = (start + i) & domain->slotMask;
+			std::atomic<uint64_t> &pinned = domain->slots[index].pinned;
+			uint64_t expected = IDLE;
+			if(pinned.load(std::memory_order_relaxed) == IDLE
+			   && pinned.compare_exchange_strong(expected, domain->epoch.load()))
+			{
+				slot = index;
+				// the pin has to be seen before anything is read through the structure
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				return;
+			}
+		}
+		slot = NO_SLOT;
+		domain->unslotted.fetch_add(1);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+
+	void release()
+	{
+		if(slot != NO_SLOT)
+			domain->slots[slot].pinned.store(IDLE, std::memory_order_release);
+		else
+			domain->unslotted.fetch_sub(1, std::memory_order_release);
+		domain = nullptr;
+	}
+
+public:
+	Pin() = default; // pins nothing
+
+	explicit Pin(EpochDomain &domain) : domain(&domain)
+	{
+		acquire();
+	}
+
+	Pin(const Pin &other) : domain(other.domain)
+	{
+		if(domain != nullptr)
+			acquire();
+	}
+
+	Pin(Pin &&other) noexcept : domain(other.domain), slot(other.slot)
+	{
+		other.domain = nullptr;
+	}
+
+	Pin &operator=(Pin other) noexcept
+	{
+		std::swap(domain, other.domain);
+		std::swap(slot, other.slot);
+		return *this;
+	}
+
+	~Pin()
+	{
+		if(domain != nullptr)
+			release();
+	}
+
+	// object is passed to destroy once no pin taken before now is left
+	void retire(void *object, void (*destroy)(void *)) const
+	{
+		// the unlink has to be seen before the epoch it is stamped with is read
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		Retired entry{object, destroy, domain->epoch.load()};
+		if(slot != NO_SLOT)
+		{
+			std::vector<Retired> &retired = domain->slots[slot].retired;
+			retired.push_back(entry);
+			if(retired.size() >= EPOCH_RETIRE_BATCH)
+				domain->collect(retired);
+			return;
+		}
+		std::lock_guard<std::mutex> lock(domain->unslottedLock);
+		domain->unslottedRetired.push_back(entry);
+		if(domain->unslottedRetired.size() >= EPOCH_RETIRE_BATCH)
+			domain->collect(domain->unslottedRetired);
+	}
+
+	void addCount(long delta) const
+	{
+		std::atomic<long> &count = slot != NO_SLOT ? domain->slots[slot].count : domain->unslottedCount;
+		count.fetch_add(delta, std::memory_order_relaxed);
+	}
+};
+
+// Ordered map for concurrent readers and writers: the lazy skip list of Herlihy,
+// Lev, Luchangco and Shavit. Lookups and iteration take no locks; insert and
+// remove lock only the predecessors of the node they link or unlink, so writers
+// of keys far apart never meet, and nothing is rebalanced. A node is in the map
+// once it is fully linked and until it is marked; readers skip the others.
+// Unlinked nodes are freed through an EpochDomain once no reader can hold them.
+//
+// Values are replaced whole: assign() swaps in a new copy, so a reader sees the
+// old value or the new one, never half a write. There is no operator[] or
+// writable valueOf, since a reference handed out couldn't be kept from changing
+// under other readers; valueOf returns a copy. Iterators pin the epoch while they
+// live, so what they point to stays valid however the map changes (and nothing
+// retired meanwhile is freed, so don't keep them long), and are weakly
+// consistent: a walk sees every element there for all of it, in order, and maybe
+// some of those inserted or removed meanwhile. getSize() is exact only while no
+// writer runs. Copying, assigning and destroying a map need it to be quiescent.
+template<typename KeyType, typename ValueType>
+class ConcurrentSkipListMap
+{
+public:
+	using key_type = KeyType;
+	using mapped_type = ValueType;
+	using value_type = std::pair<const key_type, mapped_type>;
+	using size_type = std::size_t;
+	using const_reference = std::pair<const key_type &, const mapped_type &>;
+	using reference = const_reference;
+
+	class ConstIterator;
+
+	using const_iterator = ConstIterator;
+	using iterator = ConstIterator;
+
+private:
+	// the key and the value it was inserted with; the head has none
+	struct Element
+	{
+		key_type key;
+		mapped_type value;
+	};
+
+	// followed in the same allocation by std::atomic<Node *> next[topLevel + 1]
+	struct Node
+	{
+		std::atomic<const mapped_type *> value{nullptr};
+		std::atomic<bool> marked{false};
+		std::atomic<bool> fullyLinked{false};
+		std::atomic<bool> locked{false};
+		int topLevel;
+		typename std::aligned_storage<sizeof(Element), alignof(Element)>::type element;
+
+		explicit Node(int topLevel) : topLevel(topLevel)
+		{}
+
+		std::atomic<Node *> *next()
+		{
+			return reinterpret_cast<std::atomic<Node *> *>(this + 1);
+		}
+
+		const key_type &key() const
+		{
+			return reinterpret_cast<const Element *>(&element)->key;
+		}
+
+		const mapped_type *initialValue() const
+		{
+			return &reinterpret_cast<const Element *>(&element)->value;
+		}
+
+		void lock()
+		{
+			while(locked.exchange(true, std::memory_order_acquire))
+			{
+				while(locked.load(std::memory_order_relaxed))
+					std::this_thread::yield();
+			}
+		}
+
+		void unlock()
+		{
+			locked.store(false, std::memory_order_release);
+		}
+	};
+
+	static_assert(alignof(Node) <= alignof(std::max_align_t), "nodes are allocated by operator new");
+
+	std::unique_ptr<EpochDomain> domain;
+	Node *head;
+
+	static size_t nodeBytes(int topLevel)
+	{
+		return sizeof(Node) + (topLevel + 1) * sizeof(std::atomic<Node *>);
+	}
+
+	static Node *allocateNode(int topLevel)
+	{
+		Node *node = new(::operator new(nodeBytes(topLevel))) Node(topLevel);
+		for(int level = 0; level <= topLevel; ++level)
+			new(&node->next()[level]) std::atomic<Node *>(nullptr);
+		return node;
+	}
+
+	static Node *makeNode(const key_type &key, const mapped_type &value, int topLevel)
+	{
+		Node *node = allocateNode(topLevel);
+		try
+		{
+			new(&node->element) Element{key, value};
+		}
+		catch(...)
+		{
+			::operator delete(node);
+			throw;
+		}
+		node->value.store(node->initialValue(), std::memory_order_relaxed);
+		return node;
+	}
+
+	static void destroyNode(void *object)
+	{
+		Node *node = static_cast<Node *>(object);
+		const mapped_type *value = node->value.load(std::memory_order_relaxed);
+		if(value != node->initialValue())
+			delete value;
+		reinterpret_cast<Element *>(&node->element)->~Element();
+		node->~Node();
+		::operator delete(node);
+	}
+
+	static void destroyValue(void *value)
+	{
+		delete static_cast<mapped_type *>(value);
+	}
+
+	static bool isPresent(const Node *node)
+	{
+		return node->fullyLinked.load(std::memory_order_acquire) && !node->marked.load(std::memory_order_acquire);
+	}
+
+	// levels from 0 to SKIPLIST_MAX_LEVEL - 1, each one a quarter as likely as the last
+	static int randomLevel()
+	{
+		thread_local uint64_t state = threadHash() | 1;
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		int level = 0;
+		for(uint64_t bits = state; (bits & 3) == 0 && level < SKIPLIST_MAX_LEVEL - 1; bits >>= 2)
+			++level;
+		return level;
+	}
+
+	// Fills in, on every level, the last node before key and the one after it.
+	// Returns the highest level the node holding key was met on, or -1.
+	int findPath(const key_type &key, Node **preds, Node **succs) const
+	{
+		int found = -1;
+		Node *pred = head;
+		for(int level = SKIPLIST_MAX_LEVEL - 1; level >= 0; --level)
+		{
+			Node *current = pred->next()[level].load(std::memory_order_acquire);
+			while(current != nullptr && current->key() < key)
+			{
+				pred = current;
+				current = pred->next()[level].load(std::memory_order_acquire);
+			}
+			if(found == -1 && current != nullptr && !(key < current->key()))
+				found = level;
+			preds[level] = pred;
+			succs[level] = current;
+		}
+		return found;
+	}
+
+	// the first node not before key, whether in the map or not
+	Node *lowerBoundNode(const key_type &key) const
+	{
+		Node *pred = head;
+		Node *current = nullptr;
+		for(int level = SKIPLIST_MAX_LEVEL - 1; level >= 0; --level)
+		{
+			current = pred->next()[level].load(std::memory_order_acquire);
+			while(current != nullptr && current->key() < key)
+			{
+				pred = current;
+				current = pred->next()[level].load(std::memory_order_acquire);
+			}
+			if(current != nullptr && !(key < current->key()))
+				return current;
+		}
+		return current;
+	}
+
+	static Node *presentFrom(Node *node)
+	{
+		while(node != nullptr && !isPresent(node))
+			node = node->next()[0].load(std::memory_order_acquire);
+		return node;
+	}
+
+	static Node *presentFromNext(Node *node)
+	{
+		do
+			node = node->next()[0].load(std::memory_order_acquire);
+		while(node != nullptr && !isPresent(node));
+		return node;
+	}
+
+	Node *findNode(const key_type &key) const
+	{
+		Node *node = lowerBoundNode(key);
+		return node != nullptr && !(key < node->key()) && isPresent(node) ? node : nullptr;
+	}
+
+	// preds locked by a failed or finished update, levels 0 to highestLocked
+	static void unlockPreds(Node **preds, int highestLocked)
+	{
+		Node *previous = nullptr;
+		for(int level = 0; level <= highestLocked; ++level)
+		{
+			if(preds[level] != previous)
+			{
+				preds[level]->unlock();
+				previous = preds[level];
+			}
+		}
+	}
+
+	// false if the node was removed meanwhile
+	static bool replaceValue(const EpochDomain::Pin &pin, Node *node, const mapped_type &value)
+	{
+		std::unique_ptr<mapped_type> fresh(new mapped_type(value));
+		node->lock();
+		if(node->marked.load(std::memory_order_relaxed))
+		{
+			node->unlock();
+			return false;
+		}
+		const mapped_type *old = node->value.exchange(fresh.release(), std::memory_order_acq_rel);
+		node->unlock();
+		if(old != node->initialValue())
+			pin.retire(const_cast<mapped_type *>(old), destroyValue);
+		return true;
+	}
+
+	// Links a node for key unless the key is there; then overwrite decides whether
+	// the present node takes the value. Returns whether a node was linked.
+	bool put(const key_type &key, const mapped_type &value, bool overwrite)
+	{
+		EpochDomain::Pin pin(*domain);
+		int topLevel = randomLevel();
+		Node *preds[SKIPLIST_MAX_LEVEL];
+		Node *succs[SKIPLIST_MAX_LEVEL];
+		Node *node = nullptr;
+		while(true)
+		{
+			int found = findPath(key, preds, succs);
+			if(found != -1)
+			{
+				Node *existing = succs[found];
+				if(!existing->marked.load(std::memory_order_acquire))
+				{
+					// being linked by another insert, which comes first then
+					while(!existing->fullyLinked.load(std::memory_order_acquire))
+						std::this_thread::yield();
+					if(!overwrite || replaceValue(pin, existing, value))
+					{
+						if(node != nullptr)
+							destroyNode(node); // never published
+						return false;
+					}
+				}
+				continue; // removed under us, wait until it's unlinked
+			}
+
+			if(node == nullptr)
+				node = makeNode(key, value, topLevel);
+
+			int highestLocked = -1;
+			Node *previous = nullptr;
+			bool valid = true;
+			for(int level = 0; valid && level <= topLevel; ++level)
+			{
+				Node *pred = preds[level];
+				Node *succ = succs[level];
+				if(pred != previous)
+				{
+					pred->lock();
+					highestLocked = level;
+					previous = pred;
+				}
+				valid = !pred->marked.load(std::memory_order_acquire)
+				        && (succ == nullptr || !succ->marked.load(std::memory_order_acquire))
+				        && pred->next()[level].load(std::memory_order_acquire) == succ;
+			}
+			if(!valid)
+			{
+				unlockPreds(preds, highestLocked);
+				continue;
+			}
+
+			for(int level = 0; level <= topLevel; ++level)
+				node->next()[level].store(succs[level], std::memory_order_relaxed);
+			for(int level = 0; level <= topLevel; ++level)
+				preds[level]->next()[level].store(node, std::memory_order_release);
+			node->fullyLinked.store(true, std::memory_order_release);
+			unlockPreds(preds, highestLocked);
+			pin.addCount(1);
+			return true;
+		}
+	}
+
+	void destroyNodes()
+	{
+		Node *node = head->next()[0].load(std::memory_order_relaxed);
+		while(node != nullptr)
+		{
+			Node *next = node->next()[0].load(std::memory_order_relaxed);
+			destroyNode(node);
+			node = next;
+		}
+		head->~Node();
+		::operator delete(head);
+	}
+
+public:
+	ConcurrentSkipListMap() : domain(new EpochDomain()), head(allocateNode(SKIPLIST_MAX_LEVEL - 1))
+	{}
+
+	ConcurrentSkipListMap(std::initializer_list<value_type> list) : ConcurrentSkipListMap()
+	{
+		for(const value_type &value : list)
+			assign(value.first, value.second);
+	}
+
+	ConcurrentSkipListMap(const ConcurrentSkipListMap &other) : ConcurrentSkipListMap()
+	{
+		for(auto it = other.begin(); it != other.end(); ++it)
+			insert(it->first, it->second);
+	}
+
+	ConcurrentSkipListMap(ConcurrentSkipListMap &&other) : ConcurrentSkipListMap()
+	{
+		std::swap(domain, other.domain);
+		std::swap(head, other.head);
+	}
+
+	~ConcurrentSkipListMap()
+	{
+		if(head != nullptr)
+			destroyNodes();
+	}
+
+	ConcurrentSkipListMap &operator=(ConcurrentSkipListMap other)
+	{
+		std::swap(domain, other.domain);
+		std::swap(head, other.head);
+		return *this;
+	}
+
+	bool isEmpty() const
+	{
+		EpochDomain::Pin pin(*domain);
+		return presentFrom(head->next()[0].load(std::memory_order_acquire)) == nullptr;
+	}
+
+	size_type getSize() const
+	{
+		long count = domain->count();
+		return count > 0 ? static_cast<size_type>(count) : 0;
+	}
+
+	// adds the element unless key is there already; returns whether it was added
+	bool insert(const key_type &key, const mapped_type &value)
+	{
+		return put(key, value, false);
+	}
+
+	// adds the element or replaces the value key has
+	void assign(const key_type &key, const mapped_type &value)
+	{
+		put(key, value, true);
+	}
+
+	mapped_type valueOf(const key_type &key) const
+	{
+		EpochDomain::Pin pin(*domain);
+		Node *node = findNode(key);
+		if(node == nullptr)
+			throw std::out_of_range("key doesn't exist");
+		return *node->value.load(std::memory_order_acquire);
+	}
+
+	bool contains(const key_type &key) const
+	{
+		EpochDomain::Pin pin(*domain);
+		return findNode(key) != nullptr;
+	}
+
+	const_iterator find(const key_type &key) const
+	{
+		EpochDomain::Pin pin(*domain);
+		Node *node = findNode(key);
+		return node != nullptr ? ConstIterator(std::move(pin), node) : cend();
+	}
+
+	// the first element whose key isn't less than key
+	const_iterator lowerBound(const key_type &key) const
+	{
+		EpochDomain::Pin pin(*domain);
+		Node *node = presentFrom(lowerBoundNode(key));
+		return node != nullptr ? ConstIterator(std::move(pin), node) : cend();
+	}
+
+	const_iterator lower_bound(const key_type &key) const
+	{
+		return lowerBound(key);
+	}
+
+	// Calls visit(key, value) for the elements with keys in [from, to), in order,
+	// under a single pin; as weakly consistent as iteration.
+	template<typename Visit>
+	void forEachInRange(const key_type &from, const key_type &to, Visit visit) const
+	{
+		EpochDomain::Pin pin(*domain);
+		for(Node *node = lowerBoundNode(from); node != nullptr && node->key() < to;
+		    node = node->next()[0].load(std::memory_order_acquire))
+		{
+			if(isPresent(node))
+				visit(node->key(), *node->value.load(std::memory_order_acquire));
+		}
+	}
+
+	// Unlinks the node holding key; returns false if there is none. Concurrent
+	// removes of one key see exactly one of them succeed.
+	bool discard(const key_type &key)
+	{
+		EpochDomain::Pin pin(*domain);
+		Node *preds[SKIPLIST_MAX_LEVEL];
+		Node *succs[SKIPLIST_MAX_LEVEL];
+		Node *victim = nullptr;
+		int topLevel = -1;
+		while(true)
+		{
+			int found = findPath(key, preds, succs);
+			if(victim == nullptr)
+			{
+				if(found == -1)
+					return false;
+				Node *candidate = succs[found];
+				// one still being linked wasn't there yet
+				if(!candidate->fullyLinked.load(std::memory_order_acquire) || candidate->topLevel != found
+				   || candidate->marked.load(std::memory_order_acquire))
+					return false;
+				candidate->lock();
+				if(candidate->marked.load(std::memory_order_relaxed))
+				{
+					candidate->unlock();
+					return false;
+				}
+				candidate->marked.store(true, std::memory_order_release);
+				victim = candidate;
+				topLevel = victim->topLevel;
+			}
+
+			int highestLocked = -1;
+			Node *previous = nullptr;
+			bool valid = true;
+			for(int level = 0; valid && level <= topLevel; ++level)
+			{
+				Node *pred = preds[level];
+				if(pred != previous)
+				{
+					pred->lock();
+					highestLocked = level;
+					previous = pred;
+				}
+				valid = !pred->marked.load(std::memory_order_acquire)
+				        && pred->next()[level].load(std::memory_order_acquire) == victim;
+			}
+			if(!valid)
+			{
+				unlockPreds(preds, highestLocked);
+				continue;
+			}
+
+			for(int level = topLevel; level >= 0; --level)
+				preds[level]->next()[level].store(victim->next()[level].load(std::memory_order_relaxed),
+				                                  std::memory_order_release);
+			victim->unlock();
+			unlockPreds(preds, highestLocked);
+			pin.addCount(-1);
+			pin.retire(victim, destroyNode);
+			return true;
+		}
+	}
+
+	void remove(const key_type &key)
+	{
+		if(!discard(key))
+			throw std::out_of_range("key doesn't exist");
+	}
+
+	void remove(const const_iterator &it)
+	{
+		if(it == end())
+			throw std::out_of_range("out of range");
+		discard(it->first);
+	}
+
+	// element by element, each compared while both maps may change
+	bool operator==(const ConcurrentSkipListMap &other) const
+	{
+		if(getSize() != other.getSize())
+			return false;
+		for(auto it = other.begin(); it != other.end(); ++it)
+		{
+			auto found = find(it->first);
+			if(found == end() || !(found->second == it->second))
+				return false;
+		}
+		return true;
+	}
+
+	bool operator!=(const ConcurrentSkipListMap &other) const
+	{
+		return !(*this == other);
+	}
+
+	// nodes in the map and what the epoch domain holds, not values waiting to be freed
+	size_t memoryUsage() const
+	{
+		EpochDomain::Pin pin(*domain);
+		size_t bytes = sizeof(*this) + heapBlockSize(sizeof(EpochDomain)) + domain->memoryUsage()
+		               + heapBlockSize(nodeBytes(head->topLevel));
+		for(Node *node = head->next()[0].load(std::memory_order_acquire); node != nullptr;
+		    node = node->next()[0].load(std::memory_order_acquire))
+		{
+			const mapped_type *value = node->value.load(std::memory_order_acquire);
+			bytes += heapBlockSize(nodeBytes(node->topLevel)) + ownedBytes(node->key()) + ownedBytes(*value);
+			if(value != node->initialValue())
+				bytes += heapBlockSize(sizeof(mapped_type));
+		}
+		return bytes;
+	}
+
+	const_iterator cbegin() const
+	{
+		EpochDomain::Pin pin(*domain);
+		Node *node = presentFrom(head->next()[0].load(std::memory_order_acquire));
+		return node != nullptr ? ConstIterator(std::move(pin), node) : cend();
+	}
+
+	const_iterator cend() const
+	{
+		return ConstIterator();
+	}
+
+	const_iterator begin() const
+	{
+		return cbegin();
+	}
+
+	const_iterator end() const
+	{
+		return cend();
+	}
+};
+
+template<typename KeyType, typename ValueType>
+class ConcurrentSkipListMap<KeyType, ValueType>::ConstIterator
+{
+public:
+	using reference = typename ConcurrentSkipListMap::const_reference;
+	using iterator_category = std::forward_iterator_tag;
+	using value_type = typename ConcurrentSkipListMap::value_type;
+	using difference_type = std::ptrdiff_t;
+
+	// the value lives apart from the key once assigned, so -> hands out a temporary
+	// pair of references
+	class pointer
+	{
+		reference entry;
+
+	public:
+		explicit pointer(reference entry) : entry(entry)
+		{}
+
+		const reference *operator->() const
+		{
+			return &entry;
+		}
+	};
+
+	friend class ConcurrentSkipListMap;
+
+private:
+	EpochDomain::Pin pin; // held by iterators not at the end
+	Node *node = nullptr;
+
+	ConstIterator(EpochDomain::Pin pin, Node *node) : pin(std::move(pin)), node(node)
+	{}
+
+public:
+	ConstIterator() = default;
+
+	ConstIterator &operator++()
+	{
+		if(node == nullptr)
+			throw std::out_of_range("out of range incrementing");
+		// a node removed meanwhile still leads on to greater keys
+		node = ConcurrentSkipListMap::presentFromNext(node);
+		if(node == nullptr)
+			pin = EpochDomain::Pin();
+		return *this;
+	}
+
+	ConstIterator operator++(int)
+	{
+		auto it = *this;
+		operator++();
+		return it;
+	}
+
+	// the value as of now; references stay valid while the iterator lives
+	reference operator*() const
+	{
+		if(node == nullptr)
+			throw std::out_of_range("out of range");
+		return reference(node->key(), *node->value.load(std::memory_order_acquire));
+	}
+
+	pointer operator->() const
+	{
+		return pointer(operator*());
+	}
+
+	bool operator==(const ConstIterator &other) const
+	{
+		return node == other.node;
+	}
+
+	bool operator!=(const ConstIterator &other) const
+	{
+		return !(*this == other);
+	}
+};
+
+}
+
+#endif /* AISDI_MAPS_CONCURRENTSKIPLISTMAP_H */
@@ -0,0 +1,988 @@
+#ifndef AISDI_MAPS_FLATHASHMAP_H
+#define AISDI_MAPS_FLATHASHMAP_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <limits>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "HashMap.h"
+
+#define FLAT_MIN_CAPACITY 8
+
+namespace aisdi
+{
+
+// Open addressing with linear probing for integer keys and trivially copyable
+// values, chosen with HashMap<K, V, true> or FlatHashMap<K, V>.
+//
+// Elements live in the table itself: an insert that grows the table moves all of
+// them and an erase shifts the ones after it, so references, pointers and iterators
+// are invalidated by any insert of a new key and by any remove, except that erase()
+// returns a valid iterator to go on with.
+//
+// keys[] is a dense array that probes scan; a slot is free when it holds emptyKey().
+// entries[] keeps the key/value pair of every used slot next to it, so iterators hand
+// out value_type references exactly like the chained map. The one element whose key
+// equals emptyKey() is kept aside in the extra entries[slotCount].
+//
+// Probes never wrap around: the capacity home slots are followed by a short tail of
+// overflow slots, and a probe that runs off the tail grows the table. Erase shifts
+// the following entries back instead of leaving tombstones; entries only ever move
+// to lower slots, so erasing while iterating still visits everything exactly once.
+template<typename KeyType, typename ValueType>
+class HashMap<KeyType, ValueType, true>
+{
+	static_assert(UseFlatStorage<KeyType, ValueType>::value,
+	              "the flat layout takes integer keys and trivially copyable values");
+
+public:
+	using key_type = KeyType;
+	using mapped_type = ValueType;
+	using value_type = std::pair<const key_type, mapped_type>;
+	using size_type = std::size_t;
+	using reference = value_type &;
+	using const_reference = const value_type &;
+
+	class ConstIterator;
+
+	class Iterator;
+
+	class NodeHandle;
+
+	using iterator = Iterator;
+	using const_iterator = ConstIterator;
+	using node_type = NodeHandle;
+
+private:
+	struct Slot
+	{
+		alignas(value_type) unsigned char bytes[sizeof(value_type)];
+	};
+
+	struct Layout
+	{
+		size_t homeSlots;
+		size_t tail;
+	};
+
+	size_t homeSlots = 0; // a power of two; 0 until the first insert
+	size_t slotCount = 0; // home slots and the overflow tail
+	int shift = 64;       // home(key) keeps the top log2(homeSlots) bits of the hash
+	size_t addedElements = 0;
+	bool hasEmptyKeyEntry = false;
+	std::unique_ptr<key_type[]> keys;
+	std::unique_ptr<Slot[]> entries;
+	MAP_STATS(mutable HashMapCounters counters;)
+
+	static key_type emptyKey()
+	{
+		return std::numeric_limits<key_type>::max();
+	}
+
+	static int log2(size_t value)
+	{
+		int result = 0;
+		while(value >>= 1)
+			++result;
+		return result;
+	}
+
+	static size_t defaultTail(size_t homeSlots)
+	{
+		return 2 * log2(homeSlots) + 8;
+	}
+
+	static size_t roundCapacity(size_t requested)
+	{
+		size_t result = FLAT_MIN_CAPACITY;
+		while(result < requested)
+			result *= 2;
+		return result;
+	}
+
+	static void prefetch(const void *address)
+	{
+#if defined(__GNUC__)
+		__builtin_prefetch(address);
+#else
+		(void)address;
+#endif
+	}
+
+	explicit HashMap(Layout layout)
+	{
+		allocate(layout.homeSlots, layout.tail);
+	}
+
+	void allocate(size_t newCapacity, size_t tail)
+	{
+		std::unique_ptr<key_type[]> newKeys(new key_type[newCapacity + tail]);
+		std::unique_ptr<Slot[]> newEntries(new Slot[newCapacity + tail + 1]);
+		std::fill(newKeys.get(), newKeys.get() + newCapacity + tail, emptyKey());
+
+		keys = std::move(newKeys);
+		entries = std::move(newEntries);
+		homeSlots = newCapacity;
+		slotCount = newCapacity + tail;
+		shift = 64 - log2(newCapacity);
+	}
+
+	// Fibonacci hashing: std::hash of an integer is the integer itself, so the
+	// multiplication is what spreads consecutive keys over the table
+	size_t home(const key_type &key) const
+	{
+		uint64_t hash = static_cast<uint64_t>(std::hash<key_type>{}(key));
+		return static_cast<size_t>((hash * 0x9E3779B97F4A7C15ull) >> shift);
+	}
+
+	value_type &entryAt(size_t slot) const
+	{
+		return *reinterpret_cast<value_type *>(entries[slot].bytes);
+	}
+
+	bool isUsed(size_t slot) const
+	{
+		if(slot == slotCount)
+			return hasEmptyKeyEntry;
+		return keys[slot] != emptyKey();
+	}
+
+	size_t endSlot() const
+	{
+		return slotCount + 1;
+	}
+
+	size_t nextUsed(size_t slot) const
+	{
+		for(++slot; slot < slotCount; ++slot)
+		{
+			if(keys[slot] != emptyKey())
+				return slot;
+		}
+		return hasEmptyKeyEntry && slot == slotCount ? slotCount : endSlot();
+	}
+
+	size_t firstUsed() const
+	{
+		if(addedElements == 0)
+			return endSlot();
+		for(size_t slot = 0; slot < slotCount; ++slot)
+		{
+			if(keys[slot] != emptyKey())
+				return slot;
+		}
+		return slotCount;
+	}
+
+	// slot holding key, endSlot() if there is none
+	size_t findSlot(const key_type &key) const
+	{
+		MAP_STATS(++counters.lookups;)
+		if(key == emptyKey())
+		{
+			MAP_STATS(counters.lookupHits += hasEmptyKeyEntry;)
+			return hasEmptyKeyEntry ? slotCount : endSlot();
+		}
+		if(homeSlots == 0)
+			return endSlot();
+
+		for(size_t slot = home(key); slot < slotCount; ++slot)
+		{
+			MAP_STATS(++counters.probes;)
+			if(keys[slot] == key)
+			{
+				MAP_STATS(++counters.lookupHits;)
+				return slot;
+			}
+			if(keys[slot] == emptyKey())
+				break;
+		}
+		return endSlot();
+	}
+
+	// first free slot of key's probe sequence, slotCount if it runs off the tail
+	size_t freeSlotFor(const key_type &key) const
+	{
+		for(size_t slot = home(key); slot < slotCount; ++slot)
+		{
+			if(keys[slot] == emptyKey())
+				return slot;
+		}
+		return slotCount;
+	}
+
+	bool place(const value_type &value)
+	{
+		size_t slot = freeSlotFor(value.first);
+		if(slot == slotCount)
+			return false;
+
+		keys[slot] = value.first;
+		new (entries[slot].bytes) value_type(value);
+		return true;
+	}
+
+	void swapStorage(HashMap &other)
+	{
+		std::swap(homeSlots, other.homeSlots);
+		std::swap(slotCount, other.slotCount);
+		std::swap(shift, other.shift);
+		std::swap(addedElements, other.addedElements);
+		std::swap(hasEmptyKeyEntry, other.hasEmptyKeyEntry);
+		std::swap(keys, other.keys);
+		std::swap(entries, other.entries);
+	}
+
+	void rehash(size_t newCapacity, size_t tail)
+	{
+		while(true)
+		{
+			HashMap resized(Layout{newCapacity, tail});
+			bool fits = true;
+			for(size_t slot = 0; slot < slotCount && fits; ++slot)
+			{
+				if(keys[slot] != emptyKey())
+					fits = resized.place(entryAt(slot));
+			}
+
+			if(fits)
+			{
+				if(hasEmptyKeyEntry)
+					new (resized.entries[resized.slotCount].bytes) value_type(entryAt(slotCount));
+				resized.hasEmptyKeyEntry = hasEmptyKeyEntry;
+				resized.addedElements = addedElements;
+				swapStorage(resized);
+				return;
+			}
+			tail *= 2;
+		}
+	}
+
+	// a probe ran off the tail: a crowded table doubles, a sparse one only gets a
+	// longer tail, so unlucky clusters can't blow up the capacity
+	void grow()
+	{
+		if(addedElements * 2 >= homeSlots)
+			rehash(homeSlots * 2, defaultTail(homeSlots * 2));
+		else
+			rehash(homeSlots, 2 * (slotCount - homeSlots));
+	}
+
+	// inserts a key that isn't present yet and returns its slot
+	size_t insert(const value_type &value)
+	{
+		if(homeSlots == 0)
+			allocate(FLAT_MIN_CAPACITY, defaultTail(FLAT_MIN_CAPACITY));
+
+		size_t slot = slotCount;
+		if(value.first != emptyKey())
+		{
+			if((addedElements + 1) * 4 > homeSlots * 3)
+				rehash(homeSlots * 2, defaultTail(homeSlots * 2));
+			while( (slot = freeSlotFor(value.first)) == slotCount )
+				grow();
+			keys[slot] = value.first;
+		}
+		else
+			hasEmptyKeyEntry = true;
+
+		new (entries[slot].bytes) value_type(value);
+		++addedElements;
+		MAP_STATS(++counters.inserts;)
+		return slot;
+	}
+
+	// backward-shift deletion: later entries of the cluster that may live in the
+	// hole move into it, until the cluster ends
+	void eraseSlot(size_t hole)
+	{
+		--addedElements;
+		MAP_STATS(++counters.removes;)
+		if(hole == slotCount)
+		{
+			hasEmptyKeyEntry = false;
+			return;
+		}
+
+		for(size_t next = hole + 1; next < slotCount && keys[next] != emptyKey(); ++next)
+		{
+			if(home(keys[next]) <= hole)
+			{
+				keys[hole] = keys[next];
+				new (entries[hole].bytes) value_type(entryAt(next));
+				hole = next;
+			}
+		}
+		keys[hole] = emptyKey();
+	}
+
+	// same as the chained map's lookupBatch: a group of keys gets its home slots
+	// prefetched before any of them is probed; found(i, slot) gets endSlot() on a miss
+	template<typename Found>
+	void lookupBatch(const key_type *batch, size_t count, Found found) const
+	{
+		if(homeSlots == 0)
+		{
+			for(size_t i = 0; i < count; ++i)
+				found(i, findSlot(batch[i]));
+			return;
+		}
+
+		for(size_t first = 0; first < count; first += LOOKUP_BATCH)
+		{
+			size_t group = std::min<size_t>(LOOKUP_BATCH, count - first);
+
+			for(size_t j = 0; j < group; ++j)
+			{
+				size_t slot = home(batch[first + j]);
+				prefetch(&keys[slot]);
+				prefetch(entries[slot].bytes);
+			}
+
+			for(size_t j = 0; j < group; ++j)
+				found(first + j, findSlot(batch[first + j]));
+		}
+	}
+
+	size_t slotRangeCount() const
+	{
+		if(addedElements < PARALLEL_MIN_SIZE)
+			return 1;
+		return std::min(endSlot(), parallel::preferredTaskCount());
+	}
+
+	template<typename Function>
+	void forEachInSlotRange(size_t range, size_t rangeCount, Function &fn) const
+	{
+		size_t first = endSlot() * range / rangeCount;
+		size_t last = endSlot() * (range + 1) / rangeCount;
+
+		for(size_t slot = first; slot < last; ++slot)
+		{
+			if(isUsed(slot))
+				fn(const_cast<const_reference>(entryAt(slot)));
+		}
+	}
+
+public:
+
+	HashMap()
+	{}
+
+	HashMap(size_t buckets)
+	{
+		allocate(roundCapacity(buckets), defaultTail(roundCapacity(buckets)));
+	}
+
+	HashMap(std::initializer_list<value_type> list) : HashMap()
+	{
+		for(auto &elem : list)
+			(*this)[elem.first] = elem.second;
+	}
+
+	HashMap(const HashMap &other)
+	{
+		*this = other;
+	}
+
+	HashMap(HashMap &&other)
+	{
+		swapStorage(other);
+	}
+
+	HashMap &operator=(const HashMap &other)
+	{
+		if(this != &other)
+		{
+			if(other.homeSlots == 0)
+			{
+				HashMap empty;
+				swapStorage(empty);
+				return *this;
+			}
+
+			HashMap copy(Layout{other.homeSlots, other.slotCount - other.homeSlots});
+			std::copy(other.keys.get(), other.keys.get() + other.slotCount, copy.keys.get());
+			std::memcpy(copy.entries.get(), other.entries.get(), (other.slotCount + 1) * sizeof(Slot));
+			copy.addedElements = other.addedElements;
+			copy.hasEmptyKeyEntry = other.hasEmptyKeyEntry;
+			swapStorage(copy);
+		}
+		return *this;
+	}
+
+	HashMap &operator=(HashMap &&other)
+	{
+		if(this != &other)
+		{
+			HashMap empty;
+			swapStorage(empty);
+			swapStorage(other);
+		}
+		return *this;
+	}
+
+	bool isEmpty() const
+	{
+		return addedElements == 0;
+	}
+
+	mapped_type &operator[](const key_type &key)
+	{
+		size_t slot = findSlot(key);
+		if(slot == endSlot())
+			slot = insert({key, mapped_type{}});
+		return entryAt(slot).second;
+	}
+
+	std::pair<iterator, bool> findOrInsert(const key_type &key)
+	{
+		size_t slot = findSlot(key);
+		bool inserted = slot == endSlot();
+
+		if(inserted)
+			slot = insert({key, mapped_type{}});
+		return {Iterator(ConstIterator(this, slot)), inserted};
+	}
+
+	const mapped_type &valueOf(const key_type &key) const
+	{
+		size_t slot = findSlot(key);
+		if(slot == endSlot())
+			throw std::out_of_range("key doesn't exist");
+		return entryAt(slot).second;
+	}
+
+	mapped_type &valueOf(const key_type &key)
+	{
+		size_t slot = findSlot(key);
+		if(slot == endSlot())
+			throw std::out_of_range("key doesn't exist");
+		return entryAt(slot).second;
+	}
+
+	const_iterator find(const key_type &key) const
+	{
+		return ConstIterator(this, findSlot(key));
+	}
+
+	iterator find(const key_type &key)
+	{
+		return Iterator( (const_cast<const HashMap *>(this))->find(key));
+	}
+
+	void findMany(const std::vector<key_type> &batch, std::vector<const_iterator> &out) const
+	{
+		out.clear();
+		out.reserve(batch.size());
+		lookupBatch(batch.data(), batch.size(), [&](size_t, size_t slot)
+		{
+			out.push_back(ConstIterator(this, slot));
+		});
+	}
+
+	void findMany(const std::vector<key_type> &batch, std::vector<iterator> &out)
+	{
+		out.clear();
+		out.reserve(batch.size());
+		lookupBatch(batch.data(), batch.size(), [&](size_t, size_t slot)
+		{
+			out.push_back(Iterator(ConstIterator(this, slot)));
+		});
+	}
+
+	std::vector<bool> containsMany(const std::vector<key_type> &batch) const
+	{
+		std::vector<bool> out(batch.size());
+		lookupBatch(batch.data(), batch.size(), [&](size_t i, size_t slot)
+		{
+			out[i] = slot != endSlot();
+		});
+		return out;
+	}
+
+	void remove(const key_type &key)
+	{
+		remove(find(key));
+	}
+
+	void remove(const const_iterator &it)
+	{
+		erase(it);
+	}
+
+	iterator erase(const const_iterator &it)
+	{
+		if(it == end())
+			throw std::out_of_range("out of range");
+
+		size_t slot = it.slot;
+		eraseSlot(slot);
+
+		if(slot < slotCount && keys[slot] != emptyKey())
+			return Iterator(ConstIterator(this, slot));
+		return Iterator(ConstIterator(this, nextUsed(slot)));
+	}
+
+	template<typename Predicate>
+	size_type eraseIf(Predicate pred)
+	{
+		size_type removed = 0;
+		for(size_t slot = 0; slot < slotCount; ++slot)
+		{
+			while(keys[slot] != emptyKey() && pred(const_cast<const_reference>(entryAt(slot))))
+			{
+				eraseSlot(slot);
+				++removed;
+			}
+		}
+		if(hasEmptyKeyEntry && pred(const_cast<const_reference>(entryAt(slotCount))))
+		{
+			eraseSlot(slotCount);
+			++removed;
+		}
+		return removed;
+	}
+
+	// entries are plain bytes here, so a handle simply carries a copy of the element
+	NodeHandle extract(const key_type &key)
+	{
+		NodeHandle handle;
+		size_t slot = findSlot(key);
+		if(slot != endSlot())
+		{
+			handle.set(entryAt(slot));
+			eraseSlot(slot);
+		}
+		return handle;
+	}
+
+	NodeHandle extract(const const_iterator &it)
+	{
+		return extract(it->first);
+	}
+
+	bool insert(NodeHandle &&handle)
+	{
+		if(handle.empty() || findSlot(handle.key()) != endSlot())
+			return false;
+
+		insert(handle.value());
+		handle.engaged = false;
+		return true;
+	}
+
+	void merge(HashMap &other)
+	{
+		if(this == &other)
+			return;
+
+		other.eraseIf([&](const_reference elem)
+		{
+			if(findSlot(elem.first) != endSlot())
+				return false;
+			insert(elem);
+			return true;
+		});
+	}
+
+	size_type getSize() const
+	{
+		return addedElements;
+	}
+
+	// home slots; the table grows once it is three quarters full
+	size_type capacity() const
+	{
+		return homeSlots;
+	}
+
+	void reserve(size_type count)
+	{
+		size_t needed = roundCapacity((count * 4 + 2) / 3);
+		if(needed > homeSlots)
+			rehash(needed, defaultTail(needed));
+	}
+
+	// Smallest table that holds the current elements; an empty map gives its
+	// arrays back altogether. Entries are packed already, so compact() is the same.
+	void shrink_to_fit()
+	{
+		if(addedElements == 0)
+		{
+			HashMap empty;
+			swapStorage(empty);
+			return;
+		}
+
+		size_t needed = roundCapacity((addedElements * 4 + 2) / 3);
+		if(needed < homeSlots || slotCount - homeSlots > defaultTail(homeSlots))
+			rehash(needed, defaultTail(needed));
+	}
+
+	void compact()
+	{
+		shrink_to_fit();
+	}
+
+	size_t memoryUsage() const
+	{
+		if(homeSlots == 0)
+			return sizeof(*this);
+		return sizeof(*this) + heapBlockSize(slotCount * sizeof(key_type)) + heapBlockSize((slotCount + 1) * sizeof(Slot));
+	}
+
+	bool operator==(const HashMap &other) const
+	{
+		if(addedElements != other.addedElements)
+			return false;
+
+		for(auto &elem : other)
+		{
+			auto it = find(elem.first);
+			if( it == end() || *it != elem )
+				return false;
+		}
+		return true;
+	}
+
+	bool operator!=(const HashMap &other) const
+	{
+		return !(*this == other);
+	}
+
+	void saveSnapshot(const std::string &path) const
+	{
+		writeHashSnapshot<key_type, mapped_type>(path, *this, addedElements);
+	}
+
+	// Immutable copy over a minimal perfect hash for maps that are loaded once and
+	// then only queried.
+	FrozenHashMap<key_type, mapped_type> freeze() const
+	{
+		return FrozenHashMap<key_type, mapped_type>(begin(), end(), addedElements);
+	}
+
+	HashMapStats stats() const
+	{
+		HashMapStats result;
+		result.size = addedElements;
+		result.buckets = slotCount;
+		result.loadFactor = homeSlots == 0 ? 0 : double(addedElements) / homeSlots;
+
+		for(size_t slot = 0; slot < slotCount; ++slot)
+		{
+			if(keys[slot] == emptyKey())
+			{
+				++result.emptyBuckets;
+				continue;
+			}
+			size_t probes = slot - home(keys[slot]) + 1;
+			if(probes >= result.probeLengths.size())
+				result.probeLengths.resize(probes + 1);
+			++result.probeLengths[probes];
+			result.longestChain = std::max(result.longestChain, probes);
+		}
+
+		MAP_STATS(result.countersEnabled = true;)
+		MAP_STATS(result.operations = counters;)
+		return result;
+	}
+
+	void dumpStats(std::ostream &out) const
+	{
+		stats().writeJson(out);
+	}
+
+	void resetStats()
+	{
+		MAP_STATS(counters = HashMapCounters{};)
+	}
+
+	template<typename Function>
+	void parallelForEach(Function fn) const
+	{
+		size_t ranges = slotRangeCount();
+		parallel::runTasks(ranges, [&](size_t range)
+		{
+			forEachInSlotRange(range, ranges, fn);
+		});
+	}
+
+	template<typename Function>
+	void parallelForEach(Function fn)
+	{
+		const HashMap *self = this;
+		self->parallelForEach([&](const_reference elem)
+		{
+			// ugly cast, yet reduces code duplication.
+			fn(const_cast<reference>(elem));
+		});
+	}
+
+	template<typename T, typename Map, typename Combine>
+	T parallelReduce(T init, Map map, Combine combine) const
+	{
+		size_t ranges = slotRangeCount();
+		return parallel::reduce(ranges, init, [&](size_t range, auto callback)
+		{
+			forEachInSlotRange(range, ranges, callback);
+		}, map, combine);
+	}
+
+	iterator begin()
+	{
+		return Iterator(cbegin());
+	}
+
+	iterator end()
+	{
+		return Iterator(cend());
+	}
+
+	const_iterator cbegin() const
+	{
+		return ConstIterator(this, firstUsed());
+	}
+
+	const_iterator cend() const
+	{
+		return ConstIterator(this, endSlot());
+	}
+
+	const_iterator begin() const
+	{
+		return cbegin();
+	}
+
+	const_iterator end() const
+	{
+		return cend();
+	}
+};
+
+template<typename KeyType, typename ValueType>
+class HashMap<KeyType, ValueType, true>::ConstIterator
+{
+public:
+	using reference = typename HashMap::const_reference;
+	using iterator_category = std::bidirectional_iterator_tag;
+	using value_type = typename HashMap::value_type;
+	using pointer = const typename HashMap::value_type *;
+
+	friend class HashMap;
+
+private:
+	const HashMap *map = nullptr;
+	size_t slot = 0;
+
+public:
+
+	explicit ConstIterator() = default;
+
+	ConstIterator(const HashMap *map, size_t slot) : map(map), slot(slot)
+	{}
+
+	ConstIterator &operator++()
+	{
+		if(map == nullptr)
+			throw std::logic_error("collection not given to iterator");
+
+		if(slot == map->endSlot())
+			throw std::out_of_range("iterator out of range");
+
+		slot = map->nextUsed(slot);
+		return *this;
+	}
+
+	ConstIterator operator++(int)
+	{
+		auto it = *this;
+		this->operator++();
+		return it;
+	}
+
+	ConstIterator &operator--()
+	{
+		if(map == nullptr)
+			throw std::logic_error("collection not given to iterator");
+
+		size_t previous = slot;
+		while(previous > 0)
+		{
+			--previous;
+			if(map->isUsed(previous))
+			{
+				slot = previous;
+				return *this;
+			}
+		}
+		throw std::out_of_range("iterator out of range");
+	}
+
+	ConstIterator operator--(int)
+	{
+		auto it = *this;
+		this->operator--();
+		return it;
+	}
+
+	reference operator*() const
+	{
+		if(map == nullptr || slot == map->endSlot())
+			throw std::out_of_range("out of range");
+
+		return map->entryAt(slot);
+	}
+
+	pointer operator->() const
+	{
+		return &this->operator*();
+	}
+
+	bool operator==(const ConstIterator &other) const
+	{
+		return map == other.map && slot == other.slot;
+	}
+
+	bool operator!=(const ConstIterator &other) const
+	{
+		return !(*this == other);
+	}
+};
+
+template<typename KeyType, typename ValueType>
+class HashMap<KeyType, ValueType, true>::NodeHandle
+{
+	friend class HashMap;
+
+	Slot storage;
+	bool engaged = false;
+
+	void set(const value_type &value)
+	{
+		new (storage.bytes) value_type(value);
+		engaged = true;
+	}
+
+	value_type &value() const
+	{
+		return *reinterpret_cast<value_type *>(const_cast<unsigned char *>(storage.bytes));
+	}
+
+public:
+	NodeHandle()
+	= default;
+
+	NodeHandle(const NodeHandle &) = delete;
+	NodeHandle &operator=(const NodeHandle &) = delete;
+
+	NodeHandle(NodeHandle &&other) : storage(other.storage), engaged(other.engaged)
+	{
+		other.engaged = false;
+	}
+
+	NodeHandle &operator=(NodeHandle &&other)
+	{
+		if(this != &other)
+		{
+			storage = other.storage;
+			engaged = other.engaged;
+			other.engaged = false;
+		}
+		return *this;
+	}
+
+	bool empty() const
+	{
+		return !engaged;
+	}
+
+	explicit operator bool() const
+	{
+		return !empty();
+	}
+
+	const key_type &key() const
+	{
+		if(empty())
+			throw std::logic_error("empty node handle");
+		return value().first;
+	}
+
+	mapped_type &mapped()
+	{
+		if(empty())
+			throw std::logic_error("empty node handle");
+		return value().second;
+	}
+};
+
+template<typename KeyType, typename ValueType>
+class HashMap<KeyType, ValueType, true>::Iterator : public HashMap<KeyType, ValueType, true>::ConstIterator
+{
+public:
+	using reference = typename HashMap::reference;
+	using pointer = typename HashMap::value_type *;
+
+	explicit Iterator()
+	{}
+
+	Iterator(const ConstIterator &other)
+			: ConstIterator(other)
+	{}
+
+	Iterator &operator++()
+	{
+		ConstIterator::operator++();
+		return *this;
+	}
+
+	Iterator operator++(int)
+	{
+		auto result = *this;
+		ConstIterator::operator++();
+		return result;
+	}
+
+	Iterator &operator--()
+	{
+		ConstIterator::operator--();
+		return *this;
+	}
+
+	Iterator operator--(int)
+	{
+		auto result = *this;
+		ConstIterator::operator--();
+		return result;
+	}
+
+	pointer operator->() const
+	{
+		return &this->operator*();
+	}
+
+	reference operator*() const
+	{
+		// ugly cast, yet reduces code duplication.
+		return const_cast<reference>(ConstIterator::operator*());
+	}
+};
+
+
+template<typename KeyType, typename ValueType>
+using FlatHashMap = HashMap<KeyType, ValueType, true>;
+
+}
+
+#endif /* AISDI_MAPS_FLATHASHMAP_H */
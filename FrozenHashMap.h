@@ -0,0 +1,431 @@
+#ifndef AISDI_MAPS_FROZENHASHMAP_H
+#define AISDI_MAPS_FROZENHASHMAP_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "MapStats.h"
+#include "Snapshot.h"
+
+#define PERFECT_HASH_BUCKET_SIZE 4
+#define PERFECT_HASH_MAX_TRIES (1u << 20)
+#define PERFECT_HASH_MAX_SEEDS 64
+
+namespace aisdi
+{
+
+// Minimal perfect hash in the CHD (hash, displace) style, shared by FrozenHashMap
+// and its snapshots. Keys are spread over size / PERFECT_HASH_BUCKET_SIZE buckets;
+// every bucket stores one displacement that sends each of its keys to a different
+// slot of 0 ... size - 1. A bucket with a single key stores its slot directly.
+//
+// table[0 ... buckets - 1] are the displacements, table[buckets] the seed the keys'
+// hashes were mixed with.
+struct PerfectHash
+{
+	static const uint64_t DIRECT_SLOT = uint64_t(1) << 63;
+
+	static uint64_t mix(uint64_t hash)
+	{
+		hash ^= hash >> 33;
+		hash *= 0xFF51AFD7ED558CCDull;
+		hash ^= hash >> 33;
+		hash *= 0xC4CEB9FE1A85EC53ull;
+		return hash ^ (hash >> 33);
+	}
+
+	static uint64_t keyHash(uint64_t hash, uint64_t seed)
+	{
+		return mix(hash + seed * 0x9E3779B97F4A7C15ull);
+	}
+
+	// both reductions multiply instead of taking a remainder
+	static uint64_t bucketOf(uint64_t keyHash, uint64_t buckets)
+	{
+		return ((keyHash >> 32) * buckets) >> 32;
+	}
+
+	static uint64_t slotOf(uint64_t keyHash, uint64_t displacement, uint64_t size)
+	{
+		if(displacement & DIRECT_SLOT)
+			return displacement & ~DIRECT_SLOT;
+		return ((mix(keyHash ^ (displacement * 0xD6E8FEB86659FD93ull)) & 0xFFFFFFFFu) * size) >> 32;
+	}
+
+	// slot of a key with the given std::hash; size has to be positive
+	static uint64_t lookup(uint64_t hash, const uint64_t *table, uint64_t buckets, uint64_t size)
+	{
+		uint64_t mixed = keyHash(hash, table[buckets]);
+		return slotOf(mixed, table[bucketOf(mixed, buckets)], size);
+	}
+
+	static uint64_t bucketCount(size_t size)
+	{
+		return std::max<uint64_t>(1, (size + PERFECT_HASH_BUCKET_SIZE - 1) / PERFECT_HASH_BUCKET_SIZE);
+	}
+
+	// Builds the table for keys with the given std::hash values and fills slots[i]
+	// with the slot of key i. same(i, j) tells whether keys i and j are equal, which
+	// is only asked for keys whose hashes are equal. Keys with equal hashes throw
+	// invalid_argument, whether the keys are equal or not: keyHash() keeps them equal
+	// under every seed, so no displacement could tell them apart.
+	template<typename Same>
+	static std::vector<uint64_t> build(const std::vector<uint64_t> &hashes, std::vector<uint64_t> &slots, Same same)
+	{
+		uint64_t size = hashes.size();
+		if(size >= (uint64_t(1) << 32))
+			throw std::length_error("too many keys for a perfect hash");
+		uint64_t buckets = bucketCount(size);
+
+		std::vector<uint64_t> table(buckets + 1);
+		std::vector<uint64_t> mixed(size);
+		std::vector<uint64_t> bucketStart(buckets + 1);
+		std::vector<uint32_t> members(size);
+		std::vector<uint32_t> order(buckets);
+		std::vector<bool> taken(size);
+		std::vector<uint64_t> candidate;
+		slots.assign(size, 0);
+
+		std::vector<uint32_t> byHash(size);
+		for(uint64_t i = 0; i < size; ++i)
+			byHash[i] = static_cast<uint32_t>(i);
+		std::sort(byHash.begin(), byHash.end(), [&](uint32_t a, uint32_t b) { return hashes[a] < hashes[b]; });
+		for(uint64_t i = 1; i < size; ++i)
+		{
+			if(hashes[byHash[i]] != hashes[byHash[i - 1]])
+				continue;
+			if(same(byHash[i], byHash[i - 1]))
+				throw std::invalid_argument("keys have to be unique");
+			throw std::invalid_argument("keys with equal std::hash values can't be perfectly hashed");
+		}
+
+		for(uint64_t seed = 0; seed < PERFECT_HASH_MAX_SEEDS; ++seed)
+		{
+			// keys grouped by bucket, largest buckets placed first while most slots are free
+			std::fill(bucketStart.begin(), bucketStart.end(), 0);
+			for(uint64_t i = 0; i < size; ++i)
+			{
+				mixed[i] = keyHash(hashes[i], seed);
+				++bucketStart[bucketOf(mixed[i], buckets) + 1];
+			}
+			for(uint64_t b = 0; b < buckets; ++b)
+				bucketStart[b + 1] += bucketStart[b];
+			std::vector<uint64_t> next(bucketStart.begin(), bucketStart.end() - 1);
+			for(uint64_t i = 0; i < size; ++i)
+				members[next[bucketOf(mixed[i], buckets)]++] = static_cast<uint32_t>(i);
+
+			for(uint64_t b = 0; b < buckets; ++b)
+				order[b] = static_cast<uint32_t>(b);
+			std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b)
+			{
+				return bucketStart[a + 1] - bucketStart[a] > bucketStart[b + 1] - bucketStart[b];
+			});
+
+			std::fill(taken.begin(), taken.end(), false);
+			std::fill(table.begin(), table.end(), 0);
+			size_t freeSlot = 0;
+			bool placed = true;
+			for(uint32_t b : order)
+			{
+				uint64_t first = bucketStart[b];
+				uint64_t count = bucketStart[b + 1] - first;
+				if(count == 0)
+					break;
+
+				if(count == 1)
+				{
+					while(taken[freeSlot])
+						++freeSlot;
+					taken[freeSlot] = true;
+					table[b] = DIRECT_SLOT | freeSlot;
+					slots[members[first]] = freeSlot;
+					continue;
+				}
+
+				placed = false;
+				for(uint64_t displacement = 0; displacement < PERFECT_HASH_MAX_TRIES && !placed; ++displacement)
+				{
+					candidate.clear();
+					for(uint64_t i = first; i < first + count; ++i)
+					{
+						uint64_t slot = slotOf(mixed[members[i]], displacement, size);
+						if(taken[slot] || std::find(candidate.begin(), candidate.end(), slot) != candidate.end())
+							break;
+						candidate.push_back(slot);
+					}
+					if(candidate.size() != count)
+						continue;
+
+					for(uint64_t i = 0; i < count; ++i)
+					{
+						taken[candidate[i]] = true;
+						slots[members[first + i]] = candidate[i];
+					}
+					table[b] = displacement;
+					placed = true;
+				}
+				if(!placed)
+					break;
+			}
+
+			if(placed)
+			{
+				table[buckets] = seed;
+				return table;
+			}
+		}
+		throw std::runtime_error("no perfect hash found");
+	}
+};
+
+// Immutable hash map over a minimal perfect hash: size slots for size elements and
+// no chains, so a lookup is one displacement read, one slot and one key compare,
+// hits and misses alike. Built by HashMap::freeze() for maps that never change
+// after they are loaded.
+template<typename KeyType, typename ValueType>
+class FrozenHashMap
+{
+public:
+	using key_type = KeyType;
+	using mapped_type = ValueType;
+	using value_type = std::pair<key_type, mapped_type>;
+	using size_type = std::size_t;
+	using const_reference = const value_type &;
+	using const_iterator = const value_type *;
+	using iterator = const_iterator;
+
+private:
+	std::vector<uint64_t> table;
+	std::vector<value_type> entries; // in slot order
+	uint64_t buckets = 0;
+
+public:
+	FrozenHashMap() = default;
+
+	// first ... last has to yield count key/value pairs with unique keys
+	template<typename InputIt>
+	FrozenHashMap(InputIt first, InputIt last, size_t count)
+	{
+		std::vector<value_type> elements;
+		elements.reserve(count);
+		for(; first != last; ++first)
+			elements.emplace_back(first->first, first->second);
+		if(elements.empty())
+			return;
+
+		std::vector<uint64_t> hashes(elements.size());
+		for(size_t i = 0; i < elements.size(); ++i)
+			hashes[i] = std::hash<key_type>{}(elements[i].first);
+
+		std::vector<uint64_t> slots;
+		table = PerfectHash::build(hashes, slots, [&](size_t a, size_t b)
+		{
+			return elements[a].first == elements[b].first;
+		});
+		buckets = table.size() - 1;
+
+		std::vector<size_t> elementAt(elements.size());
+		for(size_t i = 0; i < elements.size(); ++i)
+			elementAt[slots[i]] = i;
+		entries.reserve(elements.size());
+		for(size_t slot = 0; slot < elements.size(); ++slot)
+			entries.push_back(std::move(elements[elementAt[slot]]));
+	}
+
+	bool isEmpty() const
+	{
+		return entries.empty();
+	}
+
+	size_type getSize() const
+	{
+		return entries.size();
+	}
+
+	size_t memoryUsage() const
+	{
+		size_t bytes = sizeof(*this) + table.capacity() * sizeof(uint64_t) + entries.capacity() * sizeof(value_type);
+		if(MayOwnHeap<key_type, mapped_type>::value)
+		{
+			for(auto &entry : entries)
+				bytes += ownedBytes(entry.first) + ownedBytes(entry.second);
+		}
+		return bytes;
+	}
+
+	const_iterator find(const key_type &key) const
+	{
+		if(entries.empty())
+			return end();
+		const value_type &entry = entries[PerfectHash::lookup(std::hash<key_type>{}(key), table.data(), buckets, entries.size())];
+		return entry.first == key ? &entry : end();
+	}
+
+	bool contains(const key_type &key) const
+	{
+		return find(key) != end();
+	}
+
+	const mapped_type &valueOf(const key_type &key) const
+	{
+		auto it = find(key);
+		if(it == end())
+			throw std::out_of_range("key doesn't exist");
+		return it->second;
+	}
+
+	// Writes a file that FrozenHashMapSnapshot maps back read-only with the same
+	// perfect hash; keys and values have to be trivially copyable.
+	void saveSnapshot(const std::string &path) const
+	{
+		checkSnapshotTypes<key_type, mapped_type>();
+		using Entry = SnapshotEntry<key_type, mapped_type>;
+
+		uint64_t tableSize = table.empty() ? 0 : buckets;
+		std::vector<uint64_t> written(table);
+		if(written.empty())
+			written.assign(1, 0);
+
+		std::vector<Entry> rows(entries.size());
+		for(size_t i = 0; i < entries.size(); ++i)
+		{
+			rows[i].first = entries[i].first;
+			rows[i].second = entries[i].second;
+		}
+
+		SnapshotHeader header = makeSnapshotHeader<key_type, mapped_type>(PERFECT_HASH_SNAPSHOT, tableSize, entries.size());
+		std::ofstream out(path, std::ios::binary | std::ios::trunc);
+		if(!out)
+			throw std::runtime_error("can't open " + path + " for writing");
+
+		writeBytes(out, &header, sizeof(header));
+		writeBytes(out, written.data(), written.size() * sizeof(uint64_t));
+		writePadding(out, sizeof(header) + written.size() * sizeof(uint64_t), header.entriesOffset);
+		writeBytes(out, rows.data(), rows.size() * sizeof(Entry));
+
+		out.flush();
+		if(!out)
+			throw std::runtime_error("can't write " + path);
+	}
+
+	// elements in slot order, which has nothing to do with key order
+	const_iterator begin() const
+	{
+		return entries.data();
+	}
+
+	const_iterator end() const
+	{
+		return entries.data() + entries.size();
+	}
+
+	const_iterator cbegin() const
+	{
+		return begin();
+	}
+
+	const_iterator cend() const
+	{
+		return end();
+	}
+};
+
+// Zero-copy view of a file written by FrozenHashMap::saveSnapshot, looked up with
+// the stored perfect hash like the map itself.
+template<typename KeyType, typename ValueType>
+class FrozenHashMapSnapshot
+{
+public:
+	using key_type = KeyType;
+	using mapped_type = ValueType;
+	using value_type = SnapshotEntry<KeyType, ValueType>;
+	using size_type = std::size_t;
+	using const_reference = const value_type &;
+	using const_iterator = const value_type *;
+
+private:
+	MappedFile file;
+	const SnapshotHeader *header = nullptr;
+	const uint64_t *table = nullptr;
+	const value_type *entries = nullptr;
+
+public:
+	explicit FrozenHashMapSnapshot(const std::string &path) : file(path)
+	{
+		checkSnapshotTypes<KeyType, ValueType>();
+
+		if(file.getSize() < sizeof(SnapshotHeader))
+			throw std::runtime_error("snapshot is truncated");
+		header = reinterpret_cast<const SnapshotHeader *>(file.bytes());
+		checkSnapshotHeader<KeyType, ValueType>(*header, PERFECT_HASH_SNAPSHOT, file.getSize());
+
+		table = reinterpret_cast<const uint64_t *>(file.bytes() + sizeof(SnapshotHeader));
+		entries = reinterpret_cast<const value_type *>(file.bytes() + header->entriesOffset);
+		if(header->buckets != (header->size == 0 ? 0 : PerfectHash::bucketCount(header->size)))
+			throw std::runtime_error("snapshot displacement table is corrupted");
+	}
+
+	bool isEmpty() const
+	{
+		return header->size == 0;
+	}
+
+	size_type getSize() const
+	{
+		return header->size;
+	}
+
+	const_iterator find(const key_type &key) const
+	{
+		if(header->size == 0)
+			return end();
+		uint64_t slot = PerfectHash::lookup(std::hash<key_type>{}(key), table, header->buckets, header->size);
+		if(slot >= header->size || !(entries[slot].first == key))
+			return end();
+		return entries + slot;
+	}
+
+	bool contains(const key_type &key) const
+	{
+		return find(key) != end();
+	}
+
+	const mapped_type &valueOf(const key_type &key) const
+	{
+		auto it = find(key);
+		if(it == end())
+			throw std::out_of_range("key doesn't exist");
+		return it->second;
+	}
+
+	const_iterator begin() const
+	{
+		return entries;
+	}
+
+	const_iterator end() const
+	{
+		return entries + header->size;
+	}
+
+	const_iterator cbegin() const
+	{
+		return begin();
+	}
+
+	const_iterator cend() const
+	{
+		return end();
+	}
+};
+
+}
+
+#endif /* AISDI_MAPS_FROZENHASHMAP_H */
@@ -0,0 +1,300 @@
+#ifndef AISDI_MAPS_FROZENTREEMAP_H
+#define AISDI_MAPS_FROZENTREEMAP_H
+
+#include <cstddef>
+#include <iterator>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#define CACHE_LINE_SIZE 64
+
+namespace aisdi
+{
+
+// Immutable ordered map in Eytzinger (BFS) order: slot k has children 2k and 2k + 1,
+// slots are 1-based and slot 0 only pads the arrays. Keys and values live in two
+// contiguous arrays, so a lookup walks one dense key array and touches the value
+// array once at the end.
+template<typename KeyType, typename ValueType>
+class FrozenTreeMap
+{
+public:
+	using key_type = KeyType;
+	using mapped_type = ValueType;
+	using value_type = std::pair<const key_type, mapped_type>;
+	using size_type = std::size_t;
+	using const_reference = std::pair<const key_type &, const mapped_type &>;
+
+	class ConstIterator;
+
+	using const_iterator = ConstIterator;
+	using iterator = ConstIterator;
+
+private:
+	std::vector<key_type> keys;
+	std::vector<mapped_type> values;
+	size_t size = 0;
+
+	// every slot this many levels below k lies in one cache line of keys
+	static constexpr size_t prefetchStride = CACHE_LINE_SIZE / sizeof(key_type) > 0 ? CACHE_LINE_SIZE / sizeof(key_type) : 1;
+
+	size_t firstSlot() const
+	{
+		if(size == 0)
+			return 0;
+		size_t k = 1;
+		while(2 * k <= size)
+			k = 2 * k;
+		return k;
+	}
+
+	size_t lastSlot() const
+	{
+		if(size == 0)
+			return 0;
+		size_t k = 1;
+		while(2 * k + 1 <= size)
+			k = 2 * k + 1;
+		return k;
+	}
+
+	size_t nextSlot(size_t k) const
+	{
+		if(2 * k + 1 <= size)
+		{
+			k = 2 * k + 1;
+			while(2 * k <= size)
+				k = 2 * k;
+			return k;
+		}
+		while(k & 1) //climb while we are a right child
+			k >>= 1;
+		return k >> 1;
+	}
+
+	size_t previousSlot(size_t k) const
+	{
+		if(2 * k <= size)
+		{
+			k = 2 * k;
+			while(2 * k + 1 <= size)
+				k = 2 * k + 1;
+			return k;
+		}
+		while(k != 0 && !(k & 1)) //climb while we are a left child
+			k >>= 1;
+		return k >> 1;
+	}
+
+	// slot of the first key not less than key, 0 if there is none
+	size_t lowerBoundSlot(const key_type &key) const
+	{
+		const key_type *base = keys.data();
+		size_t k = 1;
+		while(k <= size)
+		{
+#if defined(__GNUC__)
+			__builtin_prefetch(reinterpret_cast<const char *>(base) + prefetchStride * k * sizeof(key_type));
+#endif
+			k = 2 * k + (base[k] < key);
+		}
+		// k went right at the end of every descent after the last left turn; that
+		// turn was taken at the answer, so strip the trailing ones and that turn
+		while(k & 1)
+			k >>= 1;
+		return k >> 1;
+	}
+
+public:
+	FrozenTreeMap() = default;
+
+	// first ... last has to yield count key/value pairs with strictly increasing keys
+	template<typename InputIt>
+	FrozenTreeMap(InputIt first, InputIt last, size_t count)
+	{
+		std::vector<std::pair<key_type, mapped_type>> sorted;
+		sorted.reserve(count);
+		for(; first != last; ++first)
+		{
+			if(!sorted.empty() && !(sorted.back().first < first->first))
+				throw std::invalid_argument("keys have to be sorted and unique");
+			sorted.emplace_back(first->first, first->second);
+		}
+		size = sorted.size();
+		if(size == 0)
+			return;
+
+		std::vector<size_t> rank(size + 1);
+		size_t next = 0;
+		for(size_t k = firstSlot(); k != 0; k = nextSlot(k))
+			rank[k] = next++;
+
+		keys.reserve(size + 1);
+		values.reserve(size + 1);
+		keys.push_back(sorted[0].first); //padding for slot 0
+		values.push_back(sorted[0].second);
+		for(size_t k = 1; k <= size; ++k)
+		{
+			keys.push_back(std::move(sorted[rank[k]].first));
+			values.push_back(std::move(sorted[rank[k]].second));
+		}
+	}
+
+	bool isEmpty() const
+	{
+		return size == 0;
+	}
+
+	size_type getSize() const
+	{
+		return size;
+	}
+
+	size_t memoryUsage() const
+	{
+		return sizeof(*this) + keys.capacity() * sizeof(key_type) + values.capacity() * sizeof(mapped_type);
+	}
+
+	const_iterator find(const key_type &key) const
+	{
+		size_t k = lowerBoundSlot(key);
+		if(k == 0 || key < keys[k])
+			return end();
+		return ConstIterator(this, k);
+	}
+
+	const_iterator lower_bound(const key_type &key) const
+	{
+		return ConstIterator(this, lowerBoundSlot(key));
+	}
+
+	bool contains(const key_type &key) const
+	{
+		return find(key) != end();
+	}
+
+	const mapped_type &valueOf(const key_type &key) const
+	{
+		size_t k = lowerBoundSlot(key);
+		if(k == 0 || key < keys[k])
+			throw std::out_of_range("Key doesn't exist");
+		return values[k];
+	}
+
+	const_iterator begin() const
+	{
+		return ConstIterator(this, firstSlot());
+	}
+
+	const_iterator end() const
+	{
+		return ConstIterator(this, 0);
+	}
+
+	const_iterator cbegin() const
+	{
+		return begin();
+	}
+
+	const_iterator cend() const
+	{
+		return end();
+	}
+};
+
+template<typename KeyType, typename ValueType>
+class FrozenTreeMap<KeyType, ValueType>::ConstIterator
+{
+public:
+	using reference = typename FrozenTreeMap::const_reference;
+	using iterator_category = std::bidirectional_iterator_tag;
+	using value_type = typename FrozenTreeMap::value_type;
+	using difference_type = std::ptrdiff_t;
+
+	// entries are split over two arrays, so -> hands out a temporary pair of references
+	class pointer
+	{
+		reference entry;
+
+	public:
+		explicit pointer(reference entry) : entry(entry)
+		{}
+
+		const reference *operator->() const
+		{
+			return &entry;
+		}
+	};
+
+	friend class FrozenTreeMap;
+
+private:
+	const FrozenTreeMap *map = nullptr;
+	size_t slot = 0;
+
+	ConstIterator(const FrozenTreeMap *map, size_t slot) : map(map), slot(slot)
+	{}
+
+public:
+	ConstIterator() = default;
+
+	ConstIterator &operator++()
+	{
+		if(map == nullptr || slot == 0)
+			throw std::out_of_range("out of range incrementing");
+		slot = map->nextSlot(slot);
+		return *this;
+	}
+
+	ConstIterator operator++(int)
+	{
+		auto it = *this;
+		operator++();
+		return it;
+	}
+
+	ConstIterator &operator--()
+	{
+		if(map == nullptr)
+			throw std::out_of_range("Collection is empty");
+		size_t previous = slot == 0 ? map->lastSlot() : map->previousSlot(slot);
+		if(previous == 0)
+			throw std::out_of_range("out of range decrementing");
+		slot = previous;
+		return *this;
+	}
+
+	ConstIterator operator--(int)
+	{
+		auto it = *this;
+		operator--();
+		return it;
+	}
+
+	reference operator*() const
+	{
+		if(map == nullptr || slot == 0)
+			throw std::out_of_range("out of range");
+		return reference(map->keys[slot], map->values[slot]);
+	}
+
+	pointer operator->() const
+	{
+		return pointer(operator*());
+	}
+
+	bool operator==(const ConstIterator &other) const
+	{
+		return map == other.map && slot == other.slot;
+	}
+
+	bool operator!=(const ConstIterator &other) const
+	{
+		return !(*this == other);
+	}
+};
+
+}
+
+#endif /* AISDI_MAPS_FROZENTREEMAP_H */
@@ -1,20 +1,50 @@
 #ifndef AISDI_MAPS_HASHMAP_H
 #define AISDI_MAPS_HASHMAP_H
 
+#include <algorithm>
 #include <cstddef>
 #include <initializer_list>
+#include <iterator>
 #include <stdexcept>
+#include <string>
+#include <type_traits>
 #include <utility>
 #include <list>
 #include <vector>
 
-#define DEF_CAPACITY 108881
+#include "BloomFilter.h"
+#include "FrozenHashMap.h"
+#include "MapStats.h"
+#include "Parallel.h"
+#include "Snapshot.h"
+
+#define DEF_CAPACITY 17
+#define MAX_LOAD_FACTOR 1
+#define LOOKUP_BATCH 16
 
 namespace aisdi
 {
 
+// Key and value types the open-addressing layout from FlatHashMap.h takes: integer
+// keys and trivially copyable values.
+template<typename KeyType, typename ValueType>
+struct UseFlatStorage : std::integral_constant<bool,
+		std::is_integral<KeyType>::value && !std::is_same<KeyType, bool>::value
+		&& std::is_trivially_copyable<ValueType>::value>
+{};
+
+// HashMap<K, V> is chained: growth relinks list nodes into other chains without
+// moving them, so references and pointers to an element stay valid until it is
+// removed (or compact() is called). Iterators stay valid too, finding their chain
+// again from the cached hash, but a walk that spans growth may skip elements or see
+// them twice. HashMap<K, V, true> (FlatHashMap<K, V>) is the open-addressing
+// layout, denser and faster for the types UseFlatStorage admits, but any insert may
+// move every element and any remove the ones after it.
+template<typename KeyType, typename ValueType, bool Flat = false>
+class HashMap;
+
 template<typename KeyType, typename ValueType>
-class HashMap
+class HashMap<KeyType, ValueType, false>
 {
 public:
 	using key_type = KeyType;
@@ -23,31 +53,284 @@ public:
 	using size_type = std::size_t;
 	using reference = value_type &;
 	using const_reference = const value_type &;
-	using listIterator = typename std::list<value_type>::const_iterator;
+
+	// list element: the pair and its full std::hash, so chains compare hashes
+	// before keys and copies or resizes never hash a key again
+	struct Entry
+	{
+		value_type value;
+		size_t hash;
+	};
+
+	using listIterator = typename std::list<Entry>::const_iterator;
 
 	class ConstIterator;
 
 	class Iterator;
 
+	class NodeHandle;
+
 	using iterator = Iterator;
 	using const_iterator = ConstIterator;
+	using node_type = NodeHandle;
 
 private:
 
 	size_t buckets = DEF_CAPACITY;
 	size_t addedElements = 0;
-	std::vector< std::list<value_type > >table;
+	std::vector< std::list<Entry> >table;
+	// Incremental rehash: the old buckets not migrated yet, and the next table, which is
+	// built a few buckets per insert while this one fills up. An element lives in its
+	// old bucket until that bucket is migrated, so every key has one chain to look in.
+	std::vector< std::list<Entry> > oldTable;
+	size_t oldBuckets = 0;
+	std::vector< std::list<Entry> > nextTable;
+	size_t rehashStep = 0; // old buckets migrated per insert, 0 = rehash all at once
+	size_t layoutEpoch = 0; // bumped whenever nodes change chains, so iterators look theirs up again
+	Prefilter<key_type> prefilter; // keyed with the cached hashes
+	MAP_STATS(mutable HashMapCounters counters;)
+
+	// the table doubles once the chains get longer than MAX_LOAD_FACTOR on average
+	void growIfNeeded()
+	{
+		if(rehashStep == 0)
+		{
+			if(addedElements >= buckets * MAX_LOAD_FACTOR)
+				rehash(2 * buckets + 1);
+			return;
+		}
+
+		migrate(rehashStep);
+		if(2 * addedElements >= buckets * MAX_LOAD_FACTOR)
+			prepareTable();
+		if(addedElements >= buckets * MAX_LOAD_FACTOR)
+			startRehash();
+	}
 
-	void insert(value_type value)
+	// Constructs as many buckets of the next table as it takes to have it ready by
+	// the time this one is full; constructing them all at once would be a stall of its own.
+	void prepareTable()
 	{
-		size_t index = std::hash<key_type>{}(value.first) % buckets;
-		table[index].push_back(value);
+		size_t newBuckets = 2 * buckets + 1;
+		size_t insertsLeft = std::max<size_t>(buckets * MAX_LOAD_FACTOR - std::min(addedElements, buckets * MAX_LOAD_FACTOR), 1);
+
+		if(nextTable.capacity() < newBuckets)
+			nextTable.reserve(newBuckets);
+		for(size_t count = (newBuckets - nextTable.size() + insertsLeft - 1) / insertsLeft; count > 0; --count)
+			nextTable.emplace_back();
+	}
+
+	// Swaps in the next table; the elements follow rehashStep buckets per insert in
+	// migrate(), long before the new table is full in turn.
+	void startRehash()
+	{
+		migrate(oldTable.size());
+		++layoutEpoch;
+		nextTable.resize(2 * buckets + 1);
+
+		oldTable.swap(table);
+		table.swap(nextTable);
+		oldBuckets = buckets;
+		buckets = table.size();
+	}
+
+	// moves the elements of count old buckets, the last ones first, so the drained
+	// buckets can be destroyed right away too
+	void migrate(size_t count)
+	{
+		if(count > 0 && !oldTable.empty())
+			++layoutEpoch;
+		for(; count > 0 && !oldTable.empty(); --count)
+		{
+			auto &bucket = oldTable.back();
+			while(!bucket.empty())
+			{
+				auto &target = table[bucket.front().hash % buckets];
+				target.splice(target.end(), bucket, bucket.begin());
+			}
+			oldTable.pop_back();
+		}
+		if(oldTable.empty() && oldTable.capacity() != 0)
+			std::vector< std::list<Entry> >().swap(oldTable);
+	}
+
+	void finishRehash()
+	{
+		migrate(oldTable.size());
+		std::vector< std::list<Entry> >().swap(nextTable);
+	}
+
+	// Buckets are numbered across both tables: table first, then oldTable, with
+	// END_BUCKET as the position of end(), since the number of buckets changes.
+	enum : size_t { END_BUCKET = static_cast<size_t>(-1) };
+
+	size_t bucketSlots() const
+	{
+		return buckets + oldTable.size();
+	}
+
+	const std::list<Entry> &bucketAt(size_t index) const
+	{
+		return index < buckets ? table[index] : oldTable[index - buckets];
+	}
+
+	std::list<Entry> &bucketAt(size_t index)
+	{
+		return index < buckets ? table[index] : oldTable[index - buckets];
+	}
+
+	// the bucket that holds, or would hold, an element with this hash
+	size_t homeIndex(size_t hash) const
+	{
+		if(!oldTable.empty() && hash % oldBuckets < oldTable.size())
+			return buckets + hash % oldBuckets;
+		return hash % buckets;
+	}
+
+	void insert(const value_type &value)
+	{
+		insertHashed(value, std::hash<key_type>{}(value.first));
+	}
+
+	// links a key that isn't present yet
+	listIterator insertHashed(const value_type &value, size_t hash)
+	{
+		growIfNeeded();
+		auto &bucket = bucketAt(homeIndex(hash));
+		bucket.push_back(Entry{value, hash});
 		++addedElements;
+		MAP_STATS(++counters.inserts;)
+		filterAdd(hash);
+		return std::prev(bucket.end());
+	}
+
+	// true if the prefilter rules the key out, without touching the table
+	bool filteredOut(size_t hash) const
+	{
+		if(!prefilter.enabled() || prefilter.mayContain(hash))
+			return false;
+		MAP_STATS(++counters.lookups;)
+		MAP_STATS(++counters.filterRejects;)
+		return true;
+	}
+
+	void filterAdd(size_t hash)
+	{
+		if(!prefilter.enabled())
+			return;
+		if(prefilter.overloaded(addedElements))
+			rebuildPrefilter(2 * addedElements);
+		else
+			prefilter.add(hash);
+	}
+
+	void filterRemove(size_t hash)
+	{
+		if(prefilter.enabled())
+			prefilter.remove(hash);
+	}
+
+	void rebuildPrefilter(size_t expectedElements)
+	{
+		prefilter.resize(expectedElements);
+		for(size_t i = 0; i < bucketSlots(); ++i)
+		{
+			for(auto &entry : bucketAt(i))
+				prefilter.add(entry.hash);
+		}
+	}
+
+	// position of key in its bucket, or that bucket's end()
+	listIterator findPosition(size_t hash, const key_type &key) const
+	{
+		const std::list<Entry> &bucket = bucketAt(homeIndex(hash));
+		MAP_STATS(++counters.lookups;)
+
+		for(auto it = bucket.begin(); it != bucket.end(); ++it)
+		{
+			MAP_STATS(++counters.probes;)
+			if(it->hash == hash && it->value.first == key)
+			{
+				MAP_STATS(++counters.lookupHits;)
+				return it;
+			}
+		}
+		return bucket.end();
 	}
 
-	size_t myHash(const key_type &key) const
+	static void prefetch(const void *address)
 	{
-		return std::hash<key_type >{}(key) % buckets;
+#if defined(__GNUC__)
+		__builtin_prefetch(address);
+#else
+		(void)address;
+#endif
+	}
+
+	// Resolves keys in groups of LOOKUP_BATCH: first every bucket head of the group is
+	// prefetched, then the first node of every non-empty bucket, and only then are the
+	// chains walked, so the misses of one group are in flight together.
+	// found(i, bucket, position) gets position == bucketAt(bucket).end() for a miss.
+	template<typename Found>
+	void lookupBatch(const key_type *keys, size_t count, Found found) const
+	{
+		size_t hash[LOOKUP_BATCH];
+		size_t index[LOOKUP_BATCH];
+
+		for(size_t first = 0; first < count; first += LOOKUP_BATCH)
+		{
+			size_t group = std::min<size_t>(LOOKUP_BATCH, count - first);
+
+			for(size_t j = 0; j < group; ++j)
+			{
+				hash[j] = std::hash<key_type>{}(keys[first + j]);
+				index[j] = homeIndex(hash[j]);
+				prefetch(&bucketAt(index[j]));
+			}
+
+			for(size_t j = 0; j < group; ++j)
+			{
+				if(!bucketAt(index[j]).empty())
+					prefetch(&bucketAt(index[j]).front());
+			}
+
+			for(size_t j = 0; j < group; ++j)
+				found(first + j, index[j], findPosition(hash[j], keys[first + j]));
+		}
+	}
+
+	// iterator to position in bucket index, or to the first element after that bucket
+	const_iterator firstFrom(size_t index, listIterator position) const
+	{
+		if(position != bucketAt(index).end())
+			return ConstIterator(this, index, position);
+
+		for(++index; index < bucketSlots(); ++index)
+		{
+			if(!bucketAt(index).empty())
+				return ConstIterator(this, index, bucketAt(index).begin());
+		}
+		return cend();
+	}
+
+	size_t bucketRangeCount() const
+	{
+		if(addedElements < PARALLEL_MIN_SIZE)
+			return 1;
+		return std::min(bucketSlots(), parallel::preferredTaskCount());
+	}
+
+	template<typename Function>
+	void forEachInBucketRange(size_t range, size_t rangeCount, Function &fn) const
+	{
+		size_t first = bucketSlots() * range / rangeCount;
+		size_t last = bucketSlots() * (range + 1) / rangeCount;
+
+		for(size_t i = first; i < last; ++i)
+		{
+			for(auto &entry : bucketAt(i))
+				fn(entry.value);
+		}
 	}
 
 public:
@@ -57,9 +340,9 @@ public:
 		table.resize(buckets);
 	}
 
-	HashMap(size_t buckets) : buckets(buckets)
+	HashMap(size_t buckets) : buckets(std::max<size_t>(buckets, 1))
 	{
-		table.resize(buckets);
+		table.resize(this->buckets);
 	}
 
 	HashMap(std::initializer_list<value_type> list) : HashMap()
@@ -68,11 +351,10 @@ public:
 			insert(elem);
 	}
 
-	HashMap(const HashMap &other) : HashMap(other.buckets)
-	{
-		for(auto elem : other)
-			insert(elem);
-	}
+	HashMap(const HashMap &other) : buckets(other.buckets), addedElements(other.addedElements), table(other.table),
+			oldTable(other.oldTable), oldBuckets(other.oldBuckets), rehashStep(other.rehashStep),
+			prefilter(other.prefilter)
+	{}
 
 	HashMap(HashMap &&other)// : buckets(other.buckets), addedElements(other.addedElements)
 	{
@@ -82,16 +364,9 @@ public:
 
 	HashMap &operator=(const HashMap &other)
 	{
+		// list assignment would assign entries in place, and their keys are const
 		if(this != &other)
-		{
-			table.clear();
-			buckets = other.buckets;
-			table.resize(buckets);
-			addedElements = 0;
-
-			for(auto elem : other)
-				insert(elem);
-		}
+			*this = HashMap(other);
 		return *this;
 	}
 
@@ -100,6 +375,11 @@ public:
 		buckets = std::move(other.buckets);
 		addedElements = std::move(other.addedElements);
 		table = std::move(other.table);
+		oldTable = std::move(other.oldTable);
+		oldBuckets = other.oldBuckets;
+		nextTable = std::move(other.nextTable);
+		rehashStep = other.rehashStep;
+		prefilter = std::move(other.prefilter);
 		return *this;
 	}
 
@@ -110,15 +390,22 @@ public:
 
 	mapped_type &operator[](const key_type &key)
 	{
-		auto it = find(key);
-		if(it == cend())
-		{
-			insert( {key, mapped_type{}} );
-			auto index = myHash(key);
-			return table[index].back().second;
-		}
-		else
-			return it->second;
+		return findOrInsert(key).first->second;
+	}
+
+	// Iterator to key's element, inserting one with a default-constructed value if
+	// there is none; second tells whether it was inserted. The key is hashed once.
+	std::pair<iterator, bool> findOrInsert(const key_type &key)
+	{
+		size_t hash = std::hash<key_type>{}(key);
+		listIterator position = bucketAt(homeIndex(hash)).end();
+		if(!filteredOut(hash))
+			position = findPosition(hash, key);
+		bool inserted = position == bucketAt(homeIndex(hash)).end();
+
+		if(inserted)
+			position = insertHashed({key, mapped_type{}}, hash);
+		return {Iterator(ConstIterator(this, homeIndex(hash), position)), inserted};
 	}
 
 	const mapped_type &valueOf(const key_type &key) const
@@ -143,26 +430,57 @@ public:
 
 	const_iterator find(const key_type &key) const
 	{
-		size_t index = myHash(key);
+		size_t hash = std::hash<key_type>{}(key);
+		if(filteredOut(hash))
+			return cend();
+		size_t index = homeIndex(hash);
+		auto position = findPosition(hash, key);
 
-		for(auto it = table[index].begin(); it != table[index].end(); ++it)
-		{
-			if(it->first == key)
-				return ConstIterator(this, index, it);
-		}
-		return cend();
+		if(position == bucketAt(index).end())
+			return cend();
+		return ConstIterator(this, index, position);
 	}
 
 	iterator find(const key_type &key)
 	{
-		size_t index = myHash(key);
+		return Iterator( (const_cast<const HashMap *>(this))->find(key));
+	}
+
+	// out[i] is find(keys[i]); meant for batches of tens to hundreds of keys
+	void findMany(const std::vector<key_type> &keys, std::vector<const_iterator> &out) const
+	{
+		out.clear();
+		out.reserve(keys.size());
+		lookupBatch(keys.data(), keys.size(), [&](size_t, size_t index, listIterator position)
+		{
+			if(position == bucketAt(index).end())
+				out.push_back(cend());
+			else
+				out.push_back(ConstIterator(this, index, position));
+		});
+	}
 
-		for(auto it = table[index].begin(); it != table[index].end(); ++it)
+	void findMany(const std::vector<key_type> &keys, std::vector<iterator> &out)
+	{
+		out.clear();
+		out.reserve(keys.size());
+		lookupBatch(keys.data(), keys.size(), [&](size_t, size_t index, listIterator position)
 		{
-			if(it->first == key)
-				return Iterator(ConstIterator(this, index, it));
-		}
-		return end();
+			if(position == bucketAt(index).end())
+				out.push_back(end());
+			else
+				out.push_back(Iterator(ConstIterator(this, index, position)));
+		});
+	}
+
+	std::vector<bool> containsMany(const std::vector<key_type> &keys) const
+	{
+		std::vector<bool> out(keys.size());
+		lookupBatch(keys.data(), keys.size(), [&](size_t i, size_t index, listIterator position)
+		{
+			out[i] = position != bucketAt(index).end();
+		});
+		return out;
 	}
 
 	void remove(const key_type &key)
@@ -173,15 +491,115 @@ public:
 
 	void remove(const const_iterator &it)
 	{
-		size_t index = it.hashIndex;
+		erase(it);
+	}
 
+	// Removes the element and returns the iterator following it, so a sweep can
+	// erase while it walks the map.
+	iterator erase(const const_iterator &it)
+	{
 		if(it == end())
 			throw std::out_of_range("out of range");
 
-		auto position = it.currentIterator;
-
-		table[index].erase(position);
+		size_t index = homeIndex(it.currentIterator->hash);
+		filterRemove(it.currentIterator->hash);
+		auto next = bucketAt(index).erase(it.currentIterator);
 		--addedElements;
+		MAP_STATS(++counters.removes;)
+
+		return Iterator(firstFrom(index, next));
+	}
+
+	// Removes every element for which pred(element) is true in one pass over the
+	// buckets; returns how many were removed.
+	template<typename Predicate>
+	size_type eraseIf(Predicate pred)
+	{
+		size_type removed = 0;
+		for(size_t i = 0; i < bucketSlots(); ++i)
+		{
+			auto &bucket = bucketAt(i);
+			for(auto it = bucket.begin(); it != bucket.end(); )
+			{
+				if(pred(const_cast<const_reference>(it->value)))
+				{
+					filterRemove(it->hash);
+					it = bucket.erase(it);
+					--addedElements;
+					++removed;
+				}
+				else
+					++it;
+			}
+		}
+		MAP_STATS(counters.removes += removed;)
+		return removed;
+	}
+
+	// Unlinks the element and hands over its list node; the handle is empty if
+	// there is no such key. Nothing is copied or freed.
+	NodeHandle extract(const key_type &key)
+	{
+		NodeHandle handle;
+		auto it = find(key);
+		if(it != end())
+		{
+			filterRemove(it.currentIterator->hash);
+			handle.storage.splice(handle.storage.begin(), bucketAt(it.hashIndex), it.currentIterator);
+			--addedElements;
+			MAP_STATS(++counters.removes;)
+		}
+		return handle;
+	}
+
+	NodeHandle extract(const const_iterator &it)
+	{
+		return extract(it->first);
+	}
+
+	// Relinks the handle's node. Returns false and leaves the node in the handle if
+	// the handle is empty or the key is already present.
+	bool insert(NodeHandle &&handle)
+	{
+		if(handle.empty() || find(handle.key()) != end())
+			return false;
+
+		growIfNeeded();
+		size_t hash = handle.storage.front().hash;
+		auto &bucket = bucketAt(homeIndex(hash));
+		bucket.splice(bucket.end(), handle.storage);
+		++addedElements;
+		MAP_STATS(++counters.inserts;)
+		filterAdd(hash);
+		return true;
+	}
+
+	// Moves every element whose key isn't present here out of other, relinking
+	// list nodes instead of reallocating them.
+	void merge(HashMap &other)
+	{
+		if(this == &other)
+			return;
+
+		for(size_t i = 0; i < other.bucketSlots(); ++i)
+		{
+			auto &otherBucket = other.bucketAt(i);
+			for(auto it = otherBucket.begin(); it != otherBucket.end(); )
+			{
+				auto position = it++;
+				if(findPosition(position->hash, position->value.first) != bucketAt(homeIndex(position->hash)).end())
+					continue;
+
+				growIfNeeded();
+				size_t hash = position->hash;
+				auto &bucket = bucketAt(homeIndex(hash));
+				bucket.splice(bucket.end(), otherBucket, position);
+				++addedElements;
+				--other.addedElements;
+				other.filterRemove(hash);
+				filterAdd(hash);
+			}
+		}
 	}
 
 	size_type getSize() const
@@ -189,6 +607,113 @@ public:
 		return addedElements;
 	}
 
+	size_type capacity() const
+	{
+		return buckets;
+	}
+
+	// Attaches a counting Bloom filter that find(), valueOf() and operator[] ask
+	// first, so most misses cost one cache line instead of a chain walk. It is kept
+	// up to date by every insert and removal and rebuilt once the map holds twice
+	// expectedElements (by default its current size, at least DEF_CAPACITY).
+	void enablePrefilter(size_t expectedElements = 0)
+	{
+		prefilter.enable(std::max<size_t>({expectedElements, addedElements, DEF_CAPACITY}));
+		rebuildPrefilter(prefilter.capacity());
+	}
+
+	void disablePrefilter()
+	{
+		prefilter.disable();
+	}
+
+	// With step > 0 growing no longer relinks every node in one insert: the new table
+	// is swapped in and each following insert migrates step old buckets, so no single
+	// operation pays for more than step chains. Lookups, removals and iteration work
+	// across both tables meanwhile. 0, the default, rehashes the whole table at once.
+	// Either way growth only relinks nodes: references stay valid, and iterators with
+	// them, but a walk that spans an insert may skip elements or see them twice.
+	void setRehashStep(size_t step)
+	{
+		rehashStep = step;
+		if(step == 0)
+			finishRehash();
+	}
+
+	// Redistributes the nodes over newBuckets chains by relinking them with their
+	// cached hashes; nothing is allocated besides the new bucket array. References
+	// stay valid; iterators too, but they are in a new order afterwards. The same
+	// holds for reserve() and shrink_to_fit().
+	void rehash(size_t newBuckets)
+	{
+		finishRehash();
+		newBuckets = std::max<size_t>(newBuckets, 1);
+		std::vector< std::list<Entry> > resized(newBuckets);
+
+		for(auto &bucket : table)
+		{
+			while(!bucket.empty())
+			{
+				auto &target = resized[bucket.front().hash % newBuckets];
+				target.splice(target.end(), bucket, bucket.begin());
+			}
+		}
+		table.swap(resized);
+		buckets = newBuckets;
+		++layoutEpoch;
+	}
+
+	void reserve(size_type count)
+	{
+		if(count > buckets * MAX_LOAD_FACTOR)
+			rehash(count / MAX_LOAD_FACTOR + 1);
+	}
+
+	// drops the bucket array down to what the current size needs
+	void shrink_to_fit()
+	{
+		rehash(std::max<size_t>(addedElements / MAX_LOAD_FACTOR + 1, DEF_CAPACITY));
+	}
+
+	// shrink_to_fit and reallocates every node in bucket order, so a scan walks
+	// nodes that were allocated one after another. Elements are moved into the new
+	// nodes, so every reference, pointer and iterator into the map is invalidated.
+	void compact()
+	{
+		finishRehash();
+		size_t newBuckets = std::max<size_t>(addedElements / MAX_LOAD_FACTOR + 1, DEF_CAPACITY);
+		std::vector< std::list<Entry> > packed(newBuckets);
+
+		for(auto &bucket : table)
+		{
+			for(auto &entry : bucket)
+				packed[entry.hash % newBuckets].push_back(std::move(entry));
+		}
+		table.swap(packed);
+		buckets = newBuckets;
+	}
+
+	// bytes held by the map: bucket array, list nodes with their links and
+	// allocator overhead, and heap memory owned by keys and values
+	size_t memoryUsage() const
+	{
+		size_t bytes = sizeof(*this) + heapBlockSize(table.capacity() * sizeof(std::list<Entry>));
+		if(oldTable.capacity() + nextTable.capacity() != 0)
+			bytes += heapBlockSize((oldTable.capacity() + nextTable.capacity()) * sizeof(std::list<Entry>));
+		bytes += addedElements * heapBlockSize(sizeof(Entry) + 2 * sizeof(void *));
+		bytes += prefilter.memoryUsage();
+
+		if(MayOwnHeap<key_type, mapped_type>::value)
+		{
+			for(size_t i = 0; i < bucketSlots(); ++i)
+			{
+				for(auto &entry : bucketAt(i))
+					bytes += ownedBytes(entry.value.first) + ownedBytes(entry.value.second);
+			}
+		}
+		return bytes;
+	}
+
 	bool operator==(const HashMap &other) const
 	{
 		if(addedElements != other.addedElements)
@@ -208,6 +733,88 @@ public:
 		return !(*this == other);
 	}
 
+	// Writes a versioned binary file that HashMapSnapshot maps back read-only without
+	// rehashing or copying; keys and values have to be trivially copyable.
+	void saveSnapshot(const std::string &path) const
+	{
+		writeHashSnapshot<key_type, mapped_type>(path, *this, addedElements);
+	}
+
+	// Immutable copy over a minimal perfect hash for maps that are loaded once and
+	// then only queried; throws invalid_argument if two keys have equal std::hash
+	// values (two NaN keys of a floating point map, say).
+	FrozenHashMap<key_type, mapped_type> freeze() const
+	{
+		return FrozenHashMap<key_type, mapped_type>(begin(), end(), addedElements);
+	}
+
+	HashMapStats stats() const
+	{
+		HashMapStats result;
+		result.size = addedElements;
+		result.pendingRehash = oldTable.size();
+		result.buckets = buckets + result.pendingRehash;
+		result.loadFactor = double(addedElements) / result.buckets;
+
+		for(size_t i = 0; i < bucketSlots(); ++i)
+		{
+			size_t length = bucketAt(i).size();
+			if(length >= result.chainLengths.size())
+				result.chainLengths.resize(length + 1);
+			++result.chainLengths[length];
+			result.longestChain = std::max(result.longestChain, length);
+		}
+		result.emptyBuckets = result.chainLengths.empty() ? 0 : result.chainLengths[0];
+
+		MAP_STATS(result.countersEnabled = true;)
+		MAP_STATS(result.operations = counters;)
+		return result;
+	}
+
+	void dumpStats(std::ostream &out) const
+	{
+		stats().writeJson(out);
+	}
+
+	void resetStats()
+	{
+		MAP_STATS(counters = HashMapCounters{};)
+	}
+
+	// fn is called once for every element, from several threads at once; buckets are
+	// split into contiguous ranges and each range is walked by a single thread.
+	template<typename Function>
+	void parallelForEach(Function fn) const
+	{
+		size_t ranges = bucketRangeCount();
+		parallel::runTasks(ranges, [&](size_t range)
+		{
+			forEachInBucketRange(range, ranges, fn);
+		});
+	}
+
+	template<typename Function>
+	void parallelForEach(Function fn)
+	{
+		const HashMap *self = this;
+		self->parallelForEach([&](const_reference elem)
+		{
+			// ugly cast, yet reduces code duplication.
+			fn(const_cast<reference>(elem));
+		});
+	}
+
+	// combine has to be associative; partial results are combined in iteration order.
+	template<typename T, typename Map, typename Combine>
+	T parallelReduce(T init, Map map, Combine combine) const
+	{
+		size_t ranges = bucketRangeCount();
+		return parallel::reduce(ranges, init, [&](size_t range, auto callback)
+		{
+			forEachInBucketRange(range, ranges, callback);
+		}, map, combine);
+	}
+
 	iterator begin()
 	{
 		return Iterator(cbegin());
@@ -222,17 +829,17 @@ public:
 	{
 		if(addedElements == 0)
 			return cend();
-		for (size_t i = 0; i < buckets ; ++i)
+		for (size_t i = 0; i < bucketSlots() ; ++i)
 		{
-			if(table[i].size() != 0)
-				return ConstIterator(this, i, table[i].begin() );
+			if(bucketAt(i).size() != 0)
+				return ConstIterator(this, i, bucketAt(i).begin() );
 		}
 		return cend();
 	}
 
 	const_iterator cend() const
 	{
-		return ConstIterator(this, buckets);
+		return ConstIterator(this, END_BUCKET);
 	}
 
 	const_iterator begin() const
@@ -247,7 +854,7 @@ public:
 };
 
 template<typename KeyType, typename ValueType>
-class HashMap<KeyType, ValueType>::ConstIterator
+class HashMap<KeyType, ValueType, false>::ConstIterator
 {
 public:
 	using reference = typename HashMap::const_reference;
@@ -262,10 +869,20 @@ private:
 	const HashMap *map = nullptr;
 	size_t hashIndex = 0;
 	listIterator currentIterator = {};
+	size_t layoutEpoch = 0; // map->layoutEpoch when hashIndex was found
 
-	const std::list<value_type> &getTable()
+	const std::list<Entry> &getTable()
 	{
-		return map->table[hashIndex];
+		return map->bucketAt(hashIndex);
+	}
+
+	// growth may have relinked the element into another chain since
+	void relocate()
+	{
+		if(layoutEpoch == map->layoutEpoch)
+			return;
+		layoutEpoch = map->layoutEpoch;
+		hashIndex = map->homeIndex(currentIterator->hash);
 	}
 
 public:
@@ -273,11 +890,12 @@ public:
 	explicit ConstIterator() = default;
 
 	ConstIterator(const HashMap *map, size_t hashIndex, listIterator currentIterator={})
-			: map(map), hashIndex(hashIndex), currentIterator(currentIterator)
+			: map(map), hashIndex(hashIndex), currentIterator(currentIterator), layoutEpoch(map->layoutEpoch)
 	{}
 
 	ConstIterator(const ConstIterator &other)
-			: map(other.map), hashIndex(other.hashIndex), currentIterator(other.currentIterator)
+			: map(other.map), hashIndex(other.hashIndex), currentIterator(other.currentIterator),
+			  layoutEpoch(other.layoutEpoch)
 	{}
 
 	ConstIterator &operator++()
@@ -285,15 +903,16 @@ public:
 		if(map == nullptr)
 			throw std::logic_error("collection not given to iterator");
 
-		if(hashIndex == map->buckets)
+		if(hashIndex == END_BUCKET)
 			throw std::out_of_range("iterator out of range");
 
+		relocate();
 		++currentIterator;
 		while( currentIterator == getTable().end() ) //skip lists which size is 0
 		{
 			++hashIndex;
 
-			if(hashIndex == map->buckets) //if incrementing iterator pointing to last element
+			if(hashIndex == map->bucketSlots()) //if incrementing iterator pointing to last element
 			{
 				*this = map->end();
 				return *this;
@@ -318,11 +937,14 @@ public:
 		if(*this == map->begin())
 			throw std::out_of_range("iterator out of range");
 
-		if(hashIndex == map->buckets)
+		if(hashIndex == END_BUCKET)
 		{
-			--hashIndex;
+			hashIndex = map->bucketSlots() - 1;
+			layoutEpoch = map->layoutEpoch;
 			currentIterator = getTable().end();
 		}
+		else
+			relocate();
 
 		while( currentIterator == getTable().begin() ) //while end == begin skip this list
 		{
@@ -343,10 +965,10 @@ public:
 
 	reference operator*() const
 	{
-		if(hashIndex == map->buckets)
+		if(hashIndex == END_BUCKET)
 			throw std::out_of_range("out of range");
 
-		return *currentIterator;
+		return currentIterator->value;
 	}
 
 	pointer operator->() const
@@ -356,10 +978,8 @@ public:
 
 	bool operator==(const ConstIterator &other) const
 	{
-		if(hashIndex != other.hashIndex)
-			return false;
-		if(hashIndex == map->buckets && other.hashIndex == map->buckets)
-			return true;
+		if(hashIndex == END_BUCKET || other.hashIndex == END_BUCKET)
+			return hashIndex == other.hashIndex;
 
 		return currentIterator == other.currentIterator;
 	}
@@ -371,8 +991,62 @@ public:
 };
 
 
+template<typename KeyType, typename ValueType>
+class HashMap<KeyType, ValueType, false>::NodeHandle
+{
+	friend class HashMap;
+
+	std::list<Entry> storage; //holds the node while it belongs to no map
+
+public:
+	NodeHandle()
+	= default;
+
+	NodeHandle(const NodeHandle &) = delete;
+	NodeHandle &operator=(const NodeHandle &) = delete;
+
+	NodeHandle(NodeHandle &&other)
+	{
+		storage.splice(storage.begin(), other.storage);
+	}
+
+	NodeHandle &operator=(NodeHandle &&other)
+	{
+		if(this != &other)
+		{
+			storage.clear();
+			storage.splice(storage.begin(), other.storage);
+		}
+		return *this;
+	}
+
+	bool empty() const
+	{
+		return storage.empty();
+	}
+
+	explicit operator bool() const
+	{
+		return !empty();
+	}
+
+	const key_type &key() const
+	{
+		if(empty())
+			throw std::logic_error("empty node handle");
+		return storage.front().value.first;
+	}
+
+	mapped_type &mapped()
+	{
+		if(empty())
+			throw std::logic_error("empty node handle");
+		return storage.front().value.second;
+	}
+};
+
 	template<typename KeyType, typename ValueType>
-class HashMap<KeyType, ValueType>::Iterator : public HashMap<KeyType, ValueType>::ConstIterator
+class HashMap<KeyType, ValueType, false>::Iterator : public HashMap<KeyType, ValueType, false>::ConstIterator
 {
 public:
 	using reference = typename HashMap::reference;
@@ -425,4 +1099,7 @@ public:
 
 }
 
+// the open-addressing specialization needs the declarations above
+#include "FlatHashMap.h"
+
 #endif /* AISDI_MAPS_HASHMAP_H */
@@ -0,0 +1,431 @@
+#ifndef AISDI_MAPS_LRUHASHMAP_H
+#define AISDI_MAPS_LRUHASHMAP_H
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <ostream>
+#include <stdexcept>
+#include <utility>
+
+#include "HashMap.h"
+#include "MapStats.h"
+
+namespace aisdi
+{
+
+// Bounded cache on top of the chained HashMap. Every element carries its recency
+// links, so there is no second container: get and put move the element to the front
+// of the recency list and the least recently used elements at its back are evicted
+// once the map holds more than maxEntries elements or maxBytes bytes (0 = no bound).
+//
+// Elements may have a time to live; expired ones are dropped lazily, when a lookup
+// finds them or eviction reaches them, or all at once by purgeExpired().
+//
+// The chained HashMap is forced because its list nodes never move, not even when the
+// table grows, so the links can point at elements directly.
+template<typename KeyType, typename ValueType, typename Clock = std::chrono::steady_clock>
+class LruHashMap
+{
+public:
+	using key_type = KeyType;
+	using mapped_type = ValueType;
+	using size_type = std::size_t;
+	using duration = typename Clock::duration;
+	using time_point = typename Clock::time_point;
+	using const_reference = std::pair<const key_type &, const mapped_type &>;
+	// bytes charged for an element against maxBytes
+	using Weigher = std::function<size_t(const key_type &, const mapped_type &)>;
+
+	class ConstIterator;
+
+	using const_iterator = ConstIterator;
+	using iterator = ConstIterator;
+
+private:
+	struct Slot;
+	using Element = std::pair<const key_type, Slot>;
+
+	struct Slot
+	{
+		mapped_type value{};
+		time_point expiry = time_point::max();
+		size_t bytes = 0;
+		Element *newer = nullptr;
+		Element *older = nullptr;
+	};
+
+	using Storage = HashMap<key_type, Slot, false>;
+
+	Storage storage;
+	Element *newest = nullptr;
+	Element *oldest = nullptr;
+	size_t maxEntries;
+	size_t maxBytes;
+	size_t usedBytes = 0;
+	duration defaultTtl;
+	bool expires; // any element may have an expiry, otherwise the clock is never read
+	Weigher weigh;
+	CacheStats counters;
+
+	static size_t defaultWeight(const key_type &key, const mapped_type &value)
+	{
+		return heapBlockSize(sizeof(Element) + sizeof(size_t) + 2 * sizeof(void *)) + ownedBytes(key) + ownedBytes(value);
+	}
+
+	time_point expiryFor(duration ttl) const
+	{
+		if(ttl <= duration::zero())
+			return time_point::max();
+		return Clock::now() + ttl;
+	}
+
+	bool isExpired(const Slot &slot) const
+	{
+		return expires && slot.expiry != time_point::max() && Clock::now() >= slot.expiry;
+	}
+
+	void unlink(Element *element)
+	{
+		Slot &slot = element->second;
+		(slot.newer != nullptr ? slot.newer->second.older : newest) = slot.older;
+		(slot.older != nullptr ? slot.older->second.newer : oldest) = slot.newer;
+		slot.newer = slot.older = nullptr;
+	}
+
+	void pushFront(Element *element)
+	{
+		Slot &slot = element->second;
+		slot.older = newest;
+		slot.newer = nullptr;
+		(newest != nullptr ? newest->second.newer : oldest) = element;
+		newest = element;
+	}
+
+	void moveToFront(Element *element)
+	{
+		if(element == newest)
+			return;
+		unlink(element);
+		pushFront(element);
+	}
+
+	void erase(typename Storage::iterator it)
+	{
+		Element *element = &*it;
+		unlink(element);
+		usedBytes -= element->second.bytes;
+		storage.erase(it);
+	}
+
+	bool overBounds() const
+	{
+		return (maxEntries != 0 && storage.getSize() > maxEntries) || (maxBytes != 0 && usedBytes > maxBytes);
+	}
+
+	void evict()
+	{
+		while(overBounds() && oldest != nullptr)
+		{
+			if(isExpired(oldest->second))
+				++counters.expirations;
+			else
+				++counters.evictions;
+			erase(storage.find(oldest->first));
+		}
+	}
+
+	// the live element with key, nullptr (counting the miss) if there is none
+	Element *lookup(const key_type &key)
+	{
+		auto it = storage.find(key);
+		if(it == storage.end())
+		{
+			++counters.misses;
+			return nullptr;
+		}
+		if(isExpired(it->second))
+		{
+			++counters.expirations;
+			++counters.misses;
+			erase(it);
+			return nullptr;
+		}
+		++counters.hits;
+		return &*it;
+	}
+
+public:
+	explicit LruHashMap(size_t maxEntries, size_t maxBytes = 0, duration ttl = duration::zero(),
+	                    Weigher weigh = defaultWeight)
+			: maxEntries(maxEntries), maxBytes(maxBytes), defaultTtl(ttl), expires(ttl > duration::zero()),
+			  weigh(std::move(weigh))
+	{}
+
+	// links point into this map's nodes, a copy would have to relink every element
+	LruHashMap(const LruHashMap &) = delete;
+	LruHashMap &operator=(const LruHashMap &) = delete;
+
+	LruHashMap(LruHashMap &&other)
+			: storage(std::move(other.storage)), newest(other.newest), oldest(other.oldest),
+			  maxEntries(other.maxEntries), maxBytes(other.maxBytes), usedBytes(other.usedBytes),
+			  defaultTtl(other.defaultTtl), expires(other.expires), weigh(other.weigh), counters(other.counters)
+	{
+		other.storage = Storage();
+		other.newest = other.oldest = nullptr;
+		other.usedBytes = 0;
+	}
+
+	LruHashMap &operator=(LruHashMap &&other) = delete;
+
+	// Value for key, refreshed as the most recently used; nullptr on a miss or if
+	// the element has expired. The pointer is valid until the next put or remove.
+	mapped_type *get(const key_type &key)
+	{
+		Element *element = lookup(key);
+		if(element == nullptr)
+			return nullptr;
+		moveToFront(element);
+		return &element->second.value;
+	}
+
+	// like get, but leaves the recency order and the counters alone
+	const mapped_type *peek(const key_type &key) const
+	{
+		auto it = storage.find(key);
+		if(it == storage.end() || isExpired(it->second))
+			return nullptr;
+		return &it->second.value;
+	}
+
+	bool contains(const key_type &key) const
+	{
+		return peek(key) != nullptr;
+	}
+
+	// Inserts or overwrites key as the most recently used element and evicts what no
+	// longer fits; ttl <= 0 means the element never expires.
+	void put(const key_type &key, mapped_type value, duration ttl)
+	{
+		if(ttl > duration::zero())
+			expires = true;
+
+		auto found = storage.findOrInsert(key);
+		Element *element = &*found.first;
+		Slot &slot = element->second;
+
+		usedBytes -= slot.bytes;
+		slot.value = std::move(value);
+		slot.expiry = expiryFor(ttl);
+		slot.bytes = weigh(key, slot.value);
+		usedBytes += slot.bytes;
+
+		if(found.second)
+			pushFront(element);
+		else
+			moveToFront(element);
+		evict();
+	}
+
+	void put(const key_type &key, mapped_type value)
+	{
+		put(key, std::move(value), defaultTtl);
+	}
+
+	bool remove(const key_type &key)
+	{
+		auto it = storage.find(key);
+		if(it == storage.end())
+			return false;
+		erase(it);
+		return true;
+	}
+
+	// drops every expired element; returns how many there were
+	size_type purgeExpired()
+	{
+		if(!expires)
+			return 0;
+
+		size_type purged = 0;
+		for(Element *element = oldest; element != nullptr; )
+		{
+			Element *newer = element->second.newer;
+			if(isExpired(element->second))
+			{
+				erase(storage.find(element->first));
+				++purged;
+			}
+			element = newer;
+		}
+		counters.expirations += purged;
+		return purged;
+	}
+
+	void clear()
+	{
+		storage = Storage();
+		newest = oldest = nullptr;
+		usedBytes = 0;
+	}
+
+	// elements held, expired ones not dropped yet included
+	size_type getSize() const
+	{
+		return storage.getSize();
+	}
+
+	bool isEmpty() const
+	{
+		return storage.isEmpty();
+	}
+
+	size_type capacity() const
+	{
+		return maxEntries;
+	}
+
+	size_t byteSize() const
+	{
+		return usedBytes;
+	}
+
+	size_t memoryUsage() const
+	{
+		return sizeof(*this) - sizeof(Storage) + storage.memoryUsage();
+	}
+
+	CacheStats stats() const
+	{
+		CacheStats result = counters;
+		result.size = storage.getSize();
+		result.maxEntries = maxEntries;
+		result.bytes = usedBytes;
+		result.maxBytes = maxBytes;
+		return result;
+	}
+
+	void dumpStats(std::ostream &out) const
+	{
+		stats().writeJson(out);
+	}
+
+	void resetStats()
+	{
+		counters = CacheStats{};
+	}
+
+	// from the most to the least recently used element
+	const_iterator begin() const
+	{
+		return ConstIterator(newest);
+	}
+
+	const_iterator end() const
+	{
+		return ConstIterator(nullptr);
+	}
+
+	const_iterator cbegin() const
+	{
+		return begin();
+	}
+
+	const_iterator cend() const
+	{
+		return end();
+	}
+};
+
+// A cache whose elements expire ttl after they were last put; maxEntries and
+// maxBytes bound it like LruHashMap and are unbounded by default.
+template<typename KeyType, typename ValueType, typename Clock = std::chrono::steady_clock>
+class TtlHashMap : public LruHashMap<KeyType, ValueType, Clock>
+{
+public:
+	explicit TtlHashMap(typename Clock::duration ttl, size_t maxEntries = 0, size_t maxBytes = 0)
+			: LruHashMap<KeyType, ValueType, Clock>(maxEntries, maxBytes, ttl)
+	{
+		if(ttl <= Clock::duration::zero())
+			throw std::invalid_argument("time to live has to be positive");
+	}
+};
+
+template<typename KeyType, typename ValueType, typename Clock>
+class LruHashMap<KeyType, ValueType, Clock>::ConstIterator
+{
+public:
+	using reference = typename LruHashMap::const_reference;
+	using iterator_category = std::forward_iterator_tag;
+	using value_type = std::pair<const KeyType, ValueType>;
+	using difference_type = std::ptrdiff_t;
+
+	// the element's value sits inside the cache slot, so -> hands out a temporary
+	// pair of references
+	class pointer
+	{
+		reference entry;
+
+	public:
+		explicit pointer(reference entry) : entry(entry)
+		{}
+
+		const reference *operator->() const
+		{
+			return &entry;
+		}
+	};
+
+	friend class LruHashMap;
+
+private:
+	const Element *element = nullptr;
+
+	explicit ConstIterator(const Element *element) : element(element)
+	{}
+
+public:
+	ConstIterator() = default;
+
+	ConstIterator &operator++()
+	{
+		if(element == nullptr)
+			throw std::out_of_range("out of range incrementing");
+		element = element->second.older;
+		return *this;
+	}
+
+	ConstIterator operator++(int)
+	{
+		auto it = *this;
+		operator++();
+		return it;
+	}
+
+	reference operator*() const
+	{
+		if(element == nullptr)
+			throw std::out_of_range("out of range");
+		return reference(element->first, element->second.value);
+	}
+
+	pointer operator->() const
+	{
+		return pointer(operator*());
+	}
+
+	bool operator==(const ConstIterator &other) const
+	{
+		return element == other.element;
+	}
+
+	bool operator!=(const ConstIterator &other) const
+	{
+		return !(*this == other);
+	}
+};
+
+}
+
+#endif /* AISDI_MAPS_LRUHASHMAP_H */
@@ -0,0 +1,463 @@
+#ifndef AISDI_MAPS_MAPLOADER_H
+#define AISDI_MAPS_MAPLOADER_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <istream>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "Snapshot.h"
+#include "TreeMap.h"
+
+#define LOADER_CHUNK_SIZE (1 << 20)
+#define LOADER_BATCH 4096
+#define LOADER_QUEUE_DEPTH 8
+
+namespace aisdi
+{
+
+// Bulk loading of key/value dumps into any of the maps. A parser thread reads the
+// input in large chunks, parses keys and values straight out of the read buffer and
+// hands batches of records over a bounded queue to the calling thread, which
+// inserts them.
+//
+// text:   key<delimiter>value per line, "\n" or "\r\n" line ends, empty lines skipped
+// binary: uint32_t key length, key bytes, uint32_t value length, value bytes per
+//         record, native byte order; strings are stored as their characters,
+//         other types as their raw bytes
+
+enum LoadFormat
+{
+	TEXT_FORMAT,
+	BINARY_FORMAT
+};
+
+struct LoadOptions
+{
+	LoadFormat format = TEXT_FORMAT;
+	char delimiter = '\t';
+	size_t chunkSize = LOADER_CHUNK_SIZE; // stream reads; grows for longer records
+	size_t queueDepth = LOADER_QUEUE_DEPTH; // batches the parser may run ahead
+};
+
+inline void parseField(const char *bytes, size_t length, std::string &out)
+{
+	out.assign(bytes, length);
+}
+
+template<typename T>
+typename std::enable_if<std::is_integral<T>::value>::type parseField(const char *bytes, size_t length, T &out)
+{
+	using Wide = unsigned long long;
+	const char *end = bytes + length;
+
+	bool negative = false;
+	if(bytes != end && (*bytes == '-' || *bytes == '+'))
+		negative = *bytes++ == '-';
+	if(bytes == end)
+		throw std::invalid_argument("not a number");
+	if(negative && !std::is_signed<T>::value)
+		throw std::out_of_range("number out of range");
+
+	Wide limit = static_cast<Wide>(std::numeric_limits<T>::max()) + (negative ? 1 : 0);
+	Wide value = 0;
+	for(; bytes != end; ++bytes)
+	{
+		unsigned digit = static_cast<unsigned char>(*bytes) - '0';
+		if(digit > 9)
+			throw std::invalid_argument("not a number");
+		if(value > (limit - digit) / 10)
+			throw std::out_of_range("number out of range");
+		value = value * 10 + digit;
+	}
+
+	if(negative && value > 0)
+		out = static_cast<T>(-static_cast<long long>(value - 1) - 1);
+	else
+		out = static_cast<T>(value);
+}
+
+template<typename T>
+typename std::enable_if<std::is_floating_point<T>::value>::type parseField(const char *bytes, size_t length, T &out)
+{
+	char buffer[64]; // strtold needs a terminated string
+	if(length == 0 || length >= sizeof(buffer))
+		throw std::invalid_argument("not a number");
+	std::memcpy(buffer, bytes, length);
+	buffer[length] = '\0';
+
+	char *end = nullptr;
+	long double value = std::strtold(buffer, &end);
+	if(end != buffer + length)
+		throw std::invalid_argument("not a number");
+	out = static_cast<T>(value);
+}
+
+inline void readField(const char *bytes, size_t length, std::string &out)
+{
+	out.assign(bytes, length);
+}
+
+template<typename T>
+void readField(const char *bytes, size_t length, T &out)
+{
+	static_assert(std::is_trivially_copyable<T>::value, "binary fields have to be strings or trivially copyable");
+	if(length != sizeof(T))
+		throw std::runtime_error("field size doesn't match the type");
+	std::memcpy(&out, bytes, sizeof(T));
+}
+
+template<typename KeyType, typename ValueType>
+class RecordParser
+{
+public:
+	using Record = std::pair<KeyType, ValueType>;
+
+private:
+	LoadOptions options;
+	size_t records = 0; // lines or binary records seen, for error messages
+
+	std::string position() const
+	{
+		return (options.format == TEXT_FORMAT ? "line " : "record ") + std::to_string(records);
+	}
+
+	template<typename Emit>
+	void parseLine(const char *begin, const char *end, Emit &emit)
+	{
+		++records;
+		if(end != begin && end[-1] == '\r')
+			--end;
+		if(end == begin)
+			return;
+
+		auto delimiter = static_cast<const char *>(std::memchr(begin, options.delimiter, end - begin));
+		if(delimiter == nullptr)
+			throw std::runtime_error(position() + " has no delimiter");
+
+		Record record;
+		try
+		{
+			parseField(begin, delimiter - begin, record.first);
+			parseField(delimiter + 1, end - delimiter - 1, record.second);
+		}
+		catch(std::exception &error)
+		{
+			throw std::runtime_error(position() + ": " + error.what());
+		}
+		emit(std::move(record));
+	}
+
+	template<typename Emit>
+	size_t parseText(const char *begin, const char *end, bool atEnd, Emit &emit)
+	{
+		const char *current = begin;
+		while(current != end)
+		{
+			auto newline = static_cast<const char *>(std::memchr(current, '\n', end - current));
+			if(newline == nullptr && !atEnd)
+				break;
+
+			parseLine(current, newline != nullptr ? newline : end, emit);
+			current = newline != nullptr ? newline + 1 : end;
+		}
+		return current - begin;
+	}
+
+	template<typename Emit>
+	size_t parseBinary(const char *begin, const char *end, bool atEnd, Emit &emit)
+	{
+		const char *current = begin;
+		while(true)
+		{
+			uint64_t available = end - current;
+			uint32_t keyLength, valueLength;
+			if(available < sizeof(uint32_t))
+				break;
+			std::memcpy(&keyLength, current, sizeof(uint32_t));
+			if(available < 2 * sizeof(uint32_t) + uint64_t{keyLength})
+				break;
+			std::memcpy(&valueLength, current + sizeof(uint32_t) + keyLength, sizeof(uint32_t));
+			if(available < 2 * sizeof(uint32_t) + uint64_t{keyLength} + valueLength)
+				break;
+
+			++records;
+			Record record;
+			try
+			{
+				readField(current + sizeof(uint32_t), keyLength, record.first);
+				readField(current + 2 * sizeof(uint32_t) + keyLength, valueLength, record.second);
+			}
+			catch(std::exception &error)
+			{
+				throw std::runtime_error(position() + ": " + error.what());
+			}
+			emit(std::move(record));
+			current += 2 * sizeof(uint32_t) + keyLength + valueLength;
+		}
+
+		if(atEnd && current != end)
+			throw std::runtime_error("truncated record after " + position());
+		return current - begin;
+	}
+
+public:
+	explicit RecordParser(const LoadOptions &options) : options(options)
+	{}
+
+	// Parses the complete records in begin ... end and returns how many bytes they
+	// took; the rest has to be passed again with more input. With atEnd there is no
+	// more input and a partial record is an error.
+	template<typename Emit>
+	size_t parse(const char *begin, const char *end, bool atEnd, Emit emit)
+	{
+		if(options.format == TEXT_FORMAT)
+			return parseText(begin, end, atEnd, emit);
+		return parseBinary(begin, end, atEnd, emit);
+	}
+};
+
+template<typename T>
+class BoundedQueue
+{
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::deque<T> items;
+	size_t limit;
+	bool closed = false;
+	bool cancelled = false;
+
+public:
+	explicit BoundedQueue(size_t limit) : limit(std::max<size_t>(limit, 1))
+	{}
+
+	// waits for room; false if the consumer gave up
+	bool push(T item)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [&] { return items.size() < limit || cancelled; });
+		if(cancelled)
+			return false;
+		items.push_back(std::move(item));
+		changed.notify_all();
+		return true;
+	}
+
+	// waits for an item; false once the queue is closed and drained
+	bool pop(T &item)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [&] { return !items.empty() || closed; });
+		if(items.empty())
+			return false;
+		item = std::move(items.front());
+		items.pop_front();
+		changed.notify_all();
+		return true;
+	}
+
+	void close()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		changed.notify_all();
+	}
+
+	void cancel()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		cancelled = true;
+		items.clear();
+		changed.notify_all();
+	}
+};
+
+// how records get into a map; later records overwrite earlier ones with the same key
+template<typename Map>
+class MapInserter
+{
+	Map &map;
+
+public:
+	explicit MapInserter(Map &map) : map(map)
+	{}
+
+	void insert(std::pair<typename Map::key_type, typename Map::mapped_type> &&record)
+	{
+		map[record.first] = std::move(record.second);
+	}
+
+	void finish()
+	{}
+};
+
+// An empty TreeMap collects records while their keys keep increasing and builds the
+// tree from them in linear time; the first out-of-order key builds it from what was
+// collected so far and the rest is inserted one by one.
+template<typename KeyType, typename ValueType>
+class MapInserter<TreeMap<KeyType, ValueType>>
+{
+	TreeMap<KeyType, ValueType> &map;
+	bool collecting;
+	std::vector<std::pair<KeyType, ValueType>> sorted;
+
+	void build()
+	{
+		map.assignSorted(sorted.begin(), sorted.end());
+		sorted = std::vector<std::pair<KeyType, ValueType>>();
+		collecting = false;
+	}
+
+public:
+	explicit MapInserter(TreeMap<KeyType, ValueType> &map) : map(map), collecting(map.isEmpty())
+	{}
+
+	void insert(std::pair<KeyType, ValueType> &&record)
+	{
+		if(collecting)
+		{
+			if(sorted.empty() || sorted.back().first < record.first)
+			{
+				sorted.push_back(std::move(record));
+				return;
+			}
+			build();
+		}
+		map[record.first] = std::move(record.second);
+	}
+
+	void finish()
+	{
+		if(collecting)
+			build();
+	}
+};
+
+struct LoadCancelled
+{};
+
+// produce(emit) runs on the parser thread and calls emit(record) for every record
+template<typename Map, typename Produce>
+size_t runLoad(Map &map, const LoadOptions &options, Produce produce)
+{
+	using Record = std::pair<typename Map::key_type, typename Map::mapped_type>;
+	using Batch = std::vector<Record>;
+
+	BoundedQueue<Batch> queue(options.queueDepth);
+	std::exception_ptr parseError;
+
+	std::thread parser([&]
+	{
+		Batch batch;
+		try
+		{
+			batch.reserve(LOADER_BATCH);
+			produce([&](Record &&record)
+			{
+				batch.push_back(std::move(record));
+				if(batch.size() == LOADER_BATCH)
+				{
+					if(!queue.push(std::move(batch)))
+						throw LoadCancelled();
+					batch.clear();
+					batch.reserve(LOADER_BATCH);
+				}
+			});
+		}
+		catch(LoadCancelled &)
+		{}
+		catch(...)
+		{
+			parseError = std::current_exception();
+		}
+		// records parsed before an error still get inserted
+		if(!batch.empty())
+			queue.push(std::move(batch));
+		queue.close();
+	});
+
+	size_t loaded = 0;
+	try
+	{
+		MapInserter<Map> inserter(map);
+		Batch batch;
+		while(queue.pop(batch))
+		{
+			for(auto &record : batch)
+				inserter.insert(std::move(record));
+			loaded += batch.size();
+		}
+		inserter.finish();
+	}
+	catch(...)
+	{
+		queue.cancel();
+		parser.join();
+		throw;
+	}
+
+	parser.join();
+	if(parseError)
+		std::rethrow_exception(parseError);
+	return loaded;
+}
+
+// Loads a whole file through a read-only mapping; returns the number of records.
+template<typename Map>
+size_t loadMap(Map &map, const std::string &path, const LoadOptions &options = LoadOptions())
+{
+	MappedFile file(path, MADV_SEQUENTIAL);
+
+	return runLoad(map, options, [&](auto emit)
+	{
+		RecordParser<typename Map::key_type, typename Map::mapped_type> parser(options);
+		parser.parse(file.bytes(), file.bytes() + file.getSize(), true, emit);
+	});
+}
+
+// Loads from a stream read in options.chunkSize pieces; the stream is read by the
+// parser thread until the call returns.
+template<typename Map>
+size_t loadMap(Map &map, std::istream &in, const LoadOptions &options = LoadOptions())
+{
+	return runLoad(map, options, [&](auto emit)
+	{
+		RecordParser<typename Map::key_type, typename Map::mapped_type> parser(options);
+		std::vector<char> buffer(std::max<size_t>(options.chunkSize, 64));
+		size_t filled = 0;
+		bool atEnd = false;
+
+		while(!atEnd)
+		{
+			if(filled == buffer.size()) // a record longer than the buffer
+				buffer.resize(2 * buffer.size());
+
+			in.read(buffer.data() + filled, static_cast<std::streamsize>(buffer.size() - filled));
+			filled += static_cast<size_t>(in.gcount());
+			if(in.bad())
+				throw std::runtime_error("can't read the input stream");
+			atEnd = !in;
+
+			size_t consumed = parser.parse(buffer.data(), buffer.data() + filled, atEnd, emit);
+			std::memmove(buffer.data(), buffer.data() + consumed, filled - consumed);
+			filled -= consumed;
+		}
+	});
+}
+
+}
+
+#endif /* AISDI_MAPS_MAPLOADER_H */
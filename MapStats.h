@@ -0,0 +1,238 @@
+#ifndef AISDI_MAPS_MAPSTATS_H
+#define AISDI_MAPS_MAPSTATS_H
+
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Operation counters are compiled in only with -DAISDI_MAPS_STATS, otherwise every
+// MAP_STATS(...) disappears and the maps carry no extra members. Structural stats
+// (chain lengths, tree height) are computed on demand and are always available.
+#ifdef AISDI_MAPS_STATS
+#define MAP_STATS(statement) statement
+#else
+#define MAP_STATS(statement)
+#endif
+
+namespace aisdi
+{
+
+// memoryUsage() estimates: what a heap block of the given size really takes with a
+// glibc-like allocator (8 byte header, 16 byte granularity, 32 byte minimum)
+inline size_t heapBlockSize(size_t bytes)
+{
+	size_t block = (bytes + 8 + 15) / 16 * 16;
+	return block < 32 ? 32 : block;
+}
+
+// heap memory owned by a key or value besides its own bytes
+template<typename T>
+size_t ownedBytes(const T &)
+{
+	return 0;
+}
+
+inline size_t ownedBytes(const std::string &text)
+{
+	// short strings live inside the object
+	return text.capacity() > std::string().capacity() ? heapBlockSize(text.capacity() + 1) : 0;
+}
+
+// only types that aren't trivially copyable can own heap memory, elements of the
+// others needn't be visited
+template<typename KeyType, typename ValueType>
+struct MayOwnHeap : std::integral_constant<bool,
+		!std::is_trivially_copyable<KeyType>::value || !std::is_trivially_copyable<ValueType>::value>
+{};
+
+struct HashMapCounters
+{
+	size_t inserts = 0;
+	size_t lookups = 0;
+	size_t lookupHits = 0;
+	size_t probes = 0; // chain entries compared by lookups
+	size_t removes = 0;
+	size_t filterRejects = 0; // lookups the prefilter answered on its own
+
+	void writeJson(std::ostream &out) const
+	{
+		out << "{\"inserts\": " << inserts << ", \"lookups\": " << lookups << ", \"lookupHits\": " << lookupHits
+		    << ", \"probes\": " << probes << ", \"removes\": " << removes << ", \"filterRejects\": " << filterRejects << "}";
+	}
+};
+
+struct TreeMapCounters
+{
+	size_t inserts = 0;
+	size_t lookups = 0;
+	size_t lookupHits = 0;
+	size_t descentSteps = 0; // nodes visited by lookups
+	size_t removes = 0;
+	size_t rotationsLL = 0;
+	size_t rotationsRR = 0;
+	size_t rotationsLR = 0;
+	size_t rotationsRL = 0;
+	size_t filterRejects = 0; // lookups the prefilter answered on its own
+
+	void writeJson(std::ostream &out) const
+	{
+		out << "{\"inserts\": " << inserts << ", \"lookups\": " << lookups << ", \"lookupHits\": " << lookupHits
+		    << ", \"descentSteps\": " << descentSteps << ", \"removes\": " << removes << ", \"filterRejects\": " << filterRejects
+		    << ", \"rotations\": {\"LL\": " << rotationsLL << ", \"RR\": " << rotationsRR
+		    << ", \"LR\": " << rotationsLR << ", \"RL\": " << rotationsRL << "}}";
+	}
+};
+
+struct HashMapStats
+{
+	size_t size = 0;
+	size_t buckets = 0;
+	size_t emptyBuckets = 0;
+	size_t longestChain = 0;
+	double loadFactor = 0;
+	std::vector<size_t> chainLengths; // chainLengths[n] = buckets holding n entries
+	std::vector<size_t> probeLengths; // open addressing: probeLengths[n] = entries found by the n-th probe
+	size_t pendingRehash = 0; // chained, incremental rehash: old buckets not migrated yet
+	bool countersEnabled = false;
+	HashMapCounters operations;
+
+	double averageProbes() const
+	{
+		return operations.lookups == 0 ? 0 : double(operations.probes) / operations.lookups;
+	}
+
+	void writeJson(std::ostream &out) const
+	{
+		out << "{\"size\": " << size << ", \"buckets\": " << buckets << ", \"emptyBuckets\": " << emptyBuckets
+		    << ", \"loadFactor\": " << loadFactor << ", \"longestChain\": " << longestChain << ", \"chainLengths\": [";
+		for(size_t i = 0; i < chainLengths.size(); ++i)
+			out << (i ? ", " : "") << chainLengths[i];
+		out << "]";
+		if(!probeLengths.empty())
+		{
+			out << ", \"probeLengths\": [";
+			for(size_t i = 0; i < probeLengths.size(); ++i)
+				out << (i ? ", " : "") << probeLengths[i];
+			out << "]";
+		}
+		if(pendingRehash != 0)
+			out << ", \"pendingRehash\": " << pendingRehash;
+		if(countersEnabled)
+		{
+			out << ", \"averageProbes\": " << averageProbes() << ", \"operations\": ";
+			operations.writeJson(out);
+		}
+		out << "}";
+	}
+};
+
+// Cache counters are always kept, they are part of what a cache is for.
+struct CacheStats
+{
+	size_t size = 0;
+	size_t maxEntries = 0; // 0 = no bound
+	size_t bytes = 0;
+	size_t maxBytes = 0;   // 0 = no bound
+	size_t hits = 0;
+	size_t misses = 0;
+	size_t evictions = 0;  // dropped to stay within the bounds
+	size_t expirations = 0; // dropped because their time to live ran out
+
+	double hitRate() const
+	{
+		return hits + misses == 0 ? 0 : double(hits) / (hits + misses);
+	}
+
+	void writeJson(std::ostream &out) const
+	{
+		out << "{\"size\": " << size << ", \"maxEntries\": " << maxEntries << ", \"bytes\": " << bytes
+		    << ", \"maxBytes\": " << maxBytes << ", \"hits\": " << hits << ", \"misses\": " << misses
+		    << ", \"hitRate\": " << hitRate() << ", \"evictions\": " << evictions
+		    << ", \"expirations\": " << expirations << "}";
+	}
+};
+
+// Spill counters are always kept too, they say whether the memory budget fits the
+// working set.
+struct SpillStats
+{
+	size_t size = 0;
+	size_t partitions = 0;
+	size_t hotElements = 0;   // elements held in memory
+	size_t residentBytes = 0; // hot elements and the in-memory indexes of spilled ones
+	size_t memoryBudget = 0;
+	size_t spilledBytes = 0;  // spill files, dead records included
+	size_t evictions = 0;     // elements written out to stay within the budget
+	size_t fileWrites = 0;
+	size_t pageIns = 0;       // elements read back from spill files
+	size_t filterRejects = 0; // lookups of spilled keys answered without reading a file
+
+	void writeJson(std::ostream &out) const
+	{
+		out << "{\"size\": " << size << ", \"partitions\": " << partitions << ", \"hotElements\": " << hotElements
+		    << ", \"residentBytes\": " << residentBytes << ", \"memoryBudget\": " << memoryBudget
+		    << ", \"spilledBytes\": " << spilledBytes << ", \"evictions\": " << evictions << ", \"fileWrites\": " << fileWrites
+		    << ", \"pageIns\": " << pageIns << ", \"filterRejects\": " << filterRejects << "}";
+	}
+};
+
+struct TreeMapStats
+{
+	size_t size = 0;
+	int height = 0;
+	int optimalHeight = 0; // height of a perfectly balanced tree of the same size
+	bool countersEnabled = false;
+	TreeMapCounters operations;
+
+	double averageLookupDepth() const
+	{
+		return operations.lookups == 0 ? 0 : double(operations.descentSteps) / operations.lookups;
+	}
+
+	void writeJson(std::ostream &out) const
+	{
+		out << "{\"size\": " << size << ", \"height\": " << height << ", \"optimalHeight\": " << optimalHeight;
+		if(countersEnabled)
+		{
+			out << ", \"averageLookupDepth\": " << averageLookupDepth() << ", \"operations\": ";
+			operations.writeJson(out);
+		}
+		out << "}";
+	}
+};
+
+// RadixTreeMap uses the TreeMap counters; descentSteps counts nodes, not comparisons
+struct RadixTreeStats
+{
+	size_t size = 0;
+	int height = 0; // nodes on the longest root to leaf path
+	size_t nodes4 = 0;
+	size_t nodes16 = 0;
+	size_t nodes48 = 0;
+	size_t nodes256 = 0;
+	bool countersEnabled = false;
+	TreeMapCounters operations;
+
+	double averageLookupDepth() const
+	{
+		return operations.lookups == 0 ? 0 : double(operations.descentSteps) / operations.lookups;
+	}
+
+	void writeJson(std::ostream &out) const
+	{
+		out << "{\"size\": " << size << ", \"height\": " << height << ", \"nodes\": {\"4\": " << nodes4
+		    << ", \"16\": " << nodes16 << ", \"48\": " << nodes48 << ", \"256\": " << nodes256 << "}";
+		if(countersEnabled)
+		{
+			out << ", \"averageLookupDepth\": " << averageLookupDepth() << ", \"operations\": ";
+			operations.writeJson(out);
+		}
+		out << "}";
+	}
+};
+
+}
+
+#endif /* AISDI_MAPS_MAPSTATS_H */
@@ -0,0 +1,398 @@
+#ifndef AISDI_MAPS_MAPTRACE_H
+#define AISDI_MAPS_MAPTRACE_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "Snapshot.h"
+
+#define TRACE_FORMAT_VERSION 1
+#define TRACE_BUFFER_RECORDS 4096
+
+namespace aisdi
+{
+
+// Trace files are read by the build that wrote them, in native byte order.
+//
+// layout: TraceHeader | TraceRecord records[...]
+// a trace cut short by a crash loses at most its last, partial record
+
+enum TraceOperation : uint8_t
+{
+	TRACE_INSERT = 0,
+	TRACE_FIND = 1,
+	TRACE_REMOVE = 2,
+	TRACE_ITERATE = 3
+};
+
+// what key fingerprints are
+enum TraceKeys : uint32_t
+{
+	TRACE_INTEGER_KEYS = 1, // the keys themselves
+	TRACE_HASHED_KEYS = 2   // std::hash of the keys
+};
+
+struct TraceHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint32_t keys;
+	uint32_t reserved;
+};
+
+struct TraceRecord
+{
+	uint64_t key;      // fingerprint of the key; the map's size for TRACE_ITERATE
+	uint32_t nanos;    // how long the operation took, saturated
+	uint8_t operation;
+	uint8_t hit;       // the key was there: found, overwritten or removed
+	uint16_t reserved;
+};
+
+static_assert(sizeof(TraceRecord) == 16, "trace records are 16 bytes");
+
+// Integer keys are recorded as they are, so a replay keeps their order and
+// locality; other keys only as their hash, which keeps them out of the trace.
+template<typename KeyType>
+typename std::enable_if<std::is_integral<KeyType>::value, uint64_t>::type traceFingerprint(const KeyType &key)
+{
+	return static_cast<uint64_t>(key);
+}
+
+template<typename KeyType>
+typename std::enable_if<!std::is_integral<KeyType>::value, uint64_t>::type traceFingerprint(const KeyType &key)
+{
+	return std::hash<KeyType>{}(key);
+}
+
+template<typename KeyType>
+TraceKeys traceKeys()
+{
+	return std::is_integral<KeyType>::value ? TRACE_INTEGER_KEYS : TRACE_HASHED_KEYS;
+}
+
+// Appends records to a trace file, TRACE_BUFFER_RECORDS at a time.
+class TraceWriter
+{
+	std::string path;
+	std::ofstream out;
+	std::vector<TraceRecord> buffer;
+	size_t written = 0;
+
+public:
+	TraceWriter(const std::string &path, TraceKeys keys) : path(path), out(path, std::ios::binary | std::ios::trunc)
+	{
+		if(!out)
+			throw std::runtime_error("can't open " + path + " for writing");
+
+		TraceHeader header;
+		std::memset(&header, 0, sizeof(header));
+		std::memcpy(header.magic, "AISDITRC", sizeof(header.magic));
+		header.version = TRACE_FORMAT_VERSION;
+		header.byteOrder = SNAPSHOT_BYTE_ORDER;
+		header.keys = keys;
+		writeBytes(out, &header, sizeof(header));
+		buffer.reserve(TRACE_BUFFER_RECORDS);
+	}
+
+	TraceWriter(const TraceWriter &) = delete;
+	TraceWriter &operator=(const TraceWriter &) = delete;
+
+	// a failed final write can't be reported from here, flush() first to see it
+	~TraceWriter()
+	{
+		try
+		{
+			flush();
+		}
+		catch(const std::runtime_error &)
+		{}
+	}
+
+	void record(TraceOperation operation, uint64_t key, std::chrono::nanoseconds elapsed, bool hit)
+	{
+		TraceRecord entry;
+		entry.key = key;
+		entry.nanos = elapsed.count() < 0 ? 0 : elapsed.count() > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(elapsed.count());
+		entry.operation = operation;
+		entry.hit = hit;
+		entry.reserved = 0;
+		buffer.push_back(entry);
+		if(buffer.size() == TRACE_BUFFER_RECORDS)
+			flush();
+	}
+
+	void flush()
+	{
+		writeBytes(out, buffer.data(), buffer.size() * sizeof(TraceRecord));
+		written += buffer.size();
+		buffer.clear();
+		out.flush();
+		if(!out)
+			throw std::runtime_error("can't write " + path);
+	}
+
+	// records so far, buffered ones included
+	size_t size() const
+	{
+		return written + buffer.size();
+	}
+};
+
+// Read-only view of a trace file; records are read straight from the mapping.
+class TraceReader
+{
+	MappedFile file;
+	TraceHeader header;
+	const TraceRecord *records = nullptr;
+	size_t count = 0;
+
+public:
+	using const_iterator = const TraceRecord *;
+
+	explicit TraceReader(const std::string &path) : file(path, MADV_SEQUENTIAL)
+	{
+		if(file.getSize() < sizeof(header))
+			throw std::runtime_error(path + " is truncated");
+		std::memcpy(&header, file.bytes(), sizeof(header));
+		if(std::memcmp(header.magic, "AISDITRC", sizeof(header.magic)) != 0)
+			throw std::runtime_error(path + " isn't a map trace");
+		if(header.version != TRACE_FORMAT_VERSION || header.byteOrder != SNAPSHOT_BYTE_ORDER)
+			throw std::runtime_error("unsupported trace version or byte order");
+
+		records = reinterpret_cast<const TraceRecord *>(file.bytes() + sizeof(header));
+		count = (file.getSize() - sizeof(header)) / sizeof(TraceRecord);
+		// readers index by operation, so a corrupt or newer trace is turned away here
+		for(const TraceRecord &record : *this)
+		{
+			if(record.operation > TRACE_ITERATE)
+				throw std::runtime_error(path + " has an unknown operation");
+		}
+	}
+
+	TraceKeys keys() const
+	{
+		return static_cast<TraceKeys>(header.keys);
+	}
+
+	size_t getSize() const
+	{
+		return count;
+	}
+
+	const_iterator begin() const
+	{
+		return records;
+	}
+
+	const_iterator end() const
+	{
+		return records + count;
+	}
+};
+
+// Wraps a HashMap or TreeMap and records every operation on it, with how long it
+// took, to a trace that replay.cpp runs against other maps. Lookups (find,
+// valueOf) are TRACE_FIND, operator[] is TRACE_INSERT, and begin() starts a
+// TRACE_ITERATE carrying the map's size, since how far the walk goes isn't seen;
+// its time is only that of begin(). The wrapped map is reachable through
+// underlying(), whose operations aren't recorded.
+template<typename MapType>
+class RecordingMap
+{
+public:
+	using key_type = typename MapType::key_type;
+	using mapped_type = typename MapType::mapped_type;
+	using value_type = typename MapType::value_type;
+	using size_type = typename MapType::size_type;
+	using reference = typename MapType::reference;
+	using const_reference = typename MapType::const_reference;
+	using iterator = typename MapType::iterator;
+	using const_iterator = typename MapType::const_iterator;
+
+private:
+	using Clock = std::chrono::steady_clock;
+
+	MapType map;
+	mutable TraceWriter trace;
+
+	void record(TraceOperation operation, uint64_t key, Clock::time_point start, bool hit) const
+	{
+		trace.record(operation, key, std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start), hit);
+	}
+
+public:
+	explicit RecordingMap(const std::string &tracePath, MapType map = MapType())
+			: map(std::move(map)), trace(tracePath, traceKeys<key_type>())
+	{}
+
+	RecordingMap(const RecordingMap &) = delete;
+	RecordingMap &operator=(const RecordingMap &) = delete;
+
+	bool isEmpty() const
+	{
+		return map.isEmpty();
+	}
+
+	size_type getSize() const
+	{
+		return map.getSize();
+	}
+
+	mapped_type &operator[](const key_type &key)
+	{
+		size_type before = map.getSize();
+		auto start = Clock::now();
+		mapped_type &value = map[key];
+		record(TRACE_INSERT, traceFingerprint(key), start, map.getSize() == before);
+		return value;
+	}
+
+	const mapped_type &valueOf(const key_type &key) const
+	{
+		auto start = Clock::now();
+		auto it = map.find(key);
+		record(TRACE_FIND, traceFingerprint(key), start, it != map.end());
+		if(it == map.end())
+			throw std::out_of_range("key doesn't exist");
+		return it->second;
+	}
+
+	mapped_type &valueOf(const key_type &key)
+	{
+		// ugly cast, yet reduces code duplication.
+		return const_cast<mapped_type &>( (const_cast<const RecordingMap *>(this))->valueOf(key));
+	}
+
+	const_iterator find(const key_type &key) const
+	{
+		auto start = Clock::now();
+		auto it = map.find(key);
+		record(TRACE_FIND, traceFingerprint(key), start, it != map.end());
+		return it;
+	}
+
+	iterator find(const key_type &key)
+	{
+		auto start = Clock::now();
+		auto it = map.find(key);
+		record(TRACE_FIND, traceFingerprint(key), start, it != map.end());
+		return it;
+	}
+
+	void remove(const key_type &key)
+	{
+		auto start = Clock::now();
+		try
+		{
+			map.remove(key);
+		}
+		catch(const std::out_of_range &)
+		{
+			record(TRACE_REMOVE, traceFingerprint(key), start, false);
+			throw;
+		}
+		record(TRACE_REMOVE, traceFingerprint(key), start, true);
+	}
+
+	void remove(const const_iterator &it)
+	{
+		erase(it);
+	}
+
+	iterator erase(const const_iterator &it)
+	{
+		if(it == map.end())
+			throw std::out_of_range("out of range");
+		uint64_t key = traceFingerprint(it->first);
+		auto start = Clock::now();
+		auto next = map.erase(it);
+		record(TRACE_REMOVE, key, start, true);
+		return next;
+	}
+
+	bool operator==(const RecordingMap &other) const
+	{
+		return map == other.map;
+	}
+
+	bool operator!=(const RecordingMap &other) const
+	{
+		return !(*this == other);
+	}
+
+	size_t memoryUsage() const
+	{
+		return sizeof(*this) - sizeof(MapType) + map.memoryUsage();
+	}
+
+	const MapType &underlying() const
+	{
+		return map;
+	}
+
+	MapType &underlying()
+	{
+		return map;
+	}
+
+	// writes buffered records out, reporting a failed write
+	void flushTrace()
+	{
+		trace.flush();
+	}
+
+	size_t traceSize() const
+	{
+		return trace.size();
+	}
+
+	iterator begin()
+	{
+		auto start = Clock::now();
+		auto it = map.begin();
+		record(TRACE_ITERATE, map.getSize(), start, true);
+		return it;
+	}
+
+	iterator end()
+	{
+		return map.end();
+	}
+
+	const_iterator cbegin() const
+	{
+		auto start = Clock::now();
+		auto it = map.cbegin();
+		record(TRACE_ITERATE, map.getSize(), start, true);
+		return it;
+	}
+
+	const_iterator cend() const
+	{
+		return map.cend();
+	}
+
+	const_iterator begin() const
+	{
+		return cbegin();
+	}
+
+	const_iterator end() const
+	{
+		return cend();
+	}
+};
+
+}
+
+#endif /* AISDI_MAPS_MAPTRACE_H */
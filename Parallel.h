@@ -0,0 +1,112 @@
+#ifndef AISDI_MAPS_PARALLEL_H
+#define AISDI_MAPS_PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define PARALLEL_MIN_SIZE 4096
+#define TASKS_PER_WORKER 4
+
+namespace aisdi
+{
+namespace parallel
+{
+	inline size_t workerCount()
+	{
+		size_t count = std::thread::hardware_concurrency();
+		return count == 0 ? 1 : count;
+	}
+
+	inline size_t preferredTaskCount()
+	{
+		return workerCount() * TASKS_PER_WORKER;
+	}
+
+	// Runs task(0) ... task(taskCount - 1) on a pool of threads. Tasks are handed out
+	// one index at a time, so a worker that finishes early just takes the next pending
+	// one and uneven tasks still balance. The first exception thrown by a task is
+	// rethrown after every worker has stopped.
+	template<typename Task>
+	void runTasks(size_t taskCount, Task task)
+	{
+		size_t workers = std::min(workerCount(), taskCount);
+		if(workers <= 1)
+		{
+			for(size_t i = 0; i < taskCount; ++i)
+				task(i);
+			return;
+		}
+
+		std::atomic<size_t> next{0};
+		std::exception_ptr error;
+		std::mutex errorMutex;
+
+		auto work = [&]()
+		{
+			for(size_t i = next++; i < taskCount; i = next++)
+			{
+				try
+				{
+					task(i);
+				}
+				catch(...)
+				{
+					std::lock_guard<std::mutex> lock(errorMutex);
+					if(!error)
+						error = std::current_exception();
+					next = taskCount;
+				}
+			}
+		};
+
+		std::vector<std::thread> threads;
+		for(size_t i = 1; i < workers; ++i)
+			threads.emplace_back(work);
+		work();
+
+		for(auto &thread : threads)
+			thread.join();
+
+		if(error)
+			std::rethrow_exception(error);
+	}
+
+	// visit(i, callback) has to call callback(element) for every element of task i.
+	// Partial results are combined in task order, so combine only has to be associative.
+	template<typename T, typename Visit, typename Map, typename Combine>
+	T reduce(size_t taskCount, T init, Visit visit, Map map, Combine combine)
+	{
+		std::vector<T> partial(taskCount, init);
+		std::vector<char> filled(taskCount, 0);
+
+		runTasks(taskCount, [&](size_t i)
+		{
+			visit(i, [&](const auto &elem)
+			{
+				if(filled[i])
+					partial[i] = combine(partial[i], map(elem));
+				else
+				{
+					partial[i] = map(elem);
+					filled[i] = 1;
+				}
+			});
+		});
+
+		T result = init;
+		for(size_t i = 0; i < taskCount; ++i)
+		{
+			if(filled[i])
+				result = combine(result, partial[i]);
+		}
+		return result;
+	}
+}
+}
+
+#endif /* AISDI_MAPS_PARALLEL_H */
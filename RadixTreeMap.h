@@ -0,0 +1,1353 @@
+#ifndef AISDI_MAPS_RADIXTREEMAP_H
+#define AISDI_MAPS_RADIXTREEMAP_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "MapStats.h"
+
+// compressed path bytes kept in an inner node; longer paths are skipped during a
+// descent and checked against the leaf at its end
+#define RADIX_MAX_PREFIX 8
+
+namespace aisdi
+{
+
+// Bytes of a key in an order that sorts like the key itself. Only strings and
+// integers have one: strings are their own bytes, integers are stored big-endian
+// with the sign bit flipped.
+template<typename KeyType, typename Enable = void>
+class RadixKey;
+
+template<>
+class RadixKey<std::string>
+{
+	const unsigned char *bytes;
+	size_t length;
+
+public:
+	explicit RadixKey(const std::string &key)
+		: bytes(reinterpret_cast<const unsigned char *>(key.data())), length(key.size())
+	{}
+
+	const unsigned char *data() const
+	{
+		return bytes;
+	}
+
+	size_t size() const
+	{
+		return length;
+	}
+};
+
+template<typename KeyType>
+class RadixKey<KeyType, typename std::enable_if<std::is_integral<KeyType>::value>::type>
+{
+	unsigned char bytes[sizeof(KeyType)];
+
+public:
+	explicit RadixKey(KeyType key)
+	{
+		using Bits = typename std::make_unsigned<KeyType>::type;
+		Bits bits = static_cast<Bits>(key);
+		if(std::is_signed<KeyType>::value)
+			bits ^= Bits(1) << (8 * sizeof(KeyType) - 1);
+		for(size_t i = 0; i < sizeof(KeyType); ++i)
+			bytes[i] = static_cast<unsigned char>(bits >> (8 * (sizeof(KeyType) - 1 - i)));
+	}
+
+	const unsigned char *data() const
+	{
+		return bytes;
+	}
+
+	size_t size() const
+	{
+		return sizeof(KeyType);
+	}
+};
+
+// Adaptive radix tree: an ordered map that descends by key bytes instead of
+// comparing whole keys. Inner nodes grow and shrink between 4, 16, 48 and 256
+// children, runs of single-child nodes are compressed into a prefix, and a key
+// that ends inside another key's path sits in its inner node as the terminal.
+// Leaves are linked in key order, so iterators are leaf pointers and stay valid
+// until their own element is removed.
+template<typename KeyType, typename ValueType>
+class RadixTreeMap
+{
+public:
+	using key_type = KeyType;
+	using mapped_type = ValueType;
+	using value_type = std::pair<const key_type, mapped_type>;
+	using size_type = std::size_t;
+	using reference = value_type &;
+	using const_reference = const value_type &;
+
+	class ConstIterator;
+
+	class Iterator;
+
+	using iterator = Iterator;
+	using const_iterator = ConstIterator;
+
+private:
+	enum Kind : uint8_t
+	{
+		LEAF,
+		NODE4,
+		NODE16,
+		NODE48,
+		NODE256
+	};
+
+	struct Node
+	{
+		Kind kind;
+
+		explicit Node(Kind kind) : kind(kind)
+		{}
+	};
+
+	struct Leaf : Node
+	{
+		value_type value;
+		Leaf *prev = nullptr;
+		Leaf *next = nullptr;
+
+		Leaf(const key_type &key, const mapped_type &mapped) : Node(LEAF), value(key, mapped)
+		{}
+	};
+
+	struct Inner : Node
+	{
+		uint16_t count = 0; // children, the terminal not included
+		uint32_t prefixLength = 0;
+		unsigned char prefix[RADIX_MAX_PREFIX];
+		Leaf *terminal = nullptr; // the key that ends right after the prefix
+
+		explicit Inner(Kind kind) : Node(kind), prefix()
+		{}
+	};
+
+	// keys are sorted in the 4 and 16 wide nodes
+	struct Node4 : Inner
+	{
+		unsigned char keys[4];
+		Node *children[4];
+
+		Node4() : Inner(NODE4), keys(), children()
+		{}
+	};
+
+	struct Node16 : Inner
+	{
+		unsigned char keys[16];
+		Node *children[16];
+
+		Node16() : Inner(NODE16), keys(), children()
+		{}
+	};
+
+	// slotOf[byte] is 0 for a missing child, else its index in children plus one
+	struct Node48 : Inner
+	{
+		unsigned char slotOf[256];
+		Node *children[48];
+
+		Node48() : Inner(NODE48), slotOf(), children()
+		{}
+	};
+
+	struct Node256 : Inner
+	{
+		Node *children[256];
+
+		Node256() : Inner(NODE256), children()
+		{}
+	};
+
+	struct Inserted
+	{
+		Leaf *leaf;
+		bool created;
+		bool successorKnown; // a new leaf's successor is found on the way back up
+		Leaf *successor;
+	};
+
+	size_t size{0};
+	Node *root{nullptr};
+	Leaf *first{nullptr};
+	Leaf *last{nullptr};
+	MAP_STATS(mutable TreeMapCounters counters;)
+
+	static bool sameKey(const Leaf *leaf, const RadixKey<key_type> &key)
+	{
+		RadixKey<key_type> other(leaf->value.first);
+		return other.size() == key.size() && std::memcmp(other.data(), key.data(), key.size()) == 0;
+	}
+
+	static void setPrefix(Inner *node, const unsigned char *bytes, size_t length)
+	{
+		node->prefixLength = static_cast<uint32_t>(length);
+		std::memcpy(node->prefix, bytes, std::min<size_t>(length, RADIX_MAX_PREFIX));
+	}
+
+	static void copyHeader(Inner *to, const Inner *from)
+	{
+		to->count = from->count;
+		to->prefixLength = from->prefixLength;
+		std::memcpy(to->prefix, from->prefix, RADIX_MAX_PREFIX);
+		to->terminal = from->terminal;
+	}
+
+	// position of the first key not less than byte among the sorted keys
+	static unsigned lowerBound16(const Node16 *node, unsigned char byte)
+	{
+#ifdef __SSE2__
+		// signed compare of bytes shifted by 0x80 orders them like unsigned ones
+		__m128i flip = _mm_set1_epi8(static_cast<char>(0x80));
+		__m128i keys = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(node->keys)), flip);
+		__m128i less = _mm_cmplt_epi8(keys, _mm_xor_si128(_mm_set1_epi8(static_cast<char>(byte)), flip));
+		unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(less)) & ((1u << node->count) - 1);
+		return static_cast<unsigned>(__builtin_popcount(mask));
+#else
+		unsigned i = 0;
+		while(i < node->count && node->keys[i] < byte)
+			++i;
+		return i;
+#endif
+	}
+
+	static Node **childSlot(Inner *inner, unsigned char byte)
+	{
+		switch(inner->kind)
+		{
+			case NODE4:
+			{
+				Node4 *node = static_cast<Node4 *>(inner);
+				for(unsigned i = 0; i < node->count; ++i)
+				{
+					if(node->keys[i] == byte)
+						return &node->children[i];
+				}
+				return nullptr;
+			}
+			case NODE16:
+			{
+				Node16 *node = static_cast<Node16 *>(inner);
+#ifdef __SSE2__
+				__m128i keys = _mm_loadu_si128(reinterpret_cast<const __m128i *>(node->keys));
+				__m128i matches = _mm_cmpeq_epi8(keys, _mm_set1_epi8(static_cast<char>(byte)));
+				unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(matches)) & ((1u << node->count) - 1);
+				return mask == 0 ? nullptr : &node->children[__builtin_ctz(mask)];
+#else
+				for(unsigned i = 0; i < node->count; ++i)
+				{
+					if(node->keys[i] == byte)
+						return &node->children[i];
+				}
+				return nullptr;
+#endif
+			}
+			case NODE48:
+			{
+				Node48 *node = static_cast<Node48 *>(inner);
+				return node->slotOf[byte] == 0 ? nullptr : &node->children[node->slotOf[byte] - 1];
+			}
+			default:
+			{
+				Node256 *node = static_cast<Node256 *>(inner);
+				return node->children[byte] == nullptr ? nullptr : &node->children[byte];
+			}
+		}
+	}
+
+	// the child with the smallest byte not less than from (from up to 256), or nullptr
+	static Node *childFrom(const Inner *inner, unsigned from)
+	{
+		switch(inner->kind)
+		{
+			case NODE4:
+			{
+				const Node4 *node = static_cast<const Node4 *>(inner);
+				for(unsigned i = 0; i < node->count; ++i)
+				{
+					if(node->keys[i] >= from)
+						return node->children[i];
+				}
+				return nullptr;
+			}
+			case NODE16:
+			{
+				const Node16 *node = static_cast<const Node16 *>(inner);
+				if(from > 255)
+					return nullptr;
+				unsigned i = lowerBound16(node, static_cast<unsigned char>(from));
+				return i < node->count ? node->children[i] : nullptr;
+			}
+			case NODE48:
+			{
+				const Node48 *node = static_cast<const Node48 *>(inner);
+				for(unsigned byte = from; byte < 256; ++byte)
+				{
+					if(node->slotOf[byte] != 0)
+						return node->children[node->slotOf[byte] - 1];
+				}
+				return nullptr;
+			}
+			default:
+			{
+				const Node256 *node = static_cast<const Node256 *>(inner);
+				for(unsigned byte = from; byte < 256; ++byte)
+				{
+					if(node->children[byte] != nullptr)
+						return node->children[byte];
+				}
+				return nullptr;
+			}
+		}
+	}
+
+	static Node *lastChild(const Inner *inner)
+	{
+		switch(inner->kind)
+		{
+			case NODE4:
+				return inner->count == 0 ? nullptr : static_cast<const Node4 *>(inner)->children[inner->count - 1];
+			case NODE16:
+				return inner->count == 0 ? nullptr : static_cast<const Node16 *>(inner)->children[inner->count - 1];
+			case NODE48:
+			{
+				const Node48 *node = static_cast<const Node48 *>(inner);
+				for(unsigned byte = 256; byte-- > 0; )
+				{
+					if(node->slotOf[byte] != 0)
+						return node->children[node->slotOf[byte] - 1];
+				}
+				return nullptr;
+			}
+			default:
+			{
+				const Node256 *node = static_cast<const Node256 *>(inner);
+				for(unsigned byte = 256; byte-- > 0; )
+				{
+					if(node->children[byte] != nullptr)
+						return node->children[byte];
+				}
+				return nullptr;
+			}
+		}
+	}
+
+	// fn(byte, child) for every child in byte order
+	template<typename Function>
+	static void forEachChild(const Inner *inner, Function fn)
+	{
+		switch(inner->kind)
+		{
+			case NODE4:
+			{
+				const Node4 *node = static_cast<const Node4 *>(inner);
+				for(unsigned i = 0; i < node->count; ++i)
+					fn(node->keys[i], node->children[i]);
+				break;
+			}
+			case NODE16:
+			{
+				const Node16 *node = static_cast<const Node16 *>(inner);
+				for(unsigned i = 0; i < node->count; ++i)
+					fn(node->keys[i], node->children[i]);
+				break;
+			}
+			case NODE48:
+			{
+				const Node48 *node = static_cast<const Node48 *>(inner);
+				for(unsigned byte = 0; byte < 256; ++byte)
+				{
+					if(node->slotOf[byte] != 0)
+						fn(static_cast<unsigned char>(byte), node->children[node->slotOf[byte] - 1]);
+				}
+				break;
+			}
+			default:
+			{
+				const Node256 *node = static_cast<const Node256 *>(inner);
+				for(unsigned byte = 0; byte < 256; ++byte)
+				{
+					if(node->children[byte] != nullptr)
+						fn(static_cast<unsigned char>(byte), node->children[byte]);
+				}
+			}
+		}
+	}
+
+	static Leaf *minLeaf(Node *node)
+	{
+		while(node->kind != LEAF)
+		{
+			Inner *inner = static_cast<Inner *>(node);
+			if(inner->terminal != nullptr)
+				return inner->terminal;
+			node = childFrom(inner, 0);
+		}
+		return static_cast<Leaf *>(node);
+	}
+
+	static Leaf *maxLeaf(Node *node)
+	{
+		while(node->kind != LEAF)
+		{
+			Inner *inner = static_cast<Inner *>(node);
+			if(inner->count == 0)
+				return inner->terminal;
+			node = lastChild(inner);
+		}
+		return static_cast<Leaf *>(node);
+	}
+
+	// Adds a child for a byte the node doesn't have yet; a full node is replaced
+	// by the next wider kind, ref is where the node hangs.
+	static void addChild(Node *&ref, Inner *inner, unsigned char byte, Node *child)
+	{
+		switch(inner->kind)
+		{
+			case NODE4:
+			{
+				Node4 *node = static_cast<Node4 *>(inner);
+				if(node->count == 4)
+				{
+					Node16 *grown = new Node16();
+					copyHeader(grown, node);
+					std::memcpy(grown->keys, node->keys, 4);
+					std::memcpy(grown->children, node->children, 4 * sizeof(Node *));
+					ref = grown;
+					delete node;
+					addChild(ref, grown, byte, child);
+					return;
+				}
+				unsigned i = 0;
+				while(i < node->count && node->keys[i] < byte)
+					++i;
+				std::memmove(node->keys + i + 1, node->keys + i, node->count - i);
+				std::memmove(node->children + i + 1, node->children + i, (node->count - i) * sizeof(Node *));
+				node->keys[i] = byte;
+				node->children[i] = child;
+				break;
+			}
+			case NODE16:
+			{
+				Node16 *node = static_cast<Node16 *>(inner);
+				if(node->count == 16)
+				{
+					Node48 *grown = new Node48();
+					copyHeader(grown, node);
+					for(unsigned i = 0; i < 16; ++i)
+					{
+						grown->slotOf[node->keys[i]] = static_cast<unsigned char>(i + 1);
+						grown->children[i] = node->children[i];
+					}
+					ref = grown;
+					delete node;
+					addChild(ref, grown, byte, child);
+					return;
+				}
+				unsigned i = lowerBound16(node, byte);
+				std::memmove(node->keys + i + 1, node->keys + i, node->count - i);
+				std::memmove(node->children + i + 1, node->children + i, (node->count - i) * sizeof(Node *));
+				node->keys[i] = byte;
+				node->children[i] = child;
+				break;
+			}
+			case NODE48:
+			{
+				Node48 *node = static_cast<Node48 *>(inner);
+				if(node->count == 48)
+				{
+					Node256 *grown = new Node256();
+					copyHeader(grown, node);
+					for(unsigned b = 0; b < 256; ++b)
+					{
+						if(node->slotOf[b] != 0)
+							grown->children[b] = node->children[node->slotOf[b] - 1];
+					}
+					ref = grown;
+					delete node;
+					addChild(ref, grown, byte, child);
+					return;
+				}
+				unsigned slot = 0;
+				while(node->children[slot] != nullptr)
+					++slot;
+				node->children[slot] = child;
+				node->slotOf[byte] = static_cast<unsigned char>(slot + 1);
+				break;
+			}
+			default:
+				static_cast<Node256 *>(inner)->children[byte] = child;
+		}
+		++inner->count;
+	}
+
+	static void removeChild(Inner *inner, unsigned char byte)
+	{
+		switch(inner->kind)
+		{
+			case NODE4:
+			case NODE16:
+			{
+				unsigned char *keys = inner->kind == NODE4 ? static_cast<Node4 *>(inner)->keys : static_cast<Node16 *>(inner)->keys;
+				Node **children = inner->kind == NODE4 ? static_cast<Node4 *>(inner)->children : static_cast<Node16 *>(inner)->children;
+				unsigned i = 0;
+				while(keys[i] != byte)
+					++i;
+				std::memmove(keys + i, keys + i + 1, inner->count - i - 1);
+				std::memmove(children + i, children + i + 1, (inner->count - i - 1) * sizeof(Node *));
+				break;
+			}
+			case NODE48:
+			{
+				Node48 *node = static_cast<Node48 *>(inner);
+				node->children[node->slotOf[byte] - 1] = nullptr;
+				node->slotOf[byte] = 0;
+				break;
+			}
+			default:
+				static_cast<Node256 *>(inner)->children[byte] = nullptr;
+		}
+		--inner->count;
+	}
+
+	// After a removal: a node left with a single entry is replaced by it (a child
+	// takes over the node's prefix), a sparse node by the next narrower kind.
+	static void shrink(Node *&ref)
+	{
+		Inner *inner = static_cast<Inner *>(ref);
+		if(inner->count == 0)
+		{
+			ref = inner->terminal;
+			deleteInner(inner);
+			return;
+		}
+
+		if(inner->count == 1 && inner->terminal == nullptr)
+		{
+			unsigned char byte = 0;
+			Node *child = nullptr;
+			forEachChild(inner, [&](unsigned char b, Node *node)
+			{
+				byte = b;
+				child = node;
+			});
+
+			if(child->kind != LEAF)
+			{
+				Inner *below = static_cast<Inner *>(child);
+				unsigned char merged[RADIX_MAX_PREFIX];
+				size_t n = std::min<size_t>(inner->prefixLength, RADIX_MAX_PREFIX);
+				std::memcpy(merged, inner->prefix, n);
+				if(n < RADIX_MAX_PREFIX)
+					merged[n++] = byte;
+				for(size_t i = 0; n < RADIX_MAX_PREFIX && i < below->prefixLength; ++i)
+					merged[n++] = below->prefix[i];
+
+				below->prefixLength += inner->prefixLength + 1;
+				std::memcpy(below->prefix, merged, n);
+			}
+			ref = child;
+			deleteInner(inner);
+			return;
+		}
+
+		Inner *narrower = nullptr;
+		if(inner->kind == NODE256 && inner->count <= 37)
+		{
+			Node48 *node = new Node48();
+			forEachChild(inner, [&](unsigned char b, Node *child)
+			{
+				node->children[node->count] = child;
+				node->slotOf[b] = static_cast<unsigned char>(++node->count);
+			});
+			narrower = node;
+		}
+		else if(inner->kind == NODE48 && inner->count <= 12)
+		{
+			Node16 *node = new Node16();
+			forEachChild(inner, [&](unsigned char b, Node *child)
+			{
+				node->keys[node->count] = b;
+				node->children[node->count++] = child;
+			});
+			narrower = node;
+		}
+		else if(inner->kind == NODE16 && inner->count <= 3)
+		{
+			Node4 *node = new Node4();
+			forEachChild(inner, [&](unsigned char b, Node *child)
+			{
+				node->keys[node->count] = b;
+				node->children[node->count++] = child;
+			});
+			narrower = node;
+		}
+
+		if(narrower != nullptr)
+		{
+			copyHeader(narrower, inner);
+			ref = narrower;
+			deleteInner(inner);
+		}
+	}
+
+	// frees the node itself, not its children
+	static void deleteInner(Inner *inner)
+	{
+		switch(inner->kind)
+		{
+			case NODE4:
+				delete static_cast<Node4 *>(inner);
+				break;
+			case NODE16:
+				delete static_cast<Node16 *>(inner);
+				break;
+			case NODE48:
+				delete static_cast<Node48 *>(inner);
+				break;
+			default:
+				delete static_cast<Node256 *>(inner);
+		}
+	}
+
+	static void deleteTree(Node *node)
+	{
+		if(node == nullptr)
+			return;
+
+		if(node->kind == LEAF)
+		{
+			delete static_cast<Leaf *>(node);
+			return;
+		}
+
+		Inner *inner = static_cast<Inner *>(node);
+		delete inner->terminal;
+		forEachChild(inner, [](unsigned char, Node *child)
+		{
+			deleteTree(child);
+		});
+		deleteInner(inner);
+	}
+
+	// how many of the node's prefix bytes the key repeats from depth on
+	static size_t matchPrefix(Inner *inner, const RadixKey<key_type> &key, size_t depth)
+	{
+		size_t limit = std::min<size_t>(inner->prefixLength, key.size() - depth);
+		size_t stored = std::min<size_t>(limit, RADIX_MAX_PREFIX);
+		const unsigned char *bytes = key.data() + depth;
+
+		size_t matched = 0;
+		while(matched < stored && inner->prefix[matched] == bytes[matched])
+			++matched;
+		if(matched < stored || matched == limit)
+			return matched;
+
+		// past the stored bytes the prefix is only known from the leaves below
+		RadixKey<key_type> full(minLeaf(inner)->value.first);
+		while(matched < limit && full.data()[depth + matched] == bytes[matched])
+			++matched;
+		return matched;
+	}
+
+	Leaf *findLeaf(const RadixKey<key_type> &key) const
+	{
+		const unsigned char *bytes = key.data();
+		Node *node = root;
+		size_t depth = 0;
+
+		while(node != nullptr)
+		{
+			MAP_STATS(++counters.descentSteps;)
+			if(node->kind == LEAF)
+			{
+				Leaf *leaf = static_cast<Leaf *>(node);
+				return sameKey(leaf, key) ? leaf : nullptr;
+			}
+
+			Inner *inner = static_cast<Inner *>(node);
+			if(inner->prefixLength != 0)
+			{
+				if(key.size() - depth < inner->prefixLength)
+					return nullptr;
+				if(std::memcmp(inner->prefix, bytes + depth, std::min<size_t>(inner->prefixLength, RADIX_MAX_PREFIX)) != 0)
+					return nullptr;
+				depth += inner->prefixLength;
+			}
+
+			if(depth == key.size())
+				return inner->terminal != nullptr && sameKey(inner->terminal, key) ? inner->terminal : nullptr;
+
+			Node **slot = childSlot(inner, bytes[depth]);
+			if(slot == nullptr)
+				return nullptr;
+			node = *slot;
+			++depth;
+		}
+		return nullptr;
+	}
+
+	// Finds or adds the key's leaf in the subtree hanging at ref, whose keys all
+	// share the key's first depth bytes.
+	void insertAt(Node *&ref, const RadixKey<key_type> &key, size_t depth, const key_type &original, Inserted &result)
+	{
+		const unsigned char *bytes = key.data();
+
+		if(ref == nullptr)
+		{
+			ref = newLeaf(original, result);
+			return;
+		}
+		MAP_STATS(++counters.descentSteps;)
+
+		if(ref->kind == LEAF)
+		{
+			Leaf *leaf = static_cast<Leaf *>(ref);
+			RadixKey<key_type> other(leaf->value.first);
+			size_t limit = std::min(key.size(), other.size());
+			size_t split = depth;
+			while(split < limit && bytes[split] == other.data()[split])
+				++split;
+			if(split == key.size() && split == other.size())
+			{
+				result.leaf = leaf;
+				return;
+			}
+
+			std::unique_ptr<Node4> node(new Node4());
+			setPrefix(node.get(), bytes + depth, split - depth);
+			Leaf *created = newLeaf(original, result);
+			attach(node.get(), leaf, other, split);
+			attach(node.get(), created, key, split);
+			ref = node.release();
+
+			if(split == key.size() || (split < other.size() && bytes[split] < other.data()[split]))
+			{
+				result.successorKnown = true;
+				result.successor = leaf;
+			}
+			return;
+		}
+
+		Inner *inner = static_cast<Inner *>(ref);
+		if(inner->prefixLength != 0)
+		{
+			size_t matched = matchPrefix(inner, key, depth);
+			if(matched < inner->prefixLength)
+			{
+				splitPrefix(ref, key, depth, matched, original, result);
+				return;
+			}
+			depth += inner->prefixLength;
+		}
+
+		if(depth == key.size())
+		{
+			if(inner->terminal == nullptr)
+			{
+				inner->terminal = newLeaf(original, result);
+				result.successorKnown = true;
+				result.successor = minLeaf(childFrom(inner, 0));
+			}
+			else
+				result.leaf = inner->terminal;
+			return;
+		}
+
+		unsigned char byte = bytes[depth];
+		Node **slot = childSlot(inner, byte);
+		if(slot != nullptr)
+		{
+			insertAt(*slot, key, depth + 1, original, result);
+			if(result.created && !result.successorKnown)
+				findSuccessor(inner, byte, result);
+			return;
+		}
+
+		std::unique_ptr<Leaf> created(new Leaf(original, mapped_type{}));
+		addChild(ref, inner, byte, created.get());
+		result.leaf = created.release();
+		result.created = true;
+		findSuccessor(static_cast<Inner *>(ref), byte, result);
+	}
+
+	// the node's prefix differs from the key after matched bytes: a new Node4
+	// takes the common part, the node keeps what follows the differing byte
+	void splitPrefix(Node *&ref, const RadixKey<key_type> &key, size_t depth, size_t matched,
+	                 const key_type &original, Inserted &result)
+	{
+		Inner *inner = static_cast<Inner *>(ref);
+		RadixKey<key_type> full(minLeaf(inner)->value.first);
+		unsigned char stored[RADIX_MAX_PREFIX];
+		std::memcpy(stored, inner->prefix, RADIX_MAX_PREFIX);
+		const unsigned char *prefix = inner->prefixLength > RADIX_MAX_PREFIX ? full.data() + depth : stored;
+
+		std::unique_ptr<Node4> node(new Node4());
+		setPrefix(node.get(), prefix, matched);
+		Leaf *created = newLeaf(original, result);
+
+		unsigned char innerByte = prefix[matched];
+		setPrefix(inner, prefix + matched + 1, inner->prefixLength - matched - 1);
+		node->keys[0] = innerByte;
+		node->children[0] = inner;
+		node->count = 1;
+		attach(node.get(), created, key, depth + matched);
+		ref = node.release();
+
+		if(depth + matched == key.size() || key.data()[depth + matched] < innerByte)
+		{
+			result.successorKnown = true;
+			result.successor = minLeaf(inner);
+		}
+	}
+
+	// links a leaf into a fresh node4 either as the terminal or under its byte at depth
+	static void attach(Node4 *node, Leaf *leaf, const RadixKey<key_type> &key, size_t depth)
+	{
+		if(depth == key.size())
+			node->terminal = leaf;
+		else
+		{
+			Node *ref = node;
+			addChild(ref, node, key.data()[depth], leaf);
+		}
+	}
+
+	static Leaf *newLeaf(const key_type &key, Inserted &result)
+	{
+		result.leaf = new Leaf(key, mapped_type{});
+		result.created = true;
+		return result.leaf;
+	}
+
+	static void findSuccessor(Inner *inner, unsigned char byte, Inserted &result)
+	{
+		Node *next = childFrom(inner, byte + 1u);
+		if(next != nullptr)
+		{
+			result.successorKnown = true;
+			result.successor = minLeaf(next);
+		}
+	}
+
+	void linkLeaf(Leaf *leaf, Leaf *successor)
+	{
+		leaf->next = successor;
+		leaf->prev = successor == nullptr ? last : successor->prev;
+		(leaf->prev == nullptr ? first : leaf->prev->next) = leaf;
+		(successor == nullptr ? last : successor->prev) = leaf;
+	}
+
+	void unlinkLeaf(Leaf *leaf)
+	{
+		(leaf->prev == nullptr ? first : leaf->prev->next) = leaf->next;
+		(leaf->next == nullptr ? last : leaf->next->prev) = leaf->prev;
+	}
+
+	// unlinks the key's leaf from the subtree hanging at ref and returns it
+	static Leaf *removeAt(Node *&ref, const RadixKey<key_type> &key, size_t depth)
+	{
+		if(ref == nullptr)
+			return nullptr;
+
+		if(ref->kind == LEAF)
+		{
+			Leaf *leaf = static_cast<Leaf *>(ref);
+			if(!sameKey(leaf, key))
+				return nullptr;
+			ref = nullptr;
+			return leaf;
+		}
+
+		Inner *inner = static_cast<Inner *>(ref);
+		if(inner->prefixLength != 0)
+		{
+			if(key.size() - depth < inner->prefixLength
+			   || std::memcmp(inner->prefix, key.data() + depth, std::min<size_t>(inner->prefixLength, RADIX_MAX_PREFIX)) != 0)
+				return nullptr;
+			depth += inner->prefixLength;
+		}
+
+		Leaf *removed;
+		if(depth == key.size())
+		{
+			if(inner->terminal == nullptr || !sameKey(inner->terminal, key))
+				return nullptr;
+			removed = inner->terminal;
+			inner->terminal = nullptr;
+		}
+		else
+		{
+			unsigned char byte = key.data()[depth];
+			Node **slot = childSlot(inner, byte);
+			if(slot == nullptr)
+				return nullptr;
+			removed = removeAt(*slot, key, depth + 1);
+			if(removed == nullptr)
+				return nullptr;
+			if(*slot == nullptr)
+				removeChild(inner, byte);
+		}
+
+		shrink(ref);
+		return removed;
+	}
+
+	void collectStats(const Node *node, int depth, RadixTreeStats &result) const
+	{
+		result.height = std::max(result.height, depth);
+		if(node->kind == LEAF)
+			return;
+
+		const Inner *inner = static_cast<const Inner *>(node);
+		switch(inner->kind)
+		{
+			case NODE4:
+				++result.nodes4;
+				break;
+			case NODE16:
+				++result.nodes16;
+				break;
+			case NODE48:
+				++result.nodes48;
+				break;
+			default:
+				++result.nodes256;
+		}
+		if(inner->terminal != nullptr)
+			result.height = std::max(result.height, depth + 1);
+		forEachChild(inner, [&](unsigned char, const Node *child)
+		{
+			collectStats(child, depth + 1, result);
+		});
+	}
+
+public:
+
+	RadixTreeMap()
+	= default;
+
+	RadixTreeMap(std::initializer_list<value_type> list)
+	{
+		for(auto &elem : list)
+			(*this)[elem.first] = elem.second;
+	}
+
+	RadixTreeMap(const RadixTreeMap &other)
+	{
+		for(auto &elem : other)
+			(*this)[elem.first] = elem.second;
+	}
+
+	RadixTreeMap(RadixTreeMap &&other) : size(other.size), root(other.root), first(other.first), last(other.last)
+	{
+		other.size = 0;
+		other.root = nullptr;
+		other.first = nullptr;
+		other.last = nullptr;
+	}
+
+	~RadixTreeMap()
+	{
+		deleteTree(root);
+	}
+
+	RadixTreeMap &operator=(const RadixTreeMap &other)
+	{
+		if(this != &other)
+			*this = RadixTreeMap(other);
+		return *this;
+	}
+
+	RadixTreeMap &operator=(RadixTreeMap &&other)
+	{
+		if(this != &other)
+		{
+			deleteTree(root);
+			size = other.size;
+			root = other.root;
+			first = other.first;
+			last = other.last;
+			other.size = 0;
+			other.root = nullptr;
+			other.first = nullptr;
+			other.last = nullptr;
+		}
+		return *this;
+	}
+
+	bool isEmpty() const
+	{
+		return size == 0;
+	}
+
+	size_type getSize() const
+	{
+		return size;
+	}
+
+	mapped_type &operator[](const key_type &key)
+	{
+		MAP_STATS(++counters.lookups;)
+		RadixKey<key_type> bytes(key);
+		Inserted result{nullptr, false, false, nullptr};
+		insertAt(root, bytes, 0, key, result);
+
+		if(result.created)
+		{
+			linkLeaf(result.leaf, result.successor);
+			++size;
+			MAP_STATS(++counters.inserts;)
+		}
+		MAP_STATS(else ++counters.lookupHits;)
+		return result.leaf->value.second;
+	}
+
+	const mapped_type &valueOf(const key_type &key) const
+	{
+		if(isEmpty())
+			throw std::out_of_range("Collection is empty");
+		auto it = find(key);
+		if(it == end())
+			throw std::out_of_range("Key doesn't exist");
+		return it->second;
+	}
+
+	mapped_type &valueOf(const key_type &key)
+	{
+		// ugly cast, yet reduces code duplication.
+		return const_cast<mapped_type &>( (const_cast<const RadixTreeMap *>(this))->valueOf(key));
+	}
+
+	const_iterator find(const key_type &key) const
+	{
+		MAP_STATS(++counters.lookups;)
+		Leaf *leaf = findLeaf(RadixKey<key_type>(key));
+		MAP_STATS(if(leaf != nullptr) ++counters.lookupHits;)
+		return ConstIterator(this, leaf);
+	}
+
+	iterator find(const key_type &key)
+	{
+		return Iterator( (const_cast<const RadixTreeMap *>(this))->find(key));
+	}
+
+	// Elements whose keys start with prefix, in key order: [range.first, range.second).
+	// One descent finds the subtree holding them, the leaf links give its ends.
+	std::pair<const_iterator, const_iterator> prefixRange(const key_type &prefix) const
+	{
+		static_assert(std::is_same<key_type, std::string>::value, "prefix scans need string keys");
+
+		RadixKey<key_type> key(prefix);
+		Node *node = root;
+		size_t depth = 0;
+		while(node != nullptr && node->kind != LEAF && depth < key.size())
+		{
+			Inner *inner = static_cast<Inner *>(node);
+			size_t compared = std::min<size_t>(inner->prefixLength, key.size() - depth);
+			if(std::memcmp(inner->prefix, key.data() + depth, std::min<size_t>(compared, RADIX_MAX_PREFIX)) != 0)
+				return {cend(), cend()};
+			depth += compared;
+			if(depth == key.size())
+				break;
+
+			Node **slot = childSlot(inner, key.data()[depth]);
+			node = slot == nullptr ? nullptr : *slot;
+			++depth;
+		}
+		if(node == nullptr)
+			return {cend(), cend()};
+
+		// bytes past the stored prefixes were skipped, one leaf settles them for the subtree
+		Leaf *low = minLeaf(node);
+		RadixKey<key_type> lowKey(low->value.first);
+		if(lowKey.size() < key.size() || std::memcmp(lowKey.data(), key.data(), key.size()) != 0)
+			return {cend(), cend()};
+		return {ConstIterator(this, low), ConstIterator(this, maxLeaf(node)->next)};
+	}
+
+	std::pair<iterator, iterator> prefixRange(const key_type &prefix)
+	{
+		auto range = (const_cast<const RadixTreeMap *>(this))->prefixRange(prefix);
+		return {Iterator(range.first), Iterator(range.second)};
+	}
+
+	void remove(const key_type &key)
+	{
+		if(root == nullptr)
+			throw std::out_of_range("Collection is empty");
+
+		Leaf *removed = removeAt(root, RadixKey<key_type>(key), 0);
+		if(removed == nullptr)
+			throw std::out_of_range("there isn't element with that key");
+
+		unlinkLeaf(removed);
+		delete removed;
+		--size;
+		MAP_STATS(++counters.removes;)
+	}
+
+	void remove(const const_iterator &it)
+	{
+		remove(it->first);
+	}
+
+	// Leaves never move, so the element after the removed one is still where it was.
+	iterator erase(const const_iterator &it)
+	{
+		if(it.leaf == nullptr)
+			throw std::out_of_range("out of range");
+
+		Leaf *next = it.leaf->next;
+		remove(it->first);
+		return Iterator(ConstIterator(this, next));
+	}
+
+	bool operator==(const RadixTreeMap &other) const
+	{
+		if(size != other.size)
+			return false;
+
+		for(auto &elem : other)
+		{
+			auto it = find(elem.first);
+			if(it == end() || !(it->second == elem.second))
+				return false;
+		}
+		return true;
+	}
+
+	bool operator!=(const RadixTreeMap &other) const
+	{
+		return !(*this == other);
+	}
+
+	RadixTreeStats stats() const
+	{
+		RadixTreeStats result;
+		result.size = size;
+		if(root != nullptr)
+			collectStats(root, 1, result);
+
+		MAP_STATS(result.countersEnabled = true;)
+		MAP_STATS(result.operations = counters;)
+		return result;
+	}
+
+	void dumpStats(std::ostream &out) const
+	{
+		stats().writeJson(out);
+	}
+
+	void resetStats()
+	{
+		MAP_STATS(counters = TreeMapCounters{};)
+	}
+
+	// bytes held by the map: a leaf per element, the inner nodes of every width,
+	// plus heap memory owned by keys and values
+	size_t memoryUsage() const
+	{
+		RadixTreeStats shape = stats();
+		size_t bytes = sizeof(*this) + size * heapBlockSize(sizeof(Leaf))
+		               + shape.nodes4 * heapBlockSize(sizeof(Node4)) + shape.nodes16 * heapBlockSize(sizeof(Node16))
+		               + shape.nodes48 * heapBlockSize(sizeof(Node48)) + shape.nodes256 * heapBlockSize(sizeof(Node256));
+
+		if(MayOwnHeap<key_type, mapped_type>::value)
+		{
+			for(auto &elem : *this)
+				bytes += ownedBytes(elem.first) + ownedBytes(elem.second);
+		}
+		return bytes;
+	}
+
+	iterator begin()
+	{
+		return Iterator(cbegin());
+	}
+
+	iterator end()
+	{
+		return Iterator(cend());
+	}
+
+	const_iterator cbegin() const
+	{
+		return ConstIterator(this, first);
+	}
+
+	const_iterator cend() const
+	{
+		return ConstIterator(this, nullptr);
+	}
+
+	const_iterator begin() const
+	{
+		return cbegin();
+	}
+
+	const_iterator end() const
+	{
+		return cend();
+	}
+};
+
+template<typename KeyType, typename ValueType>
+class RadixTreeMap<KeyType, ValueType>::ConstIterator
+{
+public:
+	using reference = typename RadixTreeMap::const_reference;
+	using iterator_category = std::bidirectional_iterator_tag;
+	using value_type = typename RadixTreeMap::value_type;
+	using pointer = const typename RadixTreeMap::value_type *;
+
+	friend class RadixTreeMap;
+
+private:
+	const RadixTreeMap *map = nullptr;
+	Leaf *leaf = nullptr; // nullptr for end()
+
+public:
+
+	explicit ConstIterator() = default;
+
+	ConstIterator(const RadixTreeMap *map, Leaf *leaf) : map(map), leaf(leaf)
+	{}
+
+	ConstIterator &operator++()
+	{
+		if(map == nullptr)
+			throw std::logic_error("collection not given to iterator");
+		if(leaf == nullptr)
+			throw std::out_of_range("out of range incrementing");
+
+		leaf = leaf->next;
+		return *this;
+	}
+
+	ConstIterator operator++(int)
+	{
+		auto it = *this;
+		this->operator++();
+		return it;
+	}
+
+	ConstIterator &operator--()
+	{
+		if(map == nullptr)
+			throw std::logic_error("collection not given to iterator");
+
+		Leaf *previous = leaf == nullptr ? map->last : leaf->prev;
+		if(previous == nullptr)
+			throw std::out_of_range("out of range decrementing");
+		leaf = previous;
+		return *this;
+	}
+
+	ConstIterator operator--(int)
+	{
+		auto it = *this;
+		this->operator--();
+		return it;
+	}
+
+	reference operator*() const
+	{
+		if(leaf == nullptr)
+			throw std::out_of_range("out of range");
+
+		return leaf->value;
+	}
+
+	pointer operator->() const
+	{
+		return &this->operator*();
+	}
+
+	bool operator==(const ConstIterator &other) const
+	{
+		return map == other.map && leaf == other.leaf;
+	}
+
+	bool operator!=(const ConstIterator &other) const
+	{
+		return !(*this == other);
+	}
+};
+
+template<typename KeyType, typename ValueType>
+class RadixTreeMap<KeyType, ValueType>::Iterator : public RadixTreeMap<KeyType, ValueType>::ConstIterator
+{
+public:
+	using reference = typename RadixTreeMap::reference;
+	using pointer = typename RadixTreeMap::value_type *;
+
+	explicit Iterator() = default;
+
+	explicit Iterator(const ConstIterator &other) : ConstIterator(other)
+	{}
+
+	Iterator &operator++()
+	{
+		ConstIterator::operator++();
+		return *this;
+	}
+
+	Iterator operator++(int)
+	{
+		auto result = *this;
+		ConstIterator::operator++();
+		return result;
+	}
+
+	Iterator &operator--()
+	{
+		ConstIterator::operator--();
+		return *this;
+	}
+
+	Iterator operator--(int)
+	{
+		auto result = *this;
+		ConstIterator::operator--();
+		return result;
+	}
+
+	pointer operator->() const
+	{
+		return &this->operator*();
+	}
+
+	reference operator*() const
+	{
+		// ugly cast, yet reduces code duplication.
+		return const_cast<reference>(ConstIterator::operator*());
+	}
+};
+
+}
+
+#endif /* AISDI_MAPS_RADIXTREEMAP_H */
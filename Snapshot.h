@@ -0,0 +1,362 @@
+#ifndef AISDI_MAPS_SNAPSHOT_H
+#define AISDI_MAPS_SNAPSHOT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+
+namespace aisdi
+{
+
+// Snapshot files are written and read by the same build: entries are raw bytes of
+// the key and value types, buckets come from std::hash, both in native byte order.
+//
+// layout: SnapshotHeader | uint64_t table[buckets + 1] | Entry entries[size]
+// chained: table holds bucketStart, entries of bucket b are
+//          entries[bucketStart[b]] ... entries[bucketStart[b + 1] - 1]
+// perfect hash: table holds the displacements and the seed of a PerfectHash
+//          (FrozenHashMap.h), entries are in slot order
+
+enum SnapshotKind : uint32_t
+{
+	CHAINED_HASH_SNAPSHOT = 1,
+	PERFECT_HASH_SNAPSHOT = 2
+};
+
+struct SnapshotHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint32_t kind;
+	uint32_t entryAlignment;
+	uint64_t keySize;
+	uint64_t valueSize;
+	uint64_t entrySize;
+	uint64_t buckets;
+	uint64_t size;
+	uint64_t entriesOffset;
+};
+
+template<typename KeyType, typename ValueType>
+struct SnapshotEntry
+{
+	KeyType first;
+	ValueType second;
+};
+
+inline uint64_t alignOffset(uint64_t offset, uint64_t alignment)
+{
+	return (offset + alignment - 1) / alignment * alignment;
+}
+
+template<typename KeyType, typename ValueType>
+SnapshotHeader makeSnapshotHeader(uint32_t kind, uint64_t buckets, uint64_t size)
+{
+	using Entry = SnapshotEntry<KeyType, ValueType>;
+
+	SnapshotHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, "AISDIMAP", sizeof(header.magic));
+	header.version = SNAPSHOT_VERSION;
+	header.byteOrder = SNAPSHOT_BYTE_ORDER;
+	header.kind = kind;
+	header.entryAlignment = alignof(Entry) > 8 ? alignof(Entry) : 8;
+	header.keySize = sizeof(KeyType);
+	header.valueSize = sizeof(ValueType);
+	header.entrySize = sizeof(Entry);
+	header.buckets = buckets;
+	header.size = size;
+	header.entriesOffset = alignOffset(sizeof(SnapshotHeader) + (buckets + 1) * sizeof(uint64_t), header.entryAlignment);
+	return header;
+}
+
+// throws if the header wasn't written for these types, kind and format version
+template<typename KeyType, typename ValueType>
+void checkSnapshotHeader(const SnapshotHeader &header, uint32_t kind, size_t fileSize)
+{
+	if(header.buckets >= fileSize / sizeof(uint64_t))
+		throw std::runtime_error("snapshot is truncated");
+	SnapshotHeader expected = makeSnapshotHeader<KeyType, ValueType>(kind, header.buckets, header.size);
+
+	if(std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0)
+		throw std::runtime_error("not a map snapshot");
+	if(header.version != expected.version || header.byteOrder != expected.byteOrder)
+		throw std::runtime_error("unsupported snapshot version or byte order");
+	if(header.kind != kind)
+		throw std::runtime_error("snapshot holds a different kind of map");
+	if(header.keySize != expected.keySize || header.valueSize != expected.valueSize
+	   || header.entrySize != expected.entrySize || header.entryAlignment != expected.entryAlignment)
+		throw std::runtime_error("snapshot was written for different key or value types");
+	if(header.entriesOffset != expected.entriesOffset || header.entriesOffset > fileSize
+	   || (fileSize - header.entriesOffset) / header.entrySize < header.size)
+		throw std::runtime_error("snapshot is truncated");
+}
+
+template<typename KeyType, typename ValueType>
+void checkSnapshotTypes()
+{
+	static_assert(std::is_trivially_copyable<KeyType>::value, "snapshot keys have to be trivially copyable");
+	static_assert(std::is_trivially_copyable<ValueType>::value, "snapshot values have to be trivially copyable");
+}
+
+inline void writeBytes(std::ofstream &out, const void *data, size_t count)
+{
+	out.write(static_cast<const char *>(data), static_cast<std::streamsize>(count));
+}
+
+inline void writePadding(std::ofstream &out, uint64_t from, uint64_t to)
+{
+	static const char zeros[64] = {};
+	while(from < to)
+	{
+		uint64_t chunk = to - from < sizeof(zeros) ? to - from : sizeof(zeros);
+		writeBytes(out, zeros, chunk);
+		from += chunk;
+	}
+}
+
+// Writes a chained hash snapshot of any range of key/value pairs with unique keys.
+template<typename KeyType, typename ValueType, typename Range>
+void writeHashSnapshot(const std::string &path, const Range &range, size_t size)
+{
+	checkSnapshotTypes<KeyType, ValueType>();
+	using Entry = SnapshotEntry<KeyType, ValueType>;
+
+	uint64_t buckets = size == 0 ? 1 : size;
+	std::vector<uint64_t> bucketOf;
+	std::vector<uint64_t> bucketStart(buckets + 1, 0);
+	bucketOf.reserve(size);
+	for(auto &elem : range)
+	{
+		bucketOf.push_back(std::hash<KeyType>{}(elem.first) % buckets);
+		++bucketStart[bucketOf.back() + 1];
+	}
+	if(bucketOf.size() != size)
+		throw std::logic_error("snapshot size doesn't match the range");
+	for(uint64_t i = 0; i < buckets; ++i)
+		bucketStart[i + 1] += bucketStart[i];
+
+	std::vector<Entry> entries(size);
+	std::vector<uint64_t> next(bucketStart.begin(), bucketStart.end() - 1);
+	size_t i = 0;
+	for(auto &elem : range)
+	{
+		Entry &entry = entries[next[bucketOf[i++]]++];
+		entry.first = elem.first;
+		entry.second = elem.second;
+	}
+
+	SnapshotHeader header = makeSnapshotHeader<KeyType, ValueType>(CHAINED_HASH_SNAPSHOT, buckets, size);
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	if(!out)
+		throw std::runtime_error("can't open " + path + " for writing");
+
+	writeBytes(out, &header, sizeof(header));
+	writeBytes(out, bucketStart.data(), bucketStart.size() * sizeof(uint64_t));
+	writePadding(out, sizeof(header) + bucketStart.size() * sizeof(uint64_t), header.entriesOffset);
+	writeBytes(out, entries.data(), entries.size() * sizeof(Entry));
+
+	out.flush();
+	if(!out)
+		throw std::runtime_error("can't write " + path);
+}
+
+// Read-only mapping of a whole file; pages are faulted in only when touched.
+class MappedFile
+{
+	void *data = nullptr;
+	size_t length = 0;
+
+	void unmap()
+	{
+		if(data != nullptr)
+			munmap(data, length);
+		data = nullptr;
+		length = 0;
+	}
+
+public:
+	MappedFile() = default;
+
+	// advice goes to madvise: lookups touch single buckets, so by default read-ahead is
+	// off; readers making one pass over the file want MADV_SEQUENTIAL instead
+	explicit MappedFile(const std::string &path, int advice = MADV_RANDOM)
+	{
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if(fd < 0)
+			throw std::runtime_error("can't open " + path);
+
+		struct stat info;
+		if(fstat(fd, &info) != 0)
+		{
+			::close(fd);
+			throw std::runtime_error("can't stat " + path);
+		}
+		length = static_cast<size_t>(info.st_size);
+
+		if(length > 0)
+		{
+			data = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+			if(data == MAP_FAILED)
+			{
+				data = nullptr;
+				::close(fd);
+				throw std::runtime_error("can't map " + path);
+			}
+			madvise(data, length, advice);
+		}
+		::close(fd);
+	}
+
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	MappedFile(MappedFile &&other) : data(other.data), length(other.length)
+	{
+		other.data = nullptr;
+		other.length = 0;
+	}
+
+	MappedFile &operator=(MappedFile &&other)
+	{
+		if(this != &other)
+		{
+			unmap();
+			data = other.data;
+			length = other.length;
+			other.data = nullptr;
+			other.length = 0;
+		}
+		return *this;
+	}
+
+	~MappedFile()
+	{
+		unmap();
+	}
+
+	const char *bytes() const
+	{
+		return static_cast<const char *>(data);
+	}
+
+	size_t getSize() const
+	{
+		return length;
+	}
+};
+
+// Zero-copy view of a file written by HashMap::saveSnapshot. Opening only validates
+// the header; entries are read straight from the mapping, and a bucket's bounds are
+// checked when a lookup reaches it.
+template<typename KeyType, typename ValueType>
+class HashMapSnapshot
+{
+public:
+	using key_type = KeyType;
+	using mapped_type = ValueType;
+	using value_type = SnapshotEntry<KeyType, ValueType>;
+	using size_type = std::size_t;
+	using const_reference = const value_type &;
+	using const_iterator = const value_type *;
+
+private:
+	MappedFile file;
+	const SnapshotHeader *header = nullptr;
+	const uint64_t *bucketStart = nullptr;
+	const value_type *entries = nullptr;
+
+public:
+	explicit HashMapSnapshot(const std::string &path) : file(path)
+	{
+		checkSnapshotTypes<KeyType, ValueType>();
+
+		if(file.getSize() < sizeof(SnapshotHeader))
+			throw std::runtime_error("snapshot is truncated");
+		header = reinterpret_cast<const SnapshotHeader *>(file.bytes());
+		checkSnapshotHeader<KeyType, ValueType>(*header, CHAINED_HASH_SNAPSHOT, file.getSize());
+
+		bucketStart = reinterpret_cast<const uint64_t *>(file.bytes() + sizeof(SnapshotHeader));
+		entries = reinterpret_cast<const value_type *>(file.bytes() + header->entriesOffset);
+		if(header->buckets == 0 || bucketStart[0] != 0 || bucketStart[header->buckets] != header->size)
+			throw std::runtime_error("snapshot bucket table is corrupted");
+	}
+
+	bool isEmpty() const
+	{
+		return header->size == 0;
+	}
+
+	size_type getSize() const
+	{
+		return header->size;
+	}
+
+	const_iterator find(const key_type &key) const
+	{
+		uint64_t bucket = std::hash<key_type>{}(key) % header->buckets;
+		uint64_t first = bucketStart[bucket];
+		uint64_t last = bucketStart[bucket + 1];
+		if(first > last || last > header->size)
+			throw std::runtime_error("snapshot bucket table is corrupted");
+
+		for(const value_type *entry = entries + first; entry != entries + last; ++entry)
+		{
+			if(entry->first == key)
+				return entry;
+		}
+		return end();
+	}
+
+	bool contains(const key_type &key) const
+	{
+		return find(key) != end();
+	}
+
+	const mapped_type &valueOf(const key_type &key) const
+	{
+		auto it = find(key);
+		if(it == end())
+			throw std::out_of_range("key doesn't exist");
+		return it->second;
+	}
+
+	const_iterator begin() const
+	{
+		return entries;
+	}
+
+	const_iterator end() const
+	{
+		return entries + header->size;
+	}
+
+	const_iterator cbegin() const
+	{
+		return begin();
+	}
+
+	const_iterator cend() const
+	{
+		return end();
+	}
+};
+
+}
+
+#endif /* AISDI_MAPS_SNAPSHOT_H */
@@ -0,0 +1,1058 @@
+#ifndef AISDI_MAPS_SPILLABLEHASHMAP_H
+#define AISDI_MAPS_SPILLABLEHASHMAP_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+#include "BloomFilter.h"
+#include "HashMap.h"
+#include "MapStats.h"
+#include "Snapshot.h"
+
+#define SPILL_PARTITIONS 256
+#define SPILL_MEMORY_BUDGET (256u << 20)
+#define SPILL_DIRECTORY "/tmp"
+#define SPILL_FORMAT_VERSION 1
+
+namespace aisdi
+{
+
+// How keys and values are written to spill files: trivially copyable types as their
+// bytes, strings as a length and the characters. Any other type needs a
+// specialization with the same two functions.
+template<typename T, typename Enable = void>
+struct SpillCodec;
+
+template<typename T>
+struct SpillCodec<T, typename std::enable_if<std::is_trivially_copyable<T>::value>::type>
+{
+	static void write(std::string &out, const T &value)
+	{
+		out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+	}
+
+	static T read(const char *&cursor, const char *end)
+	{
+		if(static_cast<size_t>(end - cursor) < sizeof(T))
+			throw std::runtime_error("spill file is truncated");
+		T value;
+		std::memcpy(&value, cursor, sizeof(T));
+		cursor += sizeof(T);
+		return value;
+	}
+};
+
+template<>
+struct SpillCodec<std::string>
+{
+	static void write(std::string &out, const std::string &text)
+	{
+		SpillCodec<uint64_t>::write(out, text.size());
+		out.append(text);
+	}
+
+	static std::string read(const char *&cursor, const char *end)
+	{
+		uint64_t length = SpillCodec<uint64_t>::read(cursor, end);
+		if(static_cast<uint64_t>(end - cursor) < length)
+			throw std::runtime_error("spill file is truncated");
+		std::string text(cursor, static_cast<size_t>(length));
+		cursor += length;
+		return text;
+	}
+};
+
+// Spill files are written and read by the same process, in native byte order.
+//
+// layout: SpillHeader | records' bytes | uint64_t bucketStart[buckets + 1] | SpillRecord records[size]
+// the records of bucket b (hash % buckets) are records[bucketStart[b]] ... records[bucketStart[b + 1] - 1],
+// their encoded key and value follow each other in the same order
+struct SpillHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint64_t size;
+	uint64_t buckets;
+	uint64_t dataEnd;
+	uint64_t tableOffset;
+};
+
+struct SpillRecord
+{
+	uint64_t hash;
+	uint64_t offset;
+};
+
+// a value held in memory by SpillableHashMap
+template<typename ValueType>
+struct SpillSlot
+{
+	ValueType value{};
+	bool referenced = false; // used since its partition was last swept
+};
+
+template<typename ValueType>
+size_t ownedBytes(const SpillSlot<ValueType> &slot)
+{
+	return ownedBytes(slot.value);
+}
+
+// tells the spill files of maps living at the same time apart
+inline unsigned long nextSpillId()
+{
+	static std::atomic<unsigned long> next{0};
+	return next++;
+}
+
+// HashMap that stays within a memory budget by writing cold elements to disk.
+// Keys are hashed into partitions, each holding its hot elements in an ordinary
+// HashMap and its cold ones in a spill file. When the hot elements outgrow the
+// budget, partitions are swept least recently used first, and each sweep writes out
+// the elements that weren't used since the previous one (a second chance clock per
+// partition). A spill file is a hash table that lookups read in place through a
+// mapping, so the page cache is the buffer they go through; an element found there
+// is read back and joins the hot ones. Each spill file keeps a Bloom filter of its
+// keys in memory, which answers most lookups of absent keys without touching it.
+//
+// Spill files are immutable: elements read back or removed are only marked dead in
+// memory, and the next sweep of the partition writes its live ones to a new file. A
+// partition is never swept to make room for itself.
+//
+// Any call may move elements between memory and disk, const lookups included:
+// iterators and references are only valid until the next call on the map. A const
+// walk reads spilled elements in place and hands out copies of them; a non-const
+// one reads each back as it gets there, so its writes stick. Values growing through
+// references are charged to the budget when their partition is next swept; the
+// charge is exact for keys and values that own no heap memory.
+//
+// Unlike HashMap, iterators don't hand out value_type &: hot elements are stored
+// next to their clock mark and spilled ones are decoded copies, so dereferencing
+// yields a std::pair<const key_type &, mapped_type &> proxy (with const mapped_type &
+// for const iterators) built on the fly. for(auto &elem : map) doesn't compile;
+// walk with auto, const auto & or auto && instead.
+template<typename KeyType, typename ValueType>
+class SpillableHashMap
+{
+public:
+	using key_type = KeyType;
+	using mapped_type = ValueType;
+	using value_type = std::pair<const key_type, mapped_type>;
+	using size_type = std::size_t;
+	using reference = std::pair<const key_type &, mapped_type &>;
+	using const_reference = std::pair<const key_type &, const mapped_type &>;
+
+	class ConstIterator;
+
+	class Iterator;
+
+	using iterator = Iterator;
+	using const_iterator = ConstIterator;
+
+private:
+	// nothing outlives the next call, so the flat layout serves where it can
+	using Hot = HashMap<key_type, SpillSlot<mapped_type>, UseFlatStorage<key_type, SpillSlot<mapped_type>>::value>;
+	using HotElement = typename Hot::value_type;
+
+	// A partition's spill file, mapped. Dead records are ones read back or removed
+	// since the file was written.
+	struct Segment
+	{
+		std::string path;
+		MappedFile file;
+		SpillHeader header;
+		const uint64_t *bucketStart;
+		const SpillRecord *records;
+		std::vector<bool> dead;
+		size_t live;
+		BloomFilter filter;
+
+		explicit Segment(const std::string &path)
+				: path(path), file(path), header(readHeader(file, path)),
+				  bucketStart(reinterpret_cast<const uint64_t *>(file.bytes() + header.tableOffset)),
+				  records(reinterpret_cast<const SpillRecord *>(bucketStart + header.buckets + 1)),
+				  dead(header.size, false), live(header.size), filter(header.size)
+		{
+			for(uint64_t i = 0; i < header.size; ++i)
+				filter.add(records[i].hash);
+		}
+
+		static SpillHeader readHeader(const MappedFile &file, const std::string &path)
+		{
+			SpillHeader header;
+			if(file.getSize() < sizeof(header))
+				throw std::runtime_error(path + " is truncated");
+			std::memcpy(&header, file.bytes(), sizeof(header));
+			if(std::memcmp(header.magic, "AISDISPL", sizeof(header.magic)) != 0 || header.version != SPILL_FORMAT_VERSION
+			   || header.byteOrder != SNAPSHOT_BYTE_ORDER)
+				throw std::runtime_error(path + " isn't a spill file");
+			if(header.buckets == 0 || header.dataEnd > header.tableOffset || header.tableOffset > file.getSize()
+			   || (file.getSize() - header.tableOffset) / sizeof(uint64_t) < header.buckets + 1 + 2 * header.size)
+				throw std::runtime_error(path + " is truncated");
+			return header;
+		}
+
+		const char *data(uint64_t record) const
+		{
+			return file.bytes() + records[record].offset;
+		}
+
+		const char *dataEnd(uint64_t record) const
+		{
+			return record + 1 < header.size ? data(record + 1) : file.bytes() + header.dataEnd;
+		}
+
+		// only what lives on the heap, the mapping is page cache
+		size_t memoryUsage() const
+		{
+			return heapBlockSize(sizeof(Segment)) + ownedBytes(path) + heapBlockSize((dead.size() + 63) / 64 * 8)
+			       + filter.memoryUsage();
+		}
+	};
+
+	struct Partition
+	{
+		Hot hot;
+		std::unique_ptr<Segment> cold;
+		size_t hotBytes = 0;          // what hot takes in memory
+		size_t lastUse = 0;
+		unsigned long generation = 0; // of the spill file, every write makes a new one
+
+		size_t size() const
+		{
+			return hot.getSize() + (cold != nullptr ? cold->live : 0);
+		}
+	};
+
+	// spilling is invisible to readers, so const lookups may do it
+	mutable std::vector<Partition> partitions;
+	mutable size_t residentBytes = 0; // hot elements and segments
+	mutable size_t useClock = 0;
+	mutable SpillStats counters;
+	size_t elements = 0;
+	size_t budget;
+	std::string directory;
+	unsigned long id;
+
+	static size_t hashOf(const key_type &key)
+	{
+		return std::hash<key_type>{}(key);
+	}
+
+	// HashMap picks buckets by hash % buckets, so the partition takes the high bits
+	// of a multiplicative mix instead, or keys of a partition would share buckets
+	size_t partitionOf(size_t hash) const
+	{
+		return static_cast<size_t>((static_cast<uint64_t>(hash) * 0x9E3779B97F4A7C15ull) >> 32) % partitions.size();
+	}
+
+	// Every write goes to a new file: ext4 flushes a file truncated and rewritten in
+	// place when it is closed, which would cost a disk write every sweep.
+	std::string spillPath(size_t index, unsigned long generation) const
+	{
+		return directory + "/aisdi-spill-" + std::to_string(getpid()) + "-" + std::to_string(id) + "-"
+		       + std::to_string(index) + "-" + std::to_string(generation);
+	}
+
+	// list node of the chained map, or slot of the flat one
+	static size_t elementBytes(const HotElement &element)
+	{
+		return heapBlockSize(sizeof(HotElement) + sizeof(size_t) + 2 * sizeof(void *)) + ownedBytes(element.first)
+		       + ownedBytes(element.second.value);
+	}
+
+	void setHotBytes(Partition &part, size_t bytes) const
+	{
+		residentBytes = residentBytes - part.hotBytes + bytes;
+		part.hotBytes = bytes;
+	}
+
+	// after an element was added or removed: exact where memoryUsage() is O(1),
+	// an estimate of the element otherwise
+	void recharge(Partition &part, size_t element, bool added) const
+	{
+		if(!MayOwnHeap<key_type, mapped_type>::value)
+			setHotBytes(part, part.hot.memoryUsage());
+		else if(added)
+			setHotBytes(part, part.hotBytes + element);
+		else
+			setHotBytes(part, part.hotBytes - std::min(part.hotBytes, element));
+	}
+
+	static std::pair<key_type, mapped_type> decode(const Segment &segment, uint64_t record)
+	{
+		const char *cursor = segment.data(record);
+		const char *end = segment.dataEnd(record);
+		key_type key = SpillCodec<key_type>::read(cursor, end);
+		return std::pair<key_type, mapped_type>(std::move(key), SpillCodec<mapped_type>::read(cursor, end));
+	}
+
+	static const uint64_t NO_RECORD = ~uint64_t(0);
+
+	// the live spilled record of key, or NO_RECORD
+	uint64_t spilledRecord(const Partition &part, const key_type &key, size_t hash) const
+	{
+		if(part.cold == nullptr)
+			return NO_RECORD;
+		const Segment &segment = *part.cold;
+		if(!segment.filter.mayContain(hash))
+		{
+			++counters.filterRejects;
+			return NO_RECORD;
+		}
+
+		uint64_t bucket = hash % segment.header.buckets;
+		for(uint64_t i = segment.bucketStart[bucket]; i < segment.bucketStart[bucket + 1]; ++i)
+		{
+			if(segment.records[i].hash != hash || segment.dead[i])
+				continue;
+			const char *cursor = segment.data(i);
+			if(SpillCodec<key_type>::read(cursor, segment.dataEnd(i)) == key)
+				return i;
+		}
+		return NO_RECORD;
+	}
+
+	void dropSegment(Partition &part) const
+	{
+		residentBytes -= part.cold->memoryUsage();
+		std::remove(part.cold->path.c_str());
+		part.cold.reset();
+	}
+
+	// the spill file goes once nothing in it is live
+	void killRecord(size_t index, uint64_t record) const
+	{
+		Partition &part = partitions[index];
+		part.cold->dead[record] = true;
+		if(--part.cold->live == 0)
+			dropSegment(part);
+	}
+
+	// moves a spilled element to the hot ones, unmarked
+	typename Hot::iterator readBack(size_t index, uint64_t record) const
+	{
+		Partition &part = partitions[index];
+		auto element = decode(*part.cold, record);
+		auto it = part.hot.findOrInsert(element.first).first;
+		it->second.value = std::move(element.second);
+		killRecord(index, record);
+		recharge(part, elementBytes(*it), true);
+		++counters.pageIns;
+		return it;
+	}
+
+	// the hot element of key, read back if it was spilled, or hot.end()
+	typename Hot::iterator lookup(size_t index, const key_type &key, size_t hash) const
+	{
+		Partition &part = partitions[index];
+		part.lastUse = ++useClock;
+		auto it = part.hot.find(key);
+		if(it != part.hot.end())
+			return it;
+
+		uint64_t record = spilledRecord(part, key, hash);
+		if(record == NO_RECORD)
+			return it;
+		it = readBack(index, record);
+		enforceBudget(index);
+		return it;
+	}
+
+	// Writes the partition's live spilled records and the leaving elements to a new
+	// file that replaces the old one. Old records are copied as they are.
+	void writeSegment(size_t index, const std::vector<const HotElement *> &leaving) const
+	{
+		Partition &part = partitions[index];
+		const Segment *old = part.cold.get();
+
+		struct Source
+		{
+			uint64_t hash;
+			const HotElement *element; // nullptr for an old record
+			uint64_t record;
+		};
+		std::vector<Source> sources;
+		sources.reserve(leaving.size() + (old != nullptr ? old->live : 0));
+		for(uint64_t i = 0; old != nullptr && i < old->header.size; ++i)
+		{
+			if(!old->dead[i])
+				sources.push_back({old->records[i].hash, nullptr, i});
+		}
+		for(const HotElement *element : leaving)
+			sources.push_back({hashOf(element->first), element, 0});
+
+		uint64_t buckets = sources.size() > 0 ? sources.size() : 1;
+		std::vector<uint64_t> bucketStart(buckets + 1, 0);
+		for(const Source &source : sources)
+			++bucketStart[source.hash % buckets + 1];
+		for(uint64_t i = 0; i < buckets; ++i)
+			bucketStart[i + 1] += bucketStart[i];
+		std::vector<size_t> order(sources.size());
+		std::vector<uint64_t> next(bucketStart.begin(), bucketStart.end() - 1);
+		for(size_t i = 0; i < sources.size(); ++i)
+			order[next[sources[i].hash % buckets]++] = i;
+
+		std::string path = spillPath(index, part.generation + 1);
+		std::ofstream out(path, std::ios::binary | std::ios::trunc);
+		if(!out)
+			throw std::runtime_error("can't open " + path + " for writing");
+
+		SpillHeader header;
+		std::memset(&header, 0, sizeof(header));
+		std::memcpy(header.magic, "AISDISPL", sizeof(header.magic));
+		header.version = SPILL_FORMAT_VERSION;
+		header.byteOrder = SNAPSHOT_BYTE_ORDER;
+		header.size = sources.size();
+		header.buckets = buckets;
+		writeBytes(out, &header, sizeof(header));
+
+		std::vector<SpillRecord> records(sources.size());
+		uint64_t offset = sizeof(header);
+		std::string encoded;
+		for(size_t i = 0; i < order.size(); ++i)
+		{
+			const Source &source = sources[order[i]];
+			records[i].hash = source.hash;
+			records[i].offset = offset;
+			if(source.element == nullptr)
+			{
+				const char *bytes = old->data(source.record);
+				size_t length = static_cast<size_t>(old->dataEnd(source.record) - bytes);
+				writeBytes(out, bytes, length);
+				offset += length;
+			}
+			else
+			{
+				encoded.clear();
+				SpillCodec<key_type>::write(encoded, source.element->first);
+				SpillCodec<mapped_type>::write(encoded, source.element->second.value);
+				writeBytes(out, encoded.data(), encoded.size());
+				offset += encoded.size();
+			}
+		}
+		header.dataEnd = offset;
+		header.tableOffset = alignOffset(offset, sizeof(uint64_t));
+		writePadding(out, offset, header.tableOffset);
+		writeBytes(out, bucketStart.data(), bucketStart.size() * sizeof(uint64_t));
+		writeBytes(out, records.data(), records.size() * sizeof(SpillRecord));
+		out.seekp(0);
+		writeBytes(out, &header, sizeof(header));
+		out.close();
+
+		std::unique_ptr<Segment> segment;
+		try
+		{
+			if(!out)
+				throw std::runtime_error("can't write " + path);
+			segment.reset(new Segment(path));
+		}
+		catch(...)
+		{
+			std::remove(path.c_str());
+			throw;
+		}
+		if(old != nullptr)
+			dropSegment(part);
+		part.cold = std::move(segment);
+		++part.generation;
+		residentBytes += part.cold->memoryUsage();
+		++counters.fileWrites;
+	}
+
+	// Writes out the partition's hot elements that weren't used since its previous
+	// sweep, or all of them, and unmarks the rest.
+	void sweep(size_t index, bool all) const
+	{
+		Partition &part = partitions[index];
+		std::vector<const HotElement *> leaving;
+		for(auto &elem : part.hot)
+		{
+			if(all || !elem.second.referenced)
+				leaving.push_back(&elem);
+		}
+
+		if(!leaving.empty())
+		{
+			writeSegment(index, leaving);
+			if(all)
+				part.hot = Hot();
+			else
+			{
+				part.hot.eraseIf([](const HotElement &elem)
+				{
+					return !elem.second.referenced;
+				});
+				part.hot.shrink_to_fit();
+			}
+			counters.evictions += leaving.size();
+			setHotBytes(part, part.hot.memoryUsage());
+		}
+		for(auto &elem : part.hot)
+			elem.second.referenced = false;
+	}
+
+	// Sweeps partitions other than keep, least recently used first, until the
+	// resident bytes are down to 7/8 of the budget, so writes come in batches. A
+	// partition swept without writing anything has its elements unmarked and goes
+	// to the back, so the loop ends.
+	void enforceBudget(size_t keep) const
+	{
+		if(residentBytes <= budget)
+			return;
+
+		size_t target = budget - budget / 8;
+		while(residentBytes > target)
+		{
+			size_t victim = partitions.size();
+			for(size_t i = 0; i < partitions.size(); ++i)
+			{
+				const Partition &part = partitions[i];
+				if(i == keep || part.hot.isEmpty())
+					continue;
+				if(victim == partitions.size() || part.lastUse < partitions[victim].lastUse)
+					victim = i;
+			}
+			if(victim == partitions.size())
+				return;
+			partitions[victim].lastUse = ++useClock;
+			sweep(victim, false);
+		}
+	}
+
+	void removeFiles()
+	{
+		for(Partition &part : partitions)
+		{
+			if(part.cold != nullptr)
+				std::remove(part.cold->path.c_str());
+		}
+	}
+
+	void reset(size_t partitionCount)
+	{
+		partitions = std::vector<Partition>(partitionCount > 0 ? partitionCount : 1);
+		residentBytes = 0;
+		for(Partition &part : partitions)
+			setHotBytes(part, part.hot.memoryUsage());
+		elements = 0;
+		id = nextSpillId();
+	}
+
+public:
+
+	explicit SpillableHashMap(size_t memoryBudget = SPILL_MEMORY_BUDGET, const std::string &directory = SPILL_DIRECTORY,
+	                          size_t partitionCount = SPILL_PARTITIONS)
+			: budget(memoryBudget), directory(directory)
+	{
+		reset(partitionCount);
+	}
+
+	SpillableHashMap(std::initializer_list<value_type> list) : SpillableHashMap()
+	{
+		for(auto &elem : list)
+			(*this)[elem.first] = elem.second;
+	}
+
+	// copies element by element, the copy spills within its own budget
+	SpillableHashMap(const SpillableHashMap &other)
+			: SpillableHashMap(other.budget, other.directory, other.partitions.size())
+	{
+		for(auto elem : other)
+			(*this)[elem.first] = elem.second;
+	}
+
+	SpillableHashMap(SpillableHashMap &&other)
+			: partitions(std::move(other.partitions)), residentBytes(other.residentBytes), useClock(other.useClock),
+			  counters(other.counters), elements(other.elements), budget(other.budget), directory(other.directory), id(other.id)
+	{
+		other.reset(partitions.size());
+	}
+
+	~SpillableHashMap()
+	{
+		removeFiles();
+	}
+
+	SpillableHashMap &operator=(const SpillableHashMap &other)
+	{
+		if(this != &other)
+			*this = SpillableHashMap(other);
+		return *this;
+	}
+
+	SpillableHashMap &operator=(SpillableHashMap &&other)
+	{
+		if(this != &other)
+		{
+			removeFiles();
+			partitions = std::move(other.partitions);
+			residentBytes = other.residentBytes;
+			useClock = other.useClock;
+			counters = other.counters;
+			elements = other.elements;
+			budget = other.budget;
+			directory = other.directory;
+			id = other.id;
+			other.reset(partitions.size());
+		}
+		return *this;
+	}
+
+	bool isEmpty() const
+	{
+		return elements == 0;
+	}
+
+	mapped_type &operator[](const key_type &key)
+	{
+		size_t hash = hashOf(key);
+		size_t index = partitionOf(hash);
+		Partition &part = partitions[index];
+		auto it = lookup(index, key, hash);
+		if(it == part.hot.end())
+		{
+			it = part.hot.findOrInsert(key).first;
+			++elements;
+			recharge(part, elementBytes(*it), true);
+			enforceBudget(index);
+		}
+		it->second.referenced = true;
+		return it->second.value;
+	}
+
+	const mapped_type &valueOf(const key_type &key) const
+	{
+		auto it = find(key);
+		if(it == end())
+			throw std::out_of_range("key doesn't exist");
+		return it->second;
+	}
+
+	mapped_type &valueOf(const key_type &key)
+	{
+		// ugly cast, yet reduces code duplication.
+		return const_cast<mapped_type &>( (const_cast<const SpillableHashMap *>(this))->valueOf(key));
+	}
+
+	const_iterator find(const key_type &key) const
+	{
+		size_t hash = hashOf(key);
+		size_t index = partitionOf(hash);
+		auto it = lookup(index, key, hash);
+		if(it == partitions[index].hot.end())
+			return cend();
+		it->second.referenced = true;
+		return ConstIterator(this, index, it);
+	}
+
+	iterator find(const key_type &key)
+	{
+		return Iterator( (const_cast<const SpillableHashMap *>(this))->find(key));
+	}
+
+	void remove(const key_type &key)
+	{
+		size_t hash = hashOf(key);
+		size_t index = partitionOf(hash);
+		Partition &part = partitions[index];
+		part.lastUse = ++useClock;
+		auto it = part.hot.find(key);
+		if(it != part.hot.end())
+		{
+			erase(ConstIterator(this, index, it));
+			return;
+		}
+
+		uint64_t record = spilledRecord(part, key, hash);
+		if(record == NO_RECORD)
+			throw std::out_of_range("key doesn't exist");
+		killRecord(index, record);
+		--elements;
+	}
+
+	void remove(const const_iterator &it)
+	{
+		erase(it);
+	}
+
+	// Removes the element and returns the iterator following it.
+	iterator erase(const const_iterator &it)
+	{
+		if(it.map != this || it.partition >= partitions.size())
+			throw std::out_of_range("out of range");
+
+		Partition &part = partitions[it.partition];
+		ConstIterator next = it;
+		if(it.inCold && !it.writable)
+			killRecord(it.partition, it.record);
+		else
+		{
+			size_t element = elementBytes(*it.hot);
+			next.hot = part.hot.erase(it.hot);
+			recharge(part, element, false);
+		}
+		if(it.inCold)
+			++next.record;
+		--elements;
+		next.spilled.reset();
+		next.settle();
+		return Iterator(next);
+	}
+
+	size_type getSize() const
+	{
+		return elements;
+	}
+
+	// Writes every hot element out; the next accesses read back only what they touch.
+	void spillAll()
+	{
+		for(size_t i = 0; i < partitions.size(); ++i)
+		{
+			if(!partitions[i].hot.isEmpty())
+				sweep(i, true);
+		}
+	}
+
+	size_t memoryBudget() const
+	{
+		return budget;
+	}
+
+	// a smaller budget spills right away
+	void setMemoryBudget(size_t memoryBudget)
+	{
+		budget = memoryBudget;
+		enforceBudget(partitions.size());
+	}
+
+	size_t partitionCount() const
+	{
+		return partitions.size();
+	}
+
+	bool operator==(const SpillableHashMap &other) const
+	{
+		if(elements != other.elements)
+			return false;
+
+		for(auto elem : other)
+		{
+			auto it = find(elem.first);
+			if(it == end() || !(it->second == elem.second))
+				return false;
+		}
+		return true;
+	}
+
+	bool operator!=(const SpillableHashMap &other) const
+	{
+		return !(*this == other);
+	}
+
+	// bytes held in memory: hot elements, and the dead marks and filters of spill files
+	size_t memoryUsage() const
+	{
+		return sizeof(*this) + heapBlockSize(partitions.capacity() * sizeof(Partition)) + residentBytes;
+	}
+
+	SpillStats stats() const
+	{
+		SpillStats result = counters;
+		result.size = elements;
+		result.partitions = partitions.size();
+		result.residentBytes = residentBytes;
+		result.memoryBudget = budget;
+		for(const Partition &part : partitions)
+		{
+			result.hotElements += part.hot.getSize();
+			if(part.cold != nullptr)
+				result.spilledBytes += part.cold->file.getSize();
+		}
+		return result;
+	}
+
+	void dumpStats(std::ostream &out) const
+	{
+		stats().writeJson(out);
+	}
+
+	void resetStats()
+	{
+		counters = SpillStats();
+	}
+
+	iterator begin()
+	{
+		Iterator it;
+		it.map = this;
+		it.writable = true;
+		it.enter();
+		it.settle();
+		return it;
+	}
+
+	iterator end()
+	{
+		return Iterator(cend());
+	}
+
+	const_iterator cbegin() const
+	{
+		ConstIterator it(this, 0);
+		it.enter();
+		it.settle();
+		return it;
+	}
+
+	const_iterator cend() const
+	{
+		return ConstIterator(this, partitions.size());
+	}
+
+	const_iterator begin() const
+	{
+		return cbegin();
+	}
+
+	const_iterator end() const
+	{
+		return cend();
+	}
+};
+
+// Walks the partitions in index order, the hot elements of each and then its live
+// spilled records.
+template<typename KeyType, typename ValueType>
+class SpillableHashMap<KeyType, ValueType>::ConstIterator
+{
+public:
+	using reference = typename SpillableHashMap::const_reference;
+	using iterator_category = std::forward_iterator_tag;
+	using value_type = typename SpillableHashMap::value_type;
+	using difference_type = std::ptrdiff_t;
+
+	// elements are a key and a slot, or a copy read from a spill file, so -> hands
+	// out a temporary pair of references
+	class pointer
+	{
+		reference entry;
+
+	public:
+		explicit pointer(reference entry) : entry(entry)
+		{}
+
+		const reference *operator->() const
+		{
+			return &entry;
+		}
+	};
+
+	friend class SpillableHashMap;
+
+protected:
+	using HotIterator = typename Hot::const_iterator;
+
+	const SpillableHashMap *map = nullptr;
+	size_t partition = 0;   // partitions.size() for end()
+	HotIterator hot;        // also the record read back by a writable iterator
+	bool inCold = false;    // past the hot elements, at a spilled record
+	uint64_t record = 0;
+	std::shared_ptr<const std::pair<key_type, mapped_type>> spilled; // copy of the record
+	bool writable = false;  // an Iterator reads records back instead of copying them
+
+	ConstIterator(const SpillableHashMap *map, size_t partition, HotIterator hot = HotIterator())
+			: map(map), partition(partition), hot(hot)
+	{}
+
+	// to the start of the first partition from this one on that has elements
+	void enter()
+	{
+		inCold = false;
+		record = 0;
+		spilled.reset();
+		while(partition < map->partitions.size() && map->partitions[partition].size() == 0)
+			++partition;
+		hot = partition < map->partitions.size() ? map->partitions[partition].hot.cbegin() : HotIterator();
+	}
+
+	// at a live record: a writable iterator reads it back, keeping its partition
+	void arrive()
+	{
+		if(!writable)
+		{
+			spilled = std::make_shared<const std::pair<key_type, mapped_type>>(decode(*map->partitions[partition].cold, record));
+			return;
+		}
+		hot = map->readBack(partition, record);
+		map->enforceBudget(partition);
+	}
+
+	// from the current position on to the first element there is, or to end()
+	void settle()
+	{
+		while(partition < map->partitions.size())
+		{
+			const Partition &part = map->partitions[partition];
+			if(!inCold)
+			{
+				if(hot != part.hot.cend())
+					return;
+				inCold = true;
+			}
+			for(; part.cold != nullptr && record < part.cold->header.size; ++record)
+			{
+				if(!part.cold->dead[record])
+				{
+					arrive();
+					return;
+				}
+			}
+			++partition;
+			enter();
+		}
+		hot = HotIterator();
+		inCold = false;
+		spilled.reset();
+	}
+
+public:
+
+	explicit ConstIterator() = default;
+
+	ConstIterator &operator++()
+	{
+		if(map == nullptr)
+			throw std::logic_error("collection not given to iterator");
+		if(partition == map->partitions.size())
+			throw std::out_of_range("iterator out of range");
+
+		if(inCold)
+			++record;
+		else
+			++hot;
+		spilled.reset();
+		settle();
+		return *this;
+	}
+
+	ConstIterator operator++(int)
+	{
+		auto it = *this;
+		this->operator++();
+		return it;
+	}
+
+	reference operator*() const
+	{
+		if(map == nullptr || partition == map->partitions.size())
+			throw std::out_of_range("out of range");
+		if(inCold && !writable)
+			return reference(spilled->first, spilled->second);
+		return reference(hot->first, hot->second.value);
+	}
+
+	pointer operator->() const
+	{
+		return pointer(operator*());
+	}
+
+	bool operator==(const ConstIterator &other) const
+	{
+		if(map != other.map || partition != other.partition)
+			return false;
+		// end() carries no position to compare
+		if(map == nullptr || partition == map->partitions.size())
+			return true;
+		return inCold == other.inCold && record == other.record && (inCold || hot == other.hot);
+	}
+
+	bool operator!=(const ConstIterator &other) const
+	{
+		return !(*this == other);
+	}
+};
+
+template<typename KeyType, typename ValueType>
+class SpillableHashMap<KeyType, ValueType>::Iterator : public SpillableHashMap<KeyType, ValueType>::ConstIterator
+{
+public:
+	using reference = typename SpillableHashMap::reference;
+
+	class pointer
+	{
+		reference entry;
+
+	public:
+		explicit pointer(reference entry) : entry(entry)
+		{}
+
+		const reference *operator->() const
+		{
+			return &entry;
+		}
+	};
+
+	friend class SpillableHashMap;
+
+	explicit Iterator() = default;
+
+	// writes through the iterator have to reach the map, so a spilled record it
+	// stands at is read back
+	explicit Iterator(const ConstIterator &other) : ConstIterator(other)
+	{
+		if(this->inCold && !this->writable)
+		{
+			this->writable = true;
+			this->spilled.reset();
+			this->arrive();
+		}
+		this->writable = true;
+	}
+
+	Iterator &operator++()
+	{
+		ConstIterator::operator++();
+		return *this;
+	}
+
+	Iterator operator++(int)
+	{
+		auto result = *this;
+		ConstIterator::operator++();
+		return result;
+	}
+
+	pointer operator->() const
+	{
+		return pointer(operator*());
+	}
+
+	reference operator*() const
+	{
+		auto elem = ConstIterator::operator*();
+		// ugly cast, yet reduces code duplication.
+		return reference(elem.first, const_cast<mapped_type &>(elem.second));
+	}
+};
+
+}
+
+#endif /* AISDI_MAPS_SPILLABLEHASHMAP_H */
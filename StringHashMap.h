@@ -0,0 +1,584 @@
+#ifndef AISDI_MAPS_STRINGHASHMAP_H
+#define AISDI_MAPS_STRINGHASHMAP_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "MapStats.h"
+#include "StringKey.h"
+
+#define STRING_MAP_MIN_BUCKETS 16
+
+namespace aisdi
+{
+
+// Hash map for string keys. Key bytes are copied into an arena owned by the map,
+// entries sit in one vector and are chained through indices, and every entry keeps
+// its full hash: chains reject most mismatches on the hash alone, the remaining
+// candidates on length and prefix, and growing the bucket table never rehashes a key.
+//
+// Unlike HashMap's, elements move. An insert of a new key may reallocate the entry
+// vector, which invalidates every reference, pointer and iterator into the map;
+// reserve() up front keeps them valid until the map outgrows the reservation. An
+// erase moves the last entry into the hole, so it invalidates references to the
+// last element and iterators to it; erase() returns the iterator to continue a
+// sweep from. An erase that leaves most of the key arena garbage also copies the
+// keys into a new arena, so the keys' bytes (StringKey::data()) move too.
+template<typename ValueType>
+class StringHashMap
+{
+public:
+	using key_type = std::string;
+	using mapped_type = ValueType;
+	using value_type = std::pair<const StringKey, mapped_type>;
+	using size_type = std::size_t;
+	using reference = value_type &;
+	using const_reference = const value_type &;
+
+	class ConstIterator;
+
+	class Iterator;
+
+	using iterator = Iterator;
+	using const_iterator = ConstIterator;
+
+private:
+	static const size_t NONE = static_cast<size_t>(-1);
+
+	struct Entry
+	{
+		value_type value;
+		uint64_t hash;
+		size_t next;
+	};
+
+	std::vector<size_t> heads; // first entry of every bucket, a power of two of them
+	std::vector<Entry> entries;
+	StringArena arena;
+	MAP_STATS(mutable HashMapCounters counters;)
+
+	size_t bucketOf(uint64_t hash) const
+	{
+		return static_cast<size_t>(hash) & (heads.size() - 1);
+	}
+
+	size_t findIndex(const char *bytes, size_t length) const
+	{
+		MAP_STATS(++counters.lookups;)
+		if(heads.empty())
+			return entries.size();
+
+		uint64_t hash = hashBytes(bytes, length);
+		uint64_t prefix = loadPrefix(bytes, length);
+
+		for(size_t i = heads[bucketOf(hash)]; i != NONE; i = entries[i].next)
+		{
+			MAP_STATS(++counters.probes;)
+			if(entries[i].hash == hash && entries[i].value.first.equals(bytes, length, prefix))
+			{
+				MAP_STATS(++counters.lookupHits;)
+				return i;
+			}
+		}
+		return entries.size();
+	}
+
+	// link of the chain that points at entry i
+	size_t &linkTo(size_t i)
+	{
+		size_t *link = &heads[bucketOf(entries[i].hash)];
+		while(*link != i)
+			link = &entries[*link].next;
+		return *link;
+	}
+
+	// relinks all chains from the cached hashes
+	void rebuildChains(size_t bucketCount)
+	{
+		heads.assign(bucketCount, NONE);
+		for(size_t i = 0; i < entries.size(); ++i)
+		{
+			size_t &head = heads[bucketOf(entries[i].hash)];
+			entries[i].next = head;
+			head = i;
+		}
+	}
+
+	// replaces entry i in place; value_type has a const key, so it can't be assigned
+	void replaceEntry(size_t i, Entry &&entry)
+	{
+		entries[i].~Entry();
+		new (&entries[i]) Entry(std::move(entry));
+	}
+
+	size_t insertNew(const char *bytes, size_t length, mapped_type value)
+	{
+		if(entries.size() >= heads.size())
+			rebuildChains(std::max<size_t>(STRING_MAP_MIN_BUCKETS, 2 * heads.size()));
+
+		uint64_t hash = hashBytes(bytes, length);
+		StringKey key(arena.store(bytes, length), length);
+		size_t &head = heads[bucketOf(hash)];
+
+		entries.push_back(Entry{value_type(key, std::move(value)), hash, head});
+		head = entries.size() - 1;
+		MAP_STATS(++counters.inserts;)
+		return head;
+	}
+
+	void eraseIndex(size_t i)
+	{
+		MAP_STATS(++counters.removes;)
+		arena.release(entries[i].value.first.size());
+		size_t &link = linkTo(i);
+		link = entries[i].next;
+
+		size_t last = entries.size() - 1;
+		if(i != last)
+		{
+			linkTo(last) = i;
+			replaceEntry(i, std::move(entries[last]));
+		}
+		entries.pop_back();
+
+		if(arena.dead() > ARENA_CHUNK_SIZE && arena.dead() > arena.live())
+			compactArena();
+	}
+
+	// copies the live keys into a fresh arena once most of the old one is garbage
+	void compactArena()
+	{
+		StringArena compacted;
+		for(size_t i = 0; i < entries.size(); ++i)
+		{
+			const StringKey &key = entries[i].value.first;
+			StringKey moved(compacted.store(key.data(), key.size()), key.size());
+			replaceEntry(i, Entry{value_type(moved, std::move(entries[i].value.second)), entries[i].hash, entries[i].next});
+		}
+		arena = std::move(compacted);
+	}
+
+public:
+
+	StringHashMap()
+	{}
+
+	StringHashMap(std::initializer_list<std::pair<std::string, mapped_type>> list)
+	{
+		for(auto &elem : list)
+			(*this)[elem.first] = elem.second;
+	}
+
+	StringHashMap(const StringHashMap &other)
+	{
+		*this = other;
+	}
+
+	StringHashMap(StringHashMap &&other) = default;
+
+	StringHashMap &operator=(const StringHashMap &other)
+	{
+		if(this != &other)
+		{
+			StringHashMap copy;
+			copy.entries.reserve(other.entries.size());
+			for(auto &elem : other)
+			{
+				const StringKey &key = elem.first;
+				copy.insertNew(key.data(), key.size(), elem.second);
+			}
+			*this = std::move(copy);
+		}
+		return *this;
+	}
+
+	StringHashMap &operator=(StringHashMap &&other) = default;
+
+	bool isEmpty() const
+	{
+		return entries.empty();
+	}
+
+	size_type getSize() const
+	{
+		return entries.size();
+	}
+
+	size_type capacity() const
+	{
+		return heads.size();
+	}
+
+	void reserve(size_type count)
+	{
+		entries.reserve(count);
+		if(count > heads.size())
+		{
+			size_t bucketCount = STRING_MAP_MIN_BUCKETS;
+			while(bucketCount < count)
+				bucketCount *= 2;
+			rebuildChains(bucketCount);
+		}
+	}
+
+	// bucket table and entry vector down to what the current size needs
+	void shrink_to_fit()
+	{
+		size_t bucketCount = STRING_MAP_MIN_BUCKETS;
+		while(bucketCount < entries.size())
+			bucketCount *= 2;
+
+		entries.shrink_to_fit();
+		if(entries.empty())
+			heads = std::vector<size_t>();
+		else if(bucketCount < heads.size())
+		{
+			heads = std::vector<size_t>();
+			rebuildChains(bucketCount);
+		}
+	}
+
+	// shrink_to_fit and copies the live keys into a fresh, tightly filled arena
+	void compact()
+	{
+		shrink_to_fit();
+		compactArena();
+	}
+
+	size_t memoryUsage() const
+	{
+		size_t bytes = sizeof(*this) + arena.reserved();
+		if(heads.capacity() > 0)
+			bytes += heapBlockSize(heads.capacity() * sizeof(size_t));
+		if(entries.capacity() > 0)
+			bytes += heapBlockSize(entries.capacity() * sizeof(Entry));
+
+		if(!std::is_trivially_copyable<mapped_type>::value)
+		{
+			for(auto &entry : entries)
+				bytes += ownedBytes(entry.value.second);
+		}
+		return bytes;
+	}
+
+	mapped_type &operator[](const std::string &key)
+	{
+		size_t i = findIndex(key.data(), key.size());
+		if(i == entries.size())
+			i = insertNew(key.data(), key.size(), mapped_type{});
+		return entries[i].value.second;
+	}
+
+	const mapped_type &valueOf(const std::string &key) const
+	{
+		size_t i = findIndex(key.data(), key.size());
+		if(i == entries.size())
+			throw std::out_of_range("key doesn't exist");
+		return entries[i].value.second;
+	}
+
+	mapped_type &valueOf(const std::string &key)
+	{
+		// ugly cast, yet reduces code duplication.
+		return const_cast<mapped_type &>( (const_cast<const StringHashMap *>(this))->valueOf(key));
+	}
+
+	// lookups straight from a byte range, no std::string has to be built
+	const_iterator find(const char *bytes, size_t length) const
+	{
+		return ConstIterator(this, findIndex(bytes, length));
+	}
+
+	const_iterator find(const std::string &key) const
+	{
+		return find(key.data(), key.size());
+	}
+
+	iterator find(const char *bytes, size_t length)
+	{
+		return Iterator( (const_cast<const StringHashMap *>(this))->find(bytes, length));
+	}
+
+	iterator find(const std::string &key)
+	{
+		return find(key.data(), key.size());
+	}
+
+	bool contains(const std::string &key) const
+	{
+		return findIndex(key.data(), key.size()) != entries.size();
+	}
+
+	void remove(const std::string &key)
+	{
+		remove(find(key));
+	}
+
+	void remove(const const_iterator &it)
+	{
+		erase(it);
+	}
+
+	// The last entry takes the erased one's place, so the returned iterator points
+	// at the same position; a sweep that continues from it visits every element.
+	iterator erase(const const_iterator &it)
+	{
+		if(it == end())
+			throw std::out_of_range("out of range");
+
+		eraseIndex(it.index);
+		return Iterator(ConstIterator(this, it.index));
+	}
+
+	template<typename Predicate>
+	size_type eraseIf(Predicate pred)
+	{
+		size_type removed = 0;
+		for(size_t i = 0; i < entries.size(); )
+		{
+			if(pred(const_cast<const_reference>(entries[i].value)))
+			{
+				eraseIndex(i);
+				++removed;
+			}
+			else
+				++i;
+		}
+		return removed;
+	}
+
+	bool operator==(const StringHashMap &other) const
+	{
+		if(getSize() != other.getSize())
+			return false;
+
+		for(auto &elem : other)
+		{
+			auto it = find(elem.first.data(), elem.first.size());
+			if(it == end() || !(it->second == elem.second))
+				return false;
+		}
+		return true;
+	}
+
+	bool operator!=(const StringHashMap &other) const
+	{
+		return !(*this == other);
+	}
+
+	HashMapStats stats() const
+	{
+		HashMapStats result;
+		result.size = entries.size();
+		result.buckets = heads.size();
+		result.loadFactor = heads.empty() ? 0 : double(entries.size()) / heads.size();
+
+		for(size_t head : heads)
+		{
+			size_t length = 0;
+			for(size_t i = head; i != NONE; i = entries[i].next)
+				++length;
+			if(length >= result.chainLengths.size())
+				result.chainLengths.resize(length + 1);
+			++result.chainLengths[length];
+			result.longestChain = std::max(result.longestChain, length);
+		}
+		result.emptyBuckets = result.chainLengths.empty() ? 0 : result.chainLengths[0];
+
+		MAP_STATS(result.countersEnabled = true;)
+		MAP_STATS(result.operations = counters;)
+		return result;
+	}
+
+	void dumpStats(std::ostream &out) const
+	{
+		stats().writeJson(out);
+	}
+
+	void resetStats()
+	{
+		MAP_STATS(counters = HashMapCounters{};)
+	}
+
+	iterator begin()
+	{
+		return Iterator(cbegin());
+	}
+
+	iterator end()
+	{
+		return Iterator(cend());
+	}
+
+	const_iterator cbegin() const
+	{
+		return ConstIterator(this, 0);
+	}
+
+	const_iterator cend() const
+	{
+		return ConstIterator(this, entries.size());
+	}
+
+	const_iterator begin() const
+	{
+		return cbegin();
+	}
+
+	const_iterator end() const
+	{
+		return cend();
+	}
+};
+
+template<typename ValueType>
+const size_t StringHashMap<ValueType>::NONE;
+
+template<typename ValueType>
+class StringHashMap<ValueType>::ConstIterator
+{
+public:
+	using reference = typename StringHashMap::const_reference;
+	using iterator_category = std::bidirectional_iterator_tag;
+	using value_type = typename StringHashMap::value_type;
+	using pointer = const typename StringHashMap::value_type *;
+
+	friend class StringHashMap;
+
+private:
+	const StringHashMap *map = nullptr;
+	size_t index = 0;
+
+public:
+
+	explicit ConstIterator() = default;
+
+	ConstIterator(const StringHashMap *map, size_t index) : map(map), index(index)
+	{}
+
+	ConstIterator &operator++()
+	{
+		if(map == nullptr)
+			throw std::logic_error("collection not given to iterator");
+
+		if(index >= map->entries.size())
+			throw std::out_of_range("iterator out of range");
+
+		++index;
+		return *this;
+	}
+
+	ConstIterator operator++(int)
+	{
+		auto it = *this;
+		this->operator++();
+		return it;
+	}
+
+	ConstIterator &operator--()
+	{
+		if(map == nullptr)
+			throw std::logic_error("collection not given to iterator");
+
+		if(index == 0)
+			throw std::out_of_range("iterator out of range");
+
+		--index;
+		return *this;
+	}
+
+	ConstIterator operator--(int)
+	{
+		auto it = *this;
+		this->operator--();
+		return it;
+	}
+
+	reference operator*() const
+	{
+		if(map == nullptr || index >= map->entries.size())
+			throw std::out_of_range("out of range");
+
+		return map->entries[index].value;
+	}
+
+	pointer operator->() const
+	{
+		return &this->operator*();
+	}
+
+	bool operator==(const ConstIterator &other) const
+	{
+		return map == other.map && index == other.index;
+	}
+
+	bool operator!=(const ConstIterator &other) const
+	{
+		return !(*this == other);
+	}
+};
+
+template<typename ValueType>
+class StringHashMap<ValueType>::Iterator : public StringHashMap<ValueType>::ConstIterator
+{
+public:
+	using reference = typename StringHashMap::reference;
+	using pointer = typename StringHashMap::value_type *;
+
+	explicit Iterator()
+	{}
+
+	Iterator(const ConstIterator &other)
+			: ConstIterator(other)
+	{}
+
+	Iterator &operator++()
+	{
+		ConstIterator::operator++();
+		return *this;
+	}
+
+	Iterator operator++(int)
+	{
+		auto result = *this;
+		ConstIterator::operator++();
+		return result;
+	}
+
+	Iterator &operator--()
+	{
+		ConstIterator::operator--();
+		return *this;
+	}
+
+	Iterator operator--(int)
+	{
+		auto result = *this;
+		ConstIterator::operator--();
+		return result;
+	}
+
+	pointer operator->() const
+	{
+		return &this->operator*();
+	}
+
+	reference operator*() const
+	{
+		// ugly cast, yet reduces code duplication.
+		return const_cast<reference>(ConstIterator::operator*());
+	}
+};
+
+}
+
+#endif /* AISDI_MAPS_STRINGHASHMAP_H */
@@ -0,0 +1,221 @@
+#ifndef AISDI_MAPS_STRINGKEY_H
+#define AISDI_MAPS_STRINGKEY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#define ARENA_CHUNK_SIZE 65536
+
+namespace aisdi
+{
+
+// 64-bit hash of a byte range, eight bytes per step
+inline uint64_t hashBytes(const char *bytes, size_t length)
+{
+	const uint64_t multiplier = 0x9E3779B97F4A7C15ull;
+	uint64_t hash = length * multiplier;
+
+	for(; length >= 8; bytes += 8, length -= 8)
+	{
+		uint64_t word;
+		std::memcpy(&word, bytes, 8);
+		hash = (hash ^ word) * multiplier;
+		hash ^= hash >> 29;
+	}
+	if(length > 0)
+	{
+		uint64_t word = 0;
+		std::memcpy(&word, bytes, length);
+		hash = (hash ^ word) * multiplier;
+		hash ^= hash >> 29;
+	}
+
+	hash *= 0xD6E8FEB86659FD93ull;
+	return hash ^ (hash >> 32);
+}
+
+// first eight bytes, zero padded, as a big-endian number: comparing two prefixes
+// orders the strings like std::string does, unless the prefixes are equal
+inline uint64_t loadPrefix(const char *bytes, size_t length)
+{
+	uint64_t prefix = 0;
+	for(size_t i = 0; i < 8; ++i)
+		prefix = (prefix << 8) | (i < length ? static_cast<unsigned char>(bytes[i]) : 0);
+	return prefix;
+}
+
+// TreeMap nodes keep one of these next to the key. Only string keys get a real
+// prefix; for other keys it is empty and every comparison falls through to the keys.
+template<typename KeyType>
+struct KeyPrefix
+{
+	explicit KeyPrefix(const KeyType &)
+	{}
+
+	// <0, 0 or >0 like compare; 0 also means "the prefix can't tell"
+	int compare(const KeyPrefix &) const
+	{
+		return 0;
+	}
+
+	static int compareKeys(const KeyType &a, const KeyType &b)
+	{
+		if(a < b)
+			return -1;
+		return b < a ? 1 : 0;
+	}
+};
+
+template<>
+struct KeyPrefix<std::string>
+{
+	uint64_t bits;
+
+	explicit KeyPrefix(const std::string &key) : bits(loadPrefix(key.data(), key.size()))
+	{}
+
+	int compare(const KeyPrefix &other) const
+	{
+		if(bits == other.bits)
+			return 0;
+		return bits < other.bits ? -1 : 1;
+	}
+
+	static int compareKeys(const std::string &a, const std::string &b)
+	{
+		return a.compare(b);
+	}
+};
+
+// Key of a StringHashMap: a view of bytes owned by the map's arena, with the
+// length and the prefix at hand so most comparisons never touch the bytes.
+class StringKey
+{
+	const char *bytes = nullptr;
+	size_t length = 0;
+	uint64_t prefix = 0;
+
+public:
+	StringKey() = default;
+
+	StringKey(const char *bytes, size_t length) : bytes(bytes), length(length), prefix(loadPrefix(bytes, length))
+	{}
+
+	const char *data() const
+	{
+		return bytes;
+	}
+
+	size_t size() const
+	{
+		return length;
+	}
+
+	uint64_t getPrefix() const
+	{
+		return prefix;
+	}
+
+	std::string str() const
+	{
+		return std::string(bytes, length);
+	}
+
+	bool equals(const char *otherBytes, size_t otherLength, uint64_t otherPrefix) const
+	{
+		if(length != otherLength || prefix != otherPrefix)
+			return false;
+		return length <= 8 || std::memcmp(bytes + 8, otherBytes + 8, length - 8) == 0;
+	}
+
+	bool operator==(const StringKey &other) const
+	{
+		return equals(other.bytes, other.length, other.prefix);
+	}
+
+	bool operator!=(const StringKey &other) const
+	{
+		return !(*this == other);
+	}
+
+	bool operator==(const std::string &other) const
+	{
+		return length == other.size() && std::memcmp(bytes, other.data(), length) == 0;
+	}
+
+	bool operator!=(const std::string &other) const
+	{
+		return !(*this == other);
+	}
+
+	bool operator<(const StringKey &other) const
+	{
+		if(prefix != other.prefix)
+			return prefix < other.prefix;
+		int order = std::memcmp(bytes, other.bytes, length < other.length ? length : other.length);
+		return order < 0 || (order == 0 && length < other.length);
+	}
+
+	friend std::ostream &operator<<(std::ostream &out, const StringKey &key)
+	{
+		return out.write(key.bytes, static_cast<std::streamsize>(key.length));
+	}
+};
+
+// Append-only storage for key bytes in ARENA_CHUNK_SIZE chunks; stored bytes never
+// move, released ones are only counted until the owner rebuilds the arena.
+class StringArena
+{
+	std::vector<std::unique_ptr<char[]>> chunks;
+	size_t chunkUsed = 0;
+	size_t chunkSize = 0;
+	size_t reservedBytes = 0;
+	size_t liveBytes = 0;
+
+public:
+	const char *store(const char *bytes, size_t length)
+	{
+		if(chunks.empty() || chunkSize - chunkUsed < length)
+		{
+			chunkSize = length > ARENA_CHUNK_SIZE ? length : ARENA_CHUNK_SIZE;
+			chunks.emplace_back(new char[chunkSize]);
+			chunkUsed = 0;
+			reservedBytes += chunkSize;
+		}
+
+		char *target = chunks.back().get() + chunkUsed;
+		std::memcpy(target, bytes, length);
+		chunkUsed += length;
+		liveBytes += length;
+		return target;
+	}
+
+	void release(size_t length)
+	{
+		liveBytes -= length;
+	}
+
+	size_t reserved() const
+	{
+		return reservedBytes;
+	}
+
+	size_t live() const
+	{
+		return liveBytes;
+	}
+
+	size_t dead() const
+	{
+		return reservedBytes - liveBytes - (chunkSize - chunkUsed);
+	}
+};
+
+}
+
+#endif /* AISDI_MAPS_STRINGKEY_H */
@@ -1,13 +1,23 @@
 #ifndef AISDI_MAPS_TREEMAP_H
 #define AISDI_MAPS_TREEMAP_H
 
+#include <algorithm>
 #include <cstddef>
 #include <initializer_list>
 #include <stdexcept>
 #include <utility>
 #include <iostream>
 #include <stack>
+#include <vector>
 
+#include "BloomFilter.h"
+#include "FrozenTreeMap.h"
+#include "MapStats.h"
+#include "Parallel.h"
+#include "StringKey.h"
+
+// lookups of a findMany batch kept in flight together
+#define TREE_BATCH_LANES 16
 
 
 namespace aisdi
@@ -27,8 +37,11 @@ public:
 
 	class Iterator;
 
+	class NodeHandle;
+
 	using iterator = Iterator;
 	using const_iterator = ConstIterator;
+	using node_type = NodeHandle;
 
 	void print()
 	{
@@ -38,10 +51,36 @@ public:
 private:
 	class Node;
 
+	// path from the root to an iterator's node; a vector, unlike the default deque,
+	// costs no allocation while it is empty, e.g. in end()
+	struct PathStack : std::stack<Node *, std::vector<Node *>>
+	{
+		PathStack()
+		= default;
+
+		explicit PathStack(std::vector<Node *> &&nodes) : std::stack<Node *, std::vector<Node *>>(std::move(nodes))
+		{}
+
+		// the root first, the iterator's node's parent last
+		const std::vector<Node *> &nodes() const
+		{
+			return this->c;
+		}
+	};
+
 	size_t size{0};
 	Node *root{nullptr};
-
-	class Node
+	// changes whenever nodes are linked, unlinked or rotated; iterators made at the
+	// same version have paths that still match the tree, so they can serve as hints
+	size_t version{1};
+	// root..maximum path kept between appends, valid while maxPathVersion == version
+	std::vector<Node *> maxPath;
+	size_t maxPathVersion{0};
+	Prefilter<key_type> prefilter;
+	MAP_STATS(mutable TreeMapCounters counters;)
+
+	// the key's prefix is a base so that it takes no room for keys without one
+	class Node : KeyPrefix<key_type>
 	{
 		friend class TreeMap;
 
@@ -67,7 +106,7 @@ private:
 
 	public:
 
-		explicit Node(const value_type &value)
+		explicit Node(const value_type &value) : KeyPrefix<key_type>(value.first)
 		{
 			this->value = new value_type{value};
 		}
@@ -82,6 +121,17 @@ private:
 			return value->first;
 		}
 
+		// prefix of getKey(), it has to travel with value
+		KeyPrefix<key_type> &prefix()
+		{
+			return *this;
+		}
+
+		const KeyPrefix<key_type> &prefix() const
+		{
+			return *this;
+		}
+
 		bool operator==(const Node &other)
 		{
 			return *value == *other.value;
@@ -160,6 +210,7 @@ private:
 		{
 			deleteTree(root);
 			root = nullptr;
+			++version;
 		}
 
 		void deleteTree(Node *node)
@@ -173,6 +224,38 @@ private:
 			}
 		}
 
+		static void collectNodes(Node *node, std::vector<Node *> &nodes)
+		{
+			if(node == nullptr)
+				return;
+
+			collectNodes(node->left, nodes);
+			nodes.push_back(node);
+			collectNodes(node->right, nodes);
+		}
+
+		// builds a perfectly balanced (so valid AVL) subtree of sorted nodes
+		static Node *buildBalanced(std::vector<Node *> &nodes, size_t first, size_t last)
+		{
+			if(first == last)
+				return nullptr;
+
+			size_t middle = first + (last - first) / 2;
+			Node *node = nodes[middle];
+			node->left = buildBalanced(nodes, first, middle);
+			node->right = buildBalanced(nodes, middle + 1, last);
+			node->updateHeight();
+			return node;
+		}
+
+		// makes the tree consist of exactly the given sorted nodes
+		void relink(std::vector<Node *> &nodes)
+		{
+			root = buildBalanced(nodes, 0, nodes.size());
+			size = nodes.size();
+			++version;
+		}
+
 		Node *findSmallest(Node *node)
 		{
 			Node *currentNode = node;
@@ -220,19 +303,41 @@ private:
 			return rotateLL(a);
 		}
 
+		// <0, 0 or >0 as key compares to node's key; string keys are told apart by
+		// their cached prefixes first and only equal prefixes compare the strings
+		static int compareToNode(const key_type &key, const KeyPrefix<key_type> &prefix, const Node *node)
+		{
+			int order = prefix.compare(node->prefix());
+			if(order != 0)
+				return order;
+			return KeyPrefix<key_type>::compareKeys(key, node->getKey());
+		}
+
 		Node *insert(Node *node, value_type value)
+		{
+			return insertNode(node, new Node{value});
+		}
+
+		// links an unlinked node (and its value) into the subtree
+		Node *insertNode(Node *node, Node *newNode)
 		{
 			if (node == nullptr) //this is place where we insert new Node
 			{
 				++size;
-				return (new Node{value});
+				++version;
+				MAP_STATS(++counters.inserts;)
+				if(prefilter.enabled())
+					prefilter.add(prefilter.hash(newNode->getKey()));
+				newNode->left = nullptr;
+				newNode->right = nullptr;
+				newNode->height = 1;
+				return newNode;
 			}
-			key_type key = value.first;
 
-			if (key < node->getKey() ) //search proper place
-				node->left = insert(node->left, value);
+			if (compareToNode(newNode->getKey(), newNode->prefix(), node) < 0) //search proper place
+				node->left = insertNode(node->left, newNode);
 			else
-				node->right = insert(node->right, value);
+				node->right = insertNode(node->right, newNode);
 
 			node->updateHeight(); //update height of node
 
@@ -245,32 +350,61 @@ private:
 
 			if(bf > 1) //left child is heavier
 			{
-				if(node->left->getBalanceFactor() > 0 ) // LL case
+				if(node->left->getBalanceFactor() >= 0 ) // LL case, or a removal left the child balanced
+				{
+					MAP_STATS(++counters.rotationsLL;)
 					return rotateLL(node);
+				}
 				else
+				{
+					MAP_STATS(++counters.rotationsLR;)
 					return rotateLR(node);  // LR case
+				}
 			}
 
 			if(bf < -1) //right child is heavier
 			{
-				if(node->right->getBalanceFactor() < 0) // RR case //key > node->right->getKey()
+				if(node->right->getBalanceFactor() <= 0) // RR case, or a removal left the child balanced
+				{
+					MAP_STATS(++counters.rotationsRR;)
 					return rotateRR(node);
+				}
 				else
+				{
+					MAP_STATS(++counters.rotationsRL;)
 					return rotateRL(node); // RL case
+				}
 			}
 
 			return node;
 		}
 
 		Node *deleteNode(Node *node, key_type key)
+		{
+			Node *detached = nullptr;
+			node = detachNode(node, key, detached);
+			delete detached;
+			return node;
+		}
+
+		// Unlinks the element with the given key without freeing it: detached ends up
+		// as a node holding that element's value (not necessarily the node that held
+		// it before, values are swapped with the successor's).
+		Node *detachNode(Node *node, const key_type &key, Node *&detached)
+		{
+			return detachNode(node, key, KeyPrefix<key_type>(key), detached);
+		}
+
+		Node *detachNode(Node *node, const key_type &key, const KeyPrefix<key_type> &prefix, Node *&detached)
 		{
 			if (node == nullptr)
 				return node;
 
-			if (key < node->getKey())
-				node->left = deleteNode(node->left, key);
-			else if(key > node->getKey())
-				node->right = deleteNode(node->right, key);
+			int order = compareToNode(key, prefix, node);
+			if (order < 0)
+				node->left = detachNode(node->left, key, prefix, detached);
+			else if(order > 0)
+				node->right = detachNode(node->right, key, prefix, detached);
 			else
 			{
 				if( node->hasBothChildren() ) // 2 children
@@ -278,19 +412,23 @@ private:
 					Node *smallest = findSmallest(node->right);
 
 					std::swap( node->value, smallest->value);
-					node->right = deleteNode(node->right, smallest->getKey());
+					std::swap( node->prefix(), smallest->prefix());
+					node->right = detachNode(node->right, smallest->getKey(), smallest->prefix(), detached);
 				}
 				else // 1 or 0 children
 				{
-					Node *temp = node;
+					if(prefilter.enabled())
+						prefilter.remove(prefilter.hash(node->getKey()));
+					detached = node;
 					if( node->hasLeftChild() )
 						node = node->left;
 					else
 						node = node->right;
 
-					delete temp;
+					--size;
+					++version;
+					MAP_STATS(++counters.removes;)
 				}
-				--size;
 			}
 			if (node == nullptr)
 				return nullptr;
@@ -299,6 +437,435 @@ private:
 			return performRotation(node);
 		}
 
+		// Looks keys up TREE_BATCH_LANES at a time, the descents advancing one level
+		// per round in lockstep. A round's loads don't depend on each other, so their
+		// cache misses overlap instead of being paid one after another, and the node
+		// each descent goes to next is prefetched for the following round.
+		// found(i, match, lowerBound) gets nullptr for a missing match or bound.
+		template<typename Found>
+		void descendBatch(const key_type *keys, size_t count, Found found) const
+		{
+			std::vector<KeyPrefix<key_type>> prefixes;
+			prefixes.reserve(count);
+			for(size_t i = 0; i < count; ++i)
+				prefixes.emplace_back(keys[i]);
+
+			for(size_t first = 0; first < count; first += TREE_BATCH_LANES)
+			{
+				size_t lanes = std::min<size_t>(TREE_BATCH_LANES, count - first);
+				Node *node[TREE_BATCH_LANES];
+				Node *upper[TREE_BATCH_LANES]; // the last node the descent went left at
+				for(size_t l = 0; l < lanes; ++l)
+				{
+					MAP_STATS(++counters.lookups;)
+					node[l] = root;
+					upper[l] = nullptr;
+					if(root == nullptr)
+						found(first + l, nullptr, nullptr);
+				}
+
+				size_t active = root == nullptr ? 0 : lanes;
+				while(active > 0)
+				{
+					for(size_t l = 0; l < lanes; ++l)
+					{
+						if(node[l] == nullptr)
+							continue;
+
+						MAP_STATS(++counters.descentSteps;)
+						size_t i = first + l;
+						int order = compareToNode(keys[i], prefixes[i], node[l]);
+						if(order == 0)
+						{
+							MAP_STATS(++counters.lookupHits;)
+							found(i, node[l], node[l]);
+							node[l] = nullptr;
+							--active;
+							continue;
+						}
+
+						if(order < 0)
+							upper[l] = node[l];
+						node[l] = order < 0 ? node[l]->left : node[l]->right;
+						if(node[l] == nullptr)
+						{
+							found(i, nullptr, upper[l]);
+							--active;
+						}
+#if defined(__GNUC__)
+						else
+							__builtin_prefetch(node[l]);
+#endif
+					}
+				}
+			}
+		}
+
+		// Finger search. path has to be a root..node path of the current tree, or empty
+		// to start at the root. It is cut back to the deepest node whose subtree can
+		// hold the key and extended down to the key's node (0 is returned) or to the
+		// node under which the key belongs: on its left for <0, on its right for >0.
+		// Only the ancestors the path turns away from the key at bound that subtree,
+		// so a key d elements away from path's node costs O(log d) comparisons.
+		int seek(std::vector<Node *> &path, const key_type &key, const KeyPrefix<key_type> &prefix) const
+		{
+			if(path.empty())
+			{
+				if(root == nullptr)
+					return 0;
+				path.push_back(root);
+			}
+
+			MAP_STATS(++counters.descentSteps;)
+			int order = compareToNode(key, prefix, path.back());
+			if(order == 0)
+				return 0;
+
+			size_t keep = path.size();
+			for(size_t i = path.size() - 1; i-- > 0; )
+			{
+				Node *awayFromKey = order < 0 ? path[i]->right : path[i]->left;
+				if(path[i + 1] != awayFromKey)
+					continue;
+
+				MAP_STATS(++counters.descentSteps;)
+				int side = compareToNode(key, prefix, path[i]);
+				if(side == 0)
+				{
+					path.resize(i + 1);
+					return 0;
+				}
+				if( (side < 0) != (order < 0) )
+					break;
+				keep = i + 1;
+			}
+			path.resize(keep);
+
+			while(true)
+			{
+				Node *next = order < 0 ? path.back()->left : path.back()->right;
+				if(next == nullptr)
+					return order;
+				path.push_back(next);
+				MAP_STATS(++counters.descentSteps;)
+				order = compareToNode(key, prefix, next);
+				if(order == 0)
+					return 0;
+			}
+		}
+
+		// Links newNode where seek() left off (as the root if path is empty) and
+		// retraces path only as far as heights change; a rotation after an insert
+		// restores its subtree's height, so it ends the retrace. path ends at newNode.
+		void linkAt(std::vector<Node *> &path, int order, Node *newNode)
+		{
+			++size;
+			++version;
+			MAP_STATS(++counters.inserts;)
+			if(prefilter.enabled())
+				prefilter.add(prefilter.hash(newNode->getKey()));
+			newNode->left = nullptr;
+			newNode->right = nullptr;
+			newNode->height = 1;
+
+			if(path.empty())
+				root = newNode;
+			else if(order < 0)
+				path.back()->left = newNode;
+			else
+				path.back()->right = newNode;
+			path.push_back(newNode);
+
+			for(size_t i = path.size() - 1; i-- > 0; )
+			{
+				Node *node = path[i];
+				int height = node->height;
+				node->updateHeight();
+
+				Node *top = performRotation(node);
+				if(top != node)
+				{
+					if(i == 0)
+						root = top;
+					else if(path[i - 1]->left == node)
+						path[i - 1]->left = top;
+					else
+						path[i - 1]->right = top;
+
+					path.resize(i);
+					for(Node *next = top; next != newNode; )
+					{
+						path.push_back(next);
+						next = compareToNode(newNode->getKey(), newNode->prefix(), next) < 0 ? next->left : next->right;
+					}
+					path.push_back(newNode);
+					return;
+				}
+				if(node->height == height)
+					return;
+			}
+		}
+
+		// Unlinks the element at the end of path, a root..node path of the current tree,
+		// and retraces path as far as heights change. A node with two children takes
+		// its successor's value and the successor's node is freed, as in detachNode.
+		// path ends at the node that holds the successor afterwards, or is empty if
+		// there is none; only the part below the highest rotation is walked again.
+		void unlinkAt(std::vector<Node *> &path)
+		{
+			const size_t NONE = static_cast<size_t>(-1);
+			Node *node = path.back();
+			Node *freed = node;
+			size_t next = NONE; // index in path of the successor's node
+			size_t retrace;     // path[0..retrace) is retraced
+
+			if(prefilter.enabled())
+				prefilter.remove(prefilter.hash(node->getKey()));
+
+			if(node->hasBothChildren())
+			{
+				next = path.size() - 1;
+				path.push_back(node->right);
+				while(path.back()->left != nullptr)
+					path.push_back(path.back()->left);
+				freed = path.back();
+				path.pop_back();
+
+				std::swap(node->value, freed->value);
+				std::swap(node->prefix(), freed->prefix());
+				if(path.back() == node)
+					node->right = freed->right;
+				else
+					path.back()->left = freed->right;
+				retrace = path.size();
+			}
+			else
+			{
+				size_t last = path.size() - 1;
+				Node *child = node->hasLeftChild() ? node->left : node->right;
+				// an only child is a leaf, so a right one is the successor; otherwise it
+				// is the nearest ancestor the path goes left at
+				if(node->hasRightChild())
+					next = last;
+				for(size_t i = last; next == NONE && i-- > 0; )
+				{
+					if(path[i]->left == path[i + 1])
+						next = i;
+				}
+
+				if(last == 0)
+					root = child;
+				else if(path[last - 1]->left == node)
+					path[last - 1]->left = child;
+				else
+					path[last - 1]->right = child;
+				if(child != nullptr)
+					path[last] = child;
+				else
+					path.pop_back();
+				retrace = last;
+			}
+
+			size_t rotatedAt = path.size(); // path is still valid above the highest rotation
+			Node *rotatedTop = nullptr;
+			for(size_t i = retrace; i-- > 0; )
+			{
+				Node *ancestor = path[i];
+				int height = ancestor->height;
+				ancestor->updateHeight();
+
+				Node *top = performRotation(ancestor);
+				if(top != ancestor)
+				{
+					if(i == 0)
+						root = top;
+					else if(path[i - 1]->left == ancestor)
+						path[i - 1]->left = top;
+					else
+						path[i - 1]->right = top;
+					rotatedAt = i;
+					rotatedTop = top;
+				}
+				if(top->height == height)
+					break;
+			}
+
+			if(next == NONE)
+				path.clear();
+			else if(next < rotatedAt)
+				path.resize(next + 1);
+			else
+			{
+				Node *successor = path[next];
+				path.resize(rotatedAt);
+				for(Node *step = rotatedTop; step != successor; )
+				{
+					path.push_back(step);
+					step = compareToNode(successor->getKey(), successor->prefix(), step) < 0 ? step->left : step->right;
+				}
+				path.push_back(successor);
+			}
+
+			--size;
+			++version;
+			MAP_STATS(++counters.removes;)
+			delete freed;
+		}
+
+		// true if the key goes after every element, maxPath then leads to the maximum
+		bool goesLast(const key_type &key, const KeyPrefix<key_type> &prefix)
+		{
+			if(root == nullptr)
+				return false;
+
+			if(maxPathVersion != version)
+			{
+				maxPath.clear();
+				for(Node *node = root; node != nullptr; node = node->right)
+					maxPath.push_back(node);
+				maxPathVersion = version;
+			}
+			MAP_STATS(++counters.descentSteps;)
+			return compareToNode(key, prefix, maxPath.back()) > 0;
+		}
+
+		// the hint's root..node path if the tree hasn't changed since it was made
+		std::vector<Node *> hintPath(const const_iterator &hint) const
+		{
+			std::vector<Node *> path;
+			if(hint.current != nullptr && hint.root == root && hint.version == version)
+			{
+				path.reserve(hint.up.nodes().size() + 1);
+				path = hint.up.nodes();
+				path.push_back(hint.current);
+			}
+			return path;
+		}
+
+		const_iterator iteratorAt(std::vector<Node *> &&path) const
+		{
+			Node *node = path.back();
+			path.pop_back();
+			PathStack up(std::move(path));
+			ConstIterator it(root, node, up);
+			it.version = version;
+			return it;
+		}
+
+		// the hinted insert; makeNode() is called only if the key isn't present
+		template<typename MakeNode>
+		iterator insertFrom(const const_iterator &hint, const key_type &key, MakeNode makeNode)
+		{
+			MAP_STATS(++counters.lookups;)
+			KeyPrefix<key_type> prefix(key);
+			std::vector<Node *> path;
+			int order;
+			if(hint.current == nullptr && goesLast(key, prefix))
+			{
+				linkAt(maxPath, 1, makeNode());
+				maxPathVersion = version;
+				path = maxPath;
+			}
+			else
+			{
+				path = hintPath(hint);
+				order = seek(path, key, prefix);
+				if(!path.empty() && order == 0)
+				{
+					MAP_STATS(++counters.lookupHits;)
+					return Iterator(iteratorAt(std::move(path)));
+				}
+				linkAt(path, order, makeNode());
+			}
+			checkPrefilterLoad();
+			return Iterator(iteratorAt(std::move(path)));
+		}
+
+		struct Piece
+		{
+			Node *node;
+			bool wholeSubtree;
+		};
+
+		// splits the tree in key order into subtrees hanging at the given depth
+		// and the single nodes above them
+		void collectPieces(Node *node, int depth, std::vector<Piece> &pieces) const
+		{
+			if(node == nullptr)
+				return;
+
+			if(depth == 0)
+			{
+				pieces.push_back({node, true});
+				return;
+			}
+			collectPieces(node->left, depth - 1, pieces);
+			pieces.push_back({node, false});
+			collectPieces(node->right, depth - 1, pieces);
+		}
+
+		std::vector<Piece> splitIntoPieces() const
+		{
+			int depth = 0;
+			if(size >= PARALLEL_MIN_SIZE)
+			{
+				while( (size_t{1} << depth) < parallel::preferredTaskCount() )
+					++depth;
+			}
+
+			std::vector<Piece> pieces;
+			collectPieces(root, depth, pieces);
+			return pieces;
+		}
+
+		// true if the prefilter rules the key out, without a descent
+		bool filteredOut(const key_type &key) const
+		{
+			if(!prefilter.enabled() || prefilter.mayContain(prefilter.hash(key)))
+				return false;
+			MAP_STATS(++counters.lookups;)
+			MAP_STATS(++counters.filterRejects;)
+			return true;
+		}
+
+		void rebuildPrefilter(size_t expectedElements)
+		{
+			prefilter.resize(expectedElements);
+			auto add = [this](const value_type &elem)
+			{
+				prefilter.add(prefilter.hash(elem.first));
+			};
+			forEachInSubtree(root, add);
+		}
+
+		// insertNode() can't rebuild the filter halfway down the tree, the public
+		// inserts check its load once they are done
+		void checkPrefilterLoad()
+		{
+			if(prefilter.enabled() && prefilter.overloaded(size))
+				rebuildPrefilter(2 * size);
+		}
+
+		template<typename Function>
+		static void forEachInSubtree(Node *node, Function &fn)
+		{
+			if(node == nullptr)
+				return;
+
+			forEachInSubtree(node->left, fn);
+			fn(*node->value);
+			forEachInSubtree(node->right, fn);
+		}
+
+		template<typename Function>
+		static void forEachInPiece(const Piece &piece, Function &fn)
+		{
+			if(piece.wholeSubtree)
+				forEachInSubtree(piece.node, fn);
+			else
+				fn(*piece.node->value);
+		}
+
 public:
 
 	TreeMap()
@@ -310,16 +877,17 @@ public:
 			root = insert(root, elem);
 	}
 
-	TreeMap(const TreeMap &other)
+	TreeMap(const TreeMap &other) : prefilter(other.prefilter)
 	{
-		for(auto elem : other)
-			root = insert(root, elem);
+		assignSorted(other.begin(), other.end());
 	}
 
-	TreeMap(TreeMap &&other) : size(other.size), root(other.root)
+	TreeMap(TreeMap &&other) : size(other.size), root(other.root), version(other.version + 1),
+	                           prefilter(std::move(other.prefilter))
 	{
 		other.root = nullptr;
 		other.size = 0;
+		++other.version;
 	}
 
 	~TreeMap()
@@ -332,9 +900,8 @@ public:
 	{
 		if(this != &other)
 		{
-			deleteTree();
-			for(auto elem : other)
-				root = insert(root, elem);
+			prefilter = other.prefilter;
+			assignSorted(other.begin(), other.end());
 		}
 		return *this;
 	}
@@ -346,26 +913,74 @@ public:
 			deleteTree();
 			size = other.size;
 			root = other.root;
+			version = std::max(version, other.version) + 1;
+			prefilter = std::move(other.prefilter);
 			other.size = 0;
 			other.root = nullptr;
+			++other.version;
 		}
 		return *this;
 	}
 
+	// Replaces the contents with the elements of a range whose keys are strictly
+	// increasing, in linear time: the nodes are linked into a balanced tree directly.
+	// Throws std::invalid_argument (leaving the map unchanged) for unsorted input.
+	template<typename InputIt>
+	void assignSorted(InputIt first, InputIt last)
+	{
+		std::vector<Node *> nodes;
+		try
+		{
+			for(; first != last; ++first)
+			{
+				if(!nodes.empty() && !(nodes.back()->getKey() < first->first))
+					throw std::invalid_argument("keys have to be sorted and unique");
+				nodes.push_back(new Node(value_type(first->first, first->second)));
+			}
+		}
+		catch(...)
+		{
+			for(Node *node : nodes)
+				delete node;
+			throw;
+		}
+
+		deleteTree();
+		relink(nodes);
+		if(prefilter.enabled())
+			rebuildPrefilter(std::max(prefilter.capacity(), size));
+	}
+
 	bool isEmpty() const
 	{
 		return size == 0;
 	}
 
+	// One descent finds the key or the place to link it. A key greater than every
+	// other is appended in O(1) amortized: the path to the maximum is kept between
+	// calls, so sequential ingest doesn't walk the right spine every time.
 	mapped_type &operator[](const key_type &key)
 	{
-		auto it = find(key);
-		if(it == end() )
+		MAP_STATS(++counters.lookups;)
+		KeyPrefix<key_type> prefix(key);
+		if(goesLast(key, prefix))
 		{
-			root = insert(root, {key, mapped_type{} });
-			return find(key)->second;
+			linkAt(maxPath, 1, new Node{value_type{key, mapped_type{}}});
+			maxPathVersion = version;
+			checkPrefilterLoad();
+			return maxPath.back()->value->second;
 		}
-		return it->second;
+
+		std::vector<Node *> path;
+		int order = seek(path, key, prefix);
+		if(!path.empty() && order == 0)
+		{
+			MAP_STATS(++counters.lookupHits;)
+			return path.back()->value->second;
+		}
+		linkAt(path, order, new Node{value_type{key, mapped_type{}}});
+		checkPrefilterLoad();
+		return path.back()->value->second;
 	}
 
 	const mapped_type &valueOf(const key_type &key) const
@@ -391,31 +1006,28 @@ public:
 
 	const_iterator find(const key_type &key) const
 	{
+		if(filteredOut(key))
+			return cend();
+		MAP_STATS(++counters.lookups;)
 		if(root == nullptr)
 			return cend();
 
 		Node *node = root;
-		std::stack<Node*> up;
-		while(node->value->first != key)
+		KeyPrefix<key_type> prefix(key);
+		PathStack up;
+		MAP_STATS(++counters.descentSteps;)
+		int order;
+		while( (order = compareToNode(key, prefix, node)) != 0 )
 		{
 			up.push(node);
-			if(key < node->value->first)
-			{
-				if(node->left)
-					node = node->left;
-				else
-					return ConstIterator(root, nullptr, up);
-			}
-
-			if(key > node->value->first)
-			{
-				if(node->right)
-					node = node->right;
-				else
-					return ConstIterator(root, nullptr, up);
-			}
+			node = order < 0 ? node->left : node->right;
+			if(node == nullptr)
+				return cend();
+			MAP_STATS(++counters.descentSteps;)
 		}
+		MAP_STATS(++counters.lookupHits;)
 		auto it = ConstIterator(root, node, up);
+		it.version = version;
 		return it;
 	}
 
@@ -424,21 +1036,243 @@ public:
 		return Iterator( (const_cast<const TreeMap *>(this))->find(key));
 	}
 
+	// Finger search: starts at hint rather than the root and climbs only as far as
+	// the key's subtree, so a key d elements away costs O(log d) comparisons. A hint
+	// made before the map last changed (other than one returned by that change) is
+	// ignored and the search starts at the root.
+	const_iterator find(const key_type &key, const const_iterator &hint) const
+	{
+		if(filteredOut(key))
+			return cend();
+		MAP_STATS(++counters.lookups;)
+
+		std::vector<Node *> path = hintPath(hint);
+		if(seek(path, key, KeyPrefix<key_type>(key)) != 0 || path.empty())
+			return cend();
+		MAP_STATS(++counters.lookupHits;)
+		return iteratorAt(std::move(path));
+	}
+
+	iterator find(const key_type &key, const const_iterator &hint)
+	{
+		return Iterator( (const_cast<const TreeMap *>(this))->find(key, hint));
+	}
+
+	// Inserts value unless its key is present; either way returns an iterator to the
+	// element with that key, which is a valid hint for the next call. The key is
+	// searched for from hint like in find(key, hint); with end() as the hint a key
+	// greater than every other is appended in O(1) amortized.
+	iterator insert(const const_iterator &hint, const value_type &value)
+	{
+		return insertFrom(hint, value.first, [&value]
+		{
+			return new Node{value};
+		});
+	}
+
+	// Relinks the handle's node like insert(hint, value) links a new one. If the key
+	// is already present the node stays in the handle.
+	iterator insert(const const_iterator &hint, NodeHandle &&handle)
+	{
+		if(handle.empty())
+			throw std::logic_error("empty node handle");
+
+		return insertFrom(hint, handle.key(), [&handle]
+		{
+			Node *node = handle.node;
+			handle.node = nullptr;
+			return node;
+		});
+	}
+
+	// the first element whose key is not less than key, or end()
+	const_iterator lowerBound(const key_type &key) const
+	{
+		MAP_STATS(++counters.lookups;)
+		std::vector<Node *> path;
+		int order = seek(path, key, KeyPrefix<key_type>(key));
+		if(path.empty())
+			return cend();
+
+		MAP_STATS(if(order == 0) ++counters.lookupHits;)
+		auto it = iteratorAt(std::move(path));
+		if(order > 0)
+			++it;
+		return it;
+	}
+
+	iterator lowerBound(const key_type &key)
+	{
+		return Iterator( (const_cast<const TreeMap *>(this))->lowerBound(key));
+	}
+
+	// out[i] points at the element with keys[i] or is nullptr; sorted batches are
+	// fastest, but any order gives the right answers
+	void findMany(const std::vector<key_type> &keys, std::vector<const value_type *> &out) const
+	{
+		out.assign(keys.size(), nullptr);
+		descendBatch(keys.data(), keys.size(), [&](size_t i, Node *match, Node *)
+		{
+			if(match != nullptr)
+				out[i] = match->value;
+		});
+	}
+
+	void findMany(const std::vector<key_type> &keys, std::vector<value_type *> &out)
+	{
+		out.assign(keys.size(), nullptr);
+		descendBatch(keys.data(), keys.size(), [&](size_t i, Node *match, Node *)
+		{
+			if(match != nullptr)
+				out[i] = match->value;
+		});
+	}
+
+	// out[i] points at the first element whose key is not less than keys[i], or is nullptr
+	void lowerBoundMany(const std::vector<key_type> &keys, std::vector<const value_type *> &out) const
+	{
+		out.assign(keys.size(), nullptr);
+		descendBatch(keys.data(), keys.size(), [&](size_t i, Node *, Node *lowerBound)
+		{
+			if(lowerBound != nullptr)
+				out[i] = lowerBound->value;
+		});
+	}
+
 	void remove(const key_type &key)
 	{
 		if(root == nullptr)
 			throw std::out_of_range("Collection is empty");
 
-		auto it = find(key);
-		if(it.current == nullptr)
+		Node *detached = nullptr;
+		root = detachNode(root, key, detached);
+		if(detached == nullptr)
 			throw std::out_of_range("there isn't element with that key");
 
-		root = deleteNode(root, key);
+		delete detached;
 	}
 
 	void remove(const const_iterator &it)
 	{
-		remove(it->first);
+		erase(it);
+	}
+
+	// Removes the element and returns the iterator following it, so a sweep can
+	// erase while it walks the map. The element is unlinked through the iterator's
+	// own path, which also leads to the successor, so nothing is looked up again;
+	// only an iterator whose path the tree has outdated costs a descent.
+	iterator erase(const const_iterator &it)
+	{
+		if(it.current == nullptr)
+			throw std::out_of_range("out of range");
+
+		std::vector<Node *> path = hintPath(it);
+		if(path.empty())
+		{
+			if(seek(path, it->first, KeyPrefix<key_type>(it->first)) != 0 || path.empty())
+				throw std::out_of_range("there isn't element with that key");
+		}
+
+		unlinkAt(path);
+		if(path.empty())
+			return end();
+		return Iterator(iteratorAt(std::move(path)));
+	}
+
+	// Removes every element for which pred(element) is true in one in-order pass and
+	// relinks the survivors into a perfectly balanced tree; returns how many were
+	// removed.
+	template<typename Predicate>
+	size_type eraseIf(Predicate pred)
+	{
+		std::vector<Node *> nodes;
+		nodes.reserve(size);
+		collectNodes(root, nodes);
+
+		std::vector<Node *> kept;
+		kept.reserve(size);
+		size_type removed = 0;
+		for(size_t i = 0; i < nodes.size(); ++i)
+		{
+			bool matches;
+			try
+			{
+				matches = pred(const_cast<const_reference>(*nodes[i]->value));
+			}
+			catch(...)
+			{
+				kept.insert(kept.end(), nodes.begin() + i, nodes.end());
+				relink(kept);
+				throw;
+			}
+
+			if(matches)
+			{
+				if(prefilter.enabled())
+					prefilter.remove(prefilter.hash(nodes[i]->getKey()));
+				delete nodes[i];
+				++removed;
+			}
+			else
+				kept.push_back(nodes[i]);
+		}
+
+		if(removed != 0)
+			relink(kept);
+		MAP_STATS(counters.removes += removed;)
+		return removed;
+	}
+
+	// Unlinks the element and hands over its node; the handle is empty if there is
+	// no such key. Nothing is copied or freed.
+	NodeHandle extract(const key_type &key)
+	{
+		Node *detached = nullptr;
+		root = detachNode(root, key, detached);
+		return NodeHandle(detached);
+	}
+
+	NodeHandle extract(const const_iterator &it)
+	{
+		return extract(it->first);
+	}
+
+	// Relinks the handle's node. Returns false and leaves the node in the handle if
+	// the handle is empty or the key is already present.
+	bool insert(NodeHandle &&handle)
+	{
+		if(handle.empty() || find(handle.key()) != end())
+			return false;
+
+		root = insertNode(root, handle.node);
+		handle.node = nullptr;
+		checkPrefilterLoad();
+		return true;
+	}
+
+	// Moves every element whose key isn't present here out of other, relinking
+	// nodes instead of reallocating them.
+	void merge(TreeMap &other)
+	{
+		if(this == &other)
+			return;
+
+		std::vector<Node *> nodes;
+		nodes.reserve(other.size);
+		collectNodes(other.root, nodes);
+		other.root = nullptr;
+		other.size = 0;
+		if(other.prefilter.enabled())
+			other.prefilter.resize(other.prefilter.capacity());
+
+		for(Node *node : nodes)
+		{
+			if(find(node->getKey()) == end())
+				root = insertNode(root, node);
+			else
+				other.root = other.insertNode(other.root, node);
+		}
+		checkPrefilterLoad();
 	}
 
 	size_type getSize() const
@@ -467,6 +1301,136 @@ public:
 		return !(*this == other);
 	}
 
+	// Immutable copy in a contiguous, implicitly indexed layout for maps that are
+	// built once and then only queried.
+	FrozenTreeMap<key_type, mapped_type> freeze() const
+	{
+		return FrozenTreeMap<key_type, mapped_type>(begin(), end(), size);
+	}
+
+	// Attaches a counting Bloom filter that find() and valueOf() ask before they
+	// descend, so most misses cost one cache line instead of a root-to-leaf walk
+	// and an iterator stack. Keys are hashed with Hash, std::hash by default. The
+	// filter follows every insert and removal and is rebuilt once the map holds
+	// twice expectedElements (by default its current size).
+	template<typename Hash = std::hash<key_type>>
+	void enablePrefilter(size_t expectedElements = 0)
+	{
+		prefilter.template enable<Hash>(std::max<size_t>({expectedElements, size, 16}));
+		rebuildPrefilter(prefilter.capacity());
+	}
+
+	void disablePrefilter()
+	{
+		prefilter.disable();
+	}
+
+	// a node is allocated per element, there is no spare room to report
+	size_type capacity() const
+	{
+		return size;
+	}
+
+	// bytes held by the map: every element is a Node and a separately allocated
+	// value, both with allocator overhead, plus heap memory owned by keys and values
+	size_t memoryUsage() const
+	{
+		size_t bytes = sizeof(*this) + size * (heapBlockSize(sizeof(Node)) + heapBlockSize(sizeof(value_type)));
+		bytes += prefilter.memoryUsage();
+
+		if(MayOwnHeap<key_type, mapped_type>::value)
+		{
+			for(auto &elem : *this)
+				bytes += ownedBytes(elem.first) + ownedBytes(elem.second);
+		}
+		return bytes;
+	}
+
+	// Reallocates every node and value in key order and links them into a perfectly
+	// balanced tree, so in-order scans and lookups walk memory allocated together.
+	void compact()
+	{
+		std::vector<Node *> nodes;
+		nodes.reserve(size);
+		collectNodes(root, nodes);
+
+		std::vector<Node *> packed;
+		packed.reserve(nodes.size());
+		try
+		{
+			for(Node *node : nodes)
+				packed.push_back(new Node(*node->value));
+		}
+		catch(...)
+		{
+			for(Node *node : packed)
+				delete node;
+			throw;
+		}
+
+		for(Node *node : nodes)
+			delete node;
+		relink(packed);
+	}
+
+	TreeMapStats stats() const
+	{
+		TreeMapStats result;
+		result.size = size;
+		result.height = root == nullptr ? 0 : root->height;
+		while( (size_t{1} << result.optimalHeight) <= size )
+			++result.optimalHeight;
+
+		MAP_STATS(result.countersEnabled = true;)
+		MAP_STATS(result.operations = counters;)
+		return result;
+	}
+
+	void dumpStats(std::ostream &out) const
+	{
+		stats().writeJson(out);
+	}
+
+	void resetStats()
+	{
+		MAP_STATS(counters = TreeMapCounters{};)
+	}
+
+	// fn is called once for every element, from several threads at once; every thread
+	// takes whole subtrees, so no two threads touch the same node.
+	template<typename Function>
+	void parallelForEach(Function fn) const
+	{
+		auto pieces = splitIntoPieces();
+		parallel::runTasks(pieces.size(), [&](size_t i)
+		{
+			forEachInPiece(pieces[i], fn);
+		});
+	}
+
+	template<typename Function>
+	void parallelForEach(Function fn)
+	{
+		const TreeMap *self = this;
+		self->parallelForEach([&](const_reference elem)
+		{
+			// ugly cast, yet reduces code duplication.
+			fn(const_cast<reference>(elem));
+		});
+	}
+
+	// pieces are disjoint key ranges combined in key order, so combine only has to be
+	// associative, not commutative.
+	template<typename T, typename Map, typename Combine>
+	T parallelReduce(T init, Map map, Combine combine) const
+	{
+		auto pieces = splitIntoPieces();
+		return parallel::reduce(pieces.size(), init, [&](size_t i, auto callback)
+		{
+			forEachInPiece(pieces[i], callback);
+		}, map, combine);
+	}
+
 	iterator begin()
 	{
 		return Iterator(cbegin());
@@ -482,14 +1446,16 @@ public:
 		if(size == 0)
 			return cend();
 
-		std::stack<Node *> up;
+		PathStack up;
 		Node *node = root;
 		while(node->left != nullptr)
 		{
 			up.push(node);
 			node = node->left;
 		}
-		return ConstIterator{root, node, up};
+		ConstIterator it{root, node, up};
+		it.version = version;
+		return it;
 	}
 
 	const_iterator cend() const
@@ -526,7 +1492,8 @@ public:
 private:
 	Node *root;
 	Node *current;
-	std::stack<Node*> up;
+	PathStack up;
+	size_t version{0}; // of the map when the path was taken, 0 if unknown
 
 	void goToMinNode()
 	{
@@ -547,10 +1514,11 @@ private:
 	}
 
 public:
-	ConstIterator(Node *root, Node *current, std::stack<Node*> &up)
+	ConstIterator(Node *root, Node *current, PathStack &up)
 	:root(root), current(current), up(up)
 	{}
 
+	// end() (current == nullptr) keeps no path; decrementing it descends from the root
 	ConstIterator(Node *root, Node *current) :root(root), current(current)
 	{
 		Node *temp = root;
@@ -565,17 +1533,10 @@ public:
 					temp = temp->right;
 			}
 		}
-		else
-		{
-			while(temp != current)
-			{
-				up.push(temp);
-				temp = temp->right;
-			}
-		}
 	}
 
-	ConstIterator(const ConstIterator &other):root(other.root), current(other.current), up(other.up)
+	ConstIterator(const ConstIterator &other):root(other.root), current(other.current), up(other.up),
+	                                          version(other.version)
 	{
 	}
 
@@ -588,7 +1549,7 @@ public:
 
 		if(current == root->max() )
 		{
-			up.push(current);
+			up = PathStack();
 			current = nullptr;
 			return *this;
 		}
@@ -631,8 +1592,8 @@ public:
 			throw std::out_of_range("out of range decrementing");
 		if(current == nullptr)
 		{
-			current = up.top();
-			up.pop();
+			current = root;
+			goToMaxNode();
 			return *this;
 		}
 
@@ -680,7 +1641,8 @@ public:
 
 	bool operator==(const ConstIterator &other) const
 	{
-		return up == other.up && current == other.current;
+		// the path to a node is unique, comparing the nodes is enough
+		return current == other.current;
 	}
 
 	bool operator!=(const ConstIterator &other) const
@@ -689,6 +1651,88 @@ public:
 	}
 };
 
+template<typename KeyType, typename ValueType>
+class TreeMap<KeyType, ValueType>::NodeHandle
+{
+	friend class TreeMap;
+
+	Node *node = nullptr;
+
+	explicit NodeHandle(Node *node) : node(node)
+	{}
+
+public:
+	NodeHandle()
+	= default;
+
+	// owns a new element that isn't linked into any map yet
+	explicit NodeHandle(const value_type &value) : node(new Node(value))
+	{}
+
+	NodeHandle(const NodeHandle &) = delete;
+	NodeHandle &operator=(const NodeHandle &) = delete;
+
+	NodeHandle(NodeHandle &&other) noexcept : node(other.node)
+	{
+		other.node = nullptr;
+	}
+
+	NodeHandle &operator=(NodeHandle &&other) noexcept
+	{
+		if(this != &other)
+		{
+			delete node;
+			node = other.node;
+			other.node = nullptr;
+		}
+		return *this;
+	}
+
+	~NodeHandle()
+	{
+		delete node;
+	}
+
+	bool empty() const
+	{
+		return node == nullptr;
+	}
+
+	explicit operator bool() const
+	{
+		return !empty();
+	}
+
+	const key_type &key() const
+	{
+		if(empty())
+			throw std::logic_error("empty node handle");
+		return node->getKey();
+	}
+
+	mapped_type &mapped() const
+	{
+		if(empty())
+			throw std::logic_error("empty node handle");
+		return node->value->second;
+	}
+
+	value_type &value() const
+	{
+		if(empty())
+			throw std::logic_error("empty node handle");
+		return *node->value;
+	}
+
+	// heap bytes of the node and its element, not counting what they own
+	size_t memoryUsage() const
+	{
+		if(empty())
+			return 0;
+		return heapBlockSize(sizeof(Node)) + heapBlockSize(sizeof(value_type));
+	}
+};
+
 template<typename KeyType, typename ValueType>
 class TreeMap<KeyType, ValueType>::Iterator : public TreeMap<KeyType, ValueType>::ConstIterator
 {
@@ -0,0 +1,86 @@
+#include <cassert>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <random>
+
+#include "BufferedTreeMap.h"
+
+// g++ -std=c++14 -g -fsanitize=address,undefined -pthread bufferedtreemap_test.cpp -o bufferedtreemap_test
+
+namespace
+{
+	// a reference from operator[] to a new key outlives the merges that follow
+	void newKeyReferenceSurvivesMerges()
+	{
+		aisdi::BufferedTreeMap<int, int> map(4);
+		int &value = map[1];
+		for(int i = 2; i < 12; ++i)
+			map.put(i, i);
+		value = 42;
+		assert(map.valueOf(1) == 42);
+	}
+
+	// a key written blind over one the tree holds, then referenced
+	void blindWriteReferenceSurvivesMerges()
+	{
+		aisdi::BufferedTreeMap<int, int> map(4);
+		map.put(1, 1);
+		map.flush();
+		map.put(1, 2);
+		int &value = map[1];
+		int &same = map.valueOf(1);
+		assert(&value == &same && value == 2);
+		map.remove(1);
+		map.put(1, 3); // a tombstone revived
+		int &revived = map[1];
+		for(int i = 2; i < 12; ++i)
+			map.put(i, i);
+		revived = 42;
+		assert(map.valueOf(1) == 42);
+	}
+
+	void matchesStdMap()
+	{
+		aisdi::BufferedTreeMap<int, int> map(8);
+		std::map<int, int> expected;
+		std::mt19937 random(7);
+		for(int i = 0; i < 20000; ++i)
+		{
+			int key = static_cast<int>(random() % 500);
+			switch(random() % 4)
+			{
+			case 0:
+				map.put(key, i);
+				expected[key] = i;
+				break;
+			case 1:
+				map[key] += i;
+				expected[key] += i;
+				break;
+			case 2:
+				map.discard(key);
+				expected.erase(key);
+				break;
+			default:
+				assert((map.find(key) != map.end()) == (expected.count(key) == 1));
+			}
+		}
+		assert(map.getSize() == expected.size());
+		auto it = expected.begin();
+		for(auto &element : map)
+		{
+			assert(element.first == it->first && element.second == it->second);
+			++it;
+		}
+	}
+}
+
+int main()
+{
+	newKeyReferenceSurvivesMerges();
+	blindWriteReferenceSurvivesMerges();
+	matchesStdMap();
+	std::cout << "ok\n";
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,195 @@
+#include <atomic>
+#include <cassert>
+#include <cstdlib>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ConcurrentSkipListMap.h"
+
+// g++ -std=c++14 -g -fsanitize=address,undefined -pthread concurrentskiplistmap_test.cpp -o concurrentskiplistmap_test
+//
+// ThreadSanitizer (-fsanitize=thread) checks the node links, flags and value
+// pointers, but it doesn't model atomic_thread_fence, which EpochDomain relies on
+// for when memory may be freed; a clean run says nothing about reclamation.
+
+namespace
+{
+	using Map = aisdi::ConcurrentSkipListMap<int, std::string>;
+
+	void matchesStdMap()
+	{
+		Map map;
+		assert(map.isEmpty() && map.begin() == map.end());
+
+		std::map<int, std::string> expected;
+		std::mt19937 random(3);
+		for(int i = 0; i < 20000; ++i)
+		{
+			int key = static_cast<int>(random() % 3000);
+			switch(random() % 4)
+			{
+			case 0:
+				assert(map.insert(key, std::to_string(i)) == expected.emplace(key, std::to_string(i)).second);
+				break;
+			case 1:
+				map.assign(key, std::string(40, static_cast<char>('a' + i % 26)));
+				expected[key] = std::string(40, static_cast<char>('a' + i % 26));
+				break;
+			case 2:
+				assert(map.discard(key) == (expected.erase(key) == 1));
+				break;
+			default:
+			{
+				auto it = map.find(key);
+				assert((it == map.end()) == (expected.count(key) == 0));
+				if(it != map.end())
+					assert(it->second == expected[key] && map.valueOf(key) == expected[key]);
+			}
+			}
+		}
+
+		assert(map.getSize() == expected.size());
+		auto next = expected.begin();
+		for(auto it = map.begin(); it != map.end(); ++it, ++next)
+			assert(it->first == next->first && (*it).second == next->second);
+		assert(next == expected.end());
+
+		assert(map.lowerBound(1500)->first == expected.lower_bound(1500)->first);
+		assert(map.lower_bound(100000) == map.end());
+		long visited = 0;
+		map.forEachInRange(100, 200, [&](int key, const std::string &)
+		{
+			assert(key >= 100 && key < 200);
+			++visited;
+		});
+		assert(visited == std::distance(expected.lower_bound(100), expected.lower_bound(200)));
+	}
+
+	void copiesMovesAndThrows()
+	{
+		Map map{{1, "a"}, {2, "b"}, {3, "c"}};
+		Map copy(map);
+		assert(copy == map);
+		copy.assign(-1, "x");
+		assert(copy != map);
+
+		Map moved(std::move(copy));
+		assert(moved.getSize() == map.getSize() + 1 && copy.isEmpty());
+		copy = moved;
+		assert(copy == moved);
+
+		try
+		{
+			map.remove(-5);
+			assert(false);
+		}
+		catch(const std::out_of_range &)
+		{}
+		try
+		{
+			map.valueOf(-5);
+			assert(false);
+		}
+		catch(const std::out_of_range &)
+		{}
+		map.remove(map.begin());
+		assert(map.getSize() == 2 && !map.contains(1));
+	}
+
+	// Writers on disjoint key ranges, all also fighting over a few shared keys,
+	// while readers walk the map and check its order.
+	void concurrentWritersAndReaders()
+	{
+		const int WRITERS = 4;
+		const int READERS = 2;
+		const int PER_WRITER = 4000;
+
+		Map map;
+		std::atomic<bool> stop{false};
+		std::atomic<long> shared{0}; // shared keys present, as the writers saw it
+		std::vector<std::thread> writers;
+		for(int t = 0; t < WRITERS; ++t)
+		{
+			writers.emplace_back([&, t]
+			{
+				std::mt19937 random(t);
+				for(int i = 0; i < PER_WRITER; ++i)
+				{
+					int key = t * PER_WRITER + i;
+					map.insert(key, std::to_string(key));
+					if(i % 3 == 0)
+						map.assign(key, "v" + std::to_string(key));
+					if(i % 2 == 0)
+						assert(map.discard(key));
+
+					int contended = 1000000 + static_cast<int>(random() % 64);
+					if(random() % 2)
+					{
+						if(map.insert(contended, "shared"))
+							++shared;
+					}
+					else if(map.discard(contended))
+						--shared;
+				}
+			});
+		}
+
+		std::vector<std::thread> readers;
+		for(int t = 0; t < READERS; ++t)
+		{
+			readers.emplace_back([&]
+			{
+				while(!stop)
+				{
+					int previous = -1;
+					for(auto it = map.begin(); it != map.end(); ++it)
+					{
+						assert(it->first > previous && !it->second.empty());
+						previous = it->first;
+					}
+					map.forEachInRange(0, 500, [](int, const std::string &value)
+					{
+						assert(!value.empty());
+					});
+				}
+			});
+		}
+
+		for(std::thread &writer : writers)
+			writer.join();
+		stop = true;
+		for(std::thread &reader : readers)
+			reader.join();
+
+		assert(static_cast<long>(map.getSize()) == WRITERS * PER_WRITER / 2 + shared);
+		for(int t = 0; t < WRITERS; ++t)
+		{
+			for(int i = 0; i < PER_WRITER; ++i)
+			{
+				int key = t * PER_WRITER + i;
+				assert(map.contains(key) == (i % 2 == 1));
+				if(i % 2 == 1)
+					assert(map.valueOf(key) == (i % 3 == 0 ? "v" : "") + std::to_string(key));
+			}
+		}
+		long walked = 0;
+		for(auto it = map.begin(); it != map.end(); ++it)
+			++walked;
+		assert(walked == static_cast<long>(map.getSize()));
+	}
+}
+
+int main()
+{
+	matchesStdMap();
+	copiesMovesAndThrows();
+	concurrentWritersAndReaders();
+	std::cout << "ok\n";
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,100 @@
+#include <cassert>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include "HashMap.h"
+
+// g++ -std=c++14 -g -fsanitize=address,undefined -pthread frozenhashmap_test.cpp -o frozenhashmap_test
+
+namespace
+{
+	// a key whose std::hash drops the lowest bit, so 2 and 3 collide
+	struct CoarseKey
+	{
+		long value;
+
+		bool operator==(const CoarseKey &other) const
+		{
+			return value == other.value;
+		}
+	};
+}
+
+namespace std
+{
+	template<>
+	struct hash<CoarseKey>
+	{
+		size_t operator()(const CoarseKey &key) const
+		{
+			return static_cast<size_t>(key.value & ~1L);
+		}
+	};
+}
+
+namespace
+{
+	template<typename PairList>
+	void assertFreezeRejects(const PairList &pairs)
+	{
+		try
+		{
+			aisdi::FrozenHashMap<typename PairList::value_type::first_type, int> frozen(pairs.begin(), pairs.end(),
+			                                                                            pairs.size());
+			assert(false);
+		}
+		catch(const std::invalid_argument &)
+		{}
+	}
+
+	void freezesDistinctKeys()
+	{
+		aisdi::HashMap<long, int> map;
+		for(long i = 0; i < 10000; ++i)
+			map[i * 7919] = static_cast<int>(i);
+		auto frozen = map.freeze();
+		assert(frozen.getSize() == map.getSize());
+		for(long i = 0; i < 10000; ++i)
+			assert(frozen.valueOf(i * 7919) == i);
+		assert(frozen.find(1) == frozen.end());
+	}
+
+	void rejectsCollidingHashes()
+	{
+		aisdi::HashMap<CoarseKey, int> map;
+		map[CoarseKey{2}] = 2;
+		map[CoarseKey{3}] = 3;
+		try
+		{
+			map.freeze();
+			assert(false);
+		}
+		catch(const std::invalid_argument &)
+		{}
+	}
+
+	void rejectsNaNKeys()
+	{
+		double nan = std::numeric_limits<double>::quiet_NaN();
+		assertFreezeRejects(std::vector<std::pair<double, int>>{{nan, 1}, {1.5, 2}, {nan, 3}});
+	}
+
+	void rejectsDuplicateKeys()
+	{
+		assertFreezeRejects(std::vector<std::pair<long, int>>{{1, 1}, {2, 2}, {1, 3}});
+	}
+}
+
+int main()
+{
+	freezesDistinctKeys();
+	rejectsCollidingHashes();
+	rejectsNaNKeys();
+	rejectsDuplicateKeys();
+	std::cout << "ok\n";
+	return EXIT_SUCCESS;
+}
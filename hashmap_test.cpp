@@ -0,0 +1,138 @@
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include "HashMap.h"
+
+// g++ -std=c++14 -g -fsanitize=address,undefined -pthread hashmap_test.cpp -o hashmap_test
+
+namespace
+{
+	// references and iterators of the chained layout survive growth and the
+	// removal of other elements
+	template<typename K>
+	void referencesStayValid(K (*key)(int))
+	{
+		aisdi::HashMap<K, int> map;
+		int &value = map[key(0)];
+		const int *address = &value;
+		auto it = map.find(key(0));
+		for(int i = 1; i < 1000; ++i)
+			map[key(i)] = i;
+		for(int i = 1; i < 1000; i += 2)
+			map.remove(key(i));
+		value = 7;
+		assert(&map[key(0)] == address);
+		assert(it->second == 7);
+		assert(map.valueOf(key(0)) == 7);
+	}
+
+	// an iterator taken before the map grows, on a key that growth moves to another
+	// chain, still walks forward to end() and back to begin()
+	void iteratorSurvivesGrowth(size_t rehashStep)
+	{
+		aisdi::HashMap<int, int> map;
+		map.setRehashStep(rehashStep);
+		for(int i = 0; i <= 20; ++i)
+			map[i] = i;
+		auto it = map.find(20);
+		auto back = it;
+		for(int i = 21; i < 120; ++i)
+			map[i] = i;
+		assert(it->first == 20 && back->first == 20);
+
+		size_t steps = 0;
+		while(it != map.end())
+		{
+			assert(steps++ < 2 * map.getSize());
+			++it;
+		}
+		steps = 0;
+		while(back != map.begin())
+		{
+			assert(steps++ < 2 * map.getSize());
+			--back;
+		}
+
+		size_t walked = 0;
+		for(auto element = map.cbegin(); element != map.cend(); ++element)
+			++walked;
+		assert(walked == map.getSize());
+		for(auto element = --map.cend(); element != map.cbegin(); --element)
+			--walked;
+		assert(walked == 1);
+	}
+
+	int intKey(int i)
+	{
+		return i;
+	}
+
+	std::string stringKey(int i)
+	{
+		return "key number " + std::to_string(i);
+	}
+
+	void flatLayoutWorks()
+	{
+		aisdi::FlatHashMap<long, int> map;
+		for(long i = 0; i < 1000; ++i)
+			map[i] = static_cast<int>(i);
+		for(long i = 0; i < 1000; i += 2)
+			map.remove(i);
+		assert(map.getSize() == 500);
+		for(long i = 0; i < 1000; ++i)
+			assert((map.find(i) != map.end()) == (i % 2 == 1));
+	}
+
+	// a bucket offset past the entries is turned away by the lookups that reach it;
+	// opening the snapshot doesn't read the bucket table
+	void corruptSnapshotIsRejected()
+	{
+		const char *path = "hashmap_test.snapshot";
+		aisdi::HashMap<long, int> map;
+		for(long i = 0; i < 100; ++i)
+			map[i] = static_cast<int>(i);
+		map.saveSnapshot(path);
+		{
+			aisdi::HashMapSnapshot<long, int> snapshot(path);
+			assert(snapshot.valueOf(42) == 42);
+		}
+
+		{
+			std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+			uint64_t offset = 1000000;
+			file.seekp(sizeof(aisdi::SnapshotHeader) + sizeof(uint64_t));
+			file.write(reinterpret_cast<const char *>(&offset), sizeof(offset));
+		}
+		aisdi::HashMapSnapshot<long, int> snapshot(path);
+		for(long key : {0L, 1L}) // in buckets 0 and 1, which end and start at the bad offset
+		{
+			try
+			{
+				snapshot.find(key);
+				assert(false);
+			}
+			catch(const std::runtime_error &)
+			{}
+		}
+		std::remove(path);
+	}
+}
+
+int main()
+{
+	referencesStayValid<int>(intKey);
+	referencesStayValid<std::string>(stringKey);
+	iteratorSurvivesGrowth(0);
+	iteratorSurvivesGrowth(4);
+	flatLayoutWorks();
+	corruptSnapshotIsRejected();
+	std::cout << "ok\n";
+	return EXIT_SUCCESS;
+}
@@ -1,52 +1,456 @@
+#include <algorithm>
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
 #include <cstdlib>
-#include <string>
+#include <cstring>
+#include <iomanip>
 #include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
-#include "TreeMap.h"
-#include "HashMap.h"
+#include "Benchmark.h"
 
 namespace
 {
 
-	template <typename K, typename V>
-	using Map = aisdi::HashMap<K, V>;
+	using namespace aisdi::benchmark;
+
+	volatile std::size_t sink;
+
+	enum Operation
+	{
+		INSERT,
+		LOOKUP_HIT,
+		LOOKUP_MISS,
+		ERASE,
+		ITERATE,
+		MIX,
+		OPERATION_COUNT
+	};
+
+	const char *operationNames[] = {"insert", "lookup-hit", "lookup-miss", "erase", "iterate", "mix"};
+
+	// how many elements one "iterate" step of a mixed workload walks
+	const std::size_t mixScanLength = 16;
 
-	template <typename K, typename V>
-	using avl = aisdi::TreeMap<K, V>;
+	struct Options
+	{
+		std::vector<std::string> keyTypes{"int", "string"};
+		std::vector<std::size_t> sizes{1000, 100000};
+		std::vector<std::string> backends{"HashMap", "TreeMap", "std::map", "std::unordered_map"};
+		std::vector<Operation> operations{INSERT, LOOKUP_HIT, LOOKUP_MISS, ITERATE, ERASE};
+		std::size_t mixWeights[ITERATE + 1] = {0, 0, 0, 0, 0};
+		std::size_t repeatCount = 1;
+		std::string format = "table";
+		unsigned seed = 42;
+		bool help = false;
+	};
 
-	void perfomTest()
+	struct Result
 	{
-		std::cout<<"";
+		std::string backend;
+		std::string keyType;
+		std::size_t size;
+		Operation operation;
+		std::size_t ops;
+		double seconds;
+		double p50;
+		double p99;
+		double p999;
+	};
 
+	Result makeResult(LatencyRecorder &latency, const std::string &backend, const std::string &keyType, std::size_t size,
+	                  Operation operation)
+	{
+		return Result{backend, keyType, size, operation, latency.operations(), latency.seconds(),
+		              latency.percentile(0.50), latency.percentile(0.99), latency.percentile(0.999)};
 	}
 
-} // namespace
+	template<typename K>
+	struct KeySet
+	{
+		std::vector<K> present;  // inserted during the fill phase
+		std::vector<K> absent;   // never inserted by the fixed phases
+		std::vector<K> fresh;    // inserted by a mixed workload
+	};
 
-int main(int argc, char** argv)
-{
-//  const std::size_t repeatCount = argc > 1 ? std::atoll(argv[1]) : 10000;
-//  for (std::size_t i = 0; i < repeatCount; ++i)
-//    perfomTest();
+	template<typename K>
+	KeySet<K> makeKeys(std::size_t size, unsigned seed)
+	{
+		std::vector<std::uint64_t> ids(3 * size);
+		for(std::size_t i = 0; i < ids.size(); ++i)
+			ids[i] = i * 2654435761u % 4294967291u;
+		std::mt19937_64 random(seed);
+		std::shuffle(ids.begin(), ids.end(), random);
+
+		KeySet<K> keys;
+		for(std::size_t i = 0; i < size; ++i)
+		{
+			keys.present.push_back(makeKey<K>(ids[i]));
+			keys.absent.push_back(makeKey<K>(ids[size + i]));
+			keys.fresh.push_back(makeKey<K>(ids[2 * size + i]));
+		}
+		return keys;
+	}
+
+	std::vector<Operation> makeMix(const Options &options, std::size_t count)
+	{
+		std::vector<Operation> mix;
+		std::size_t totalWeight = 0;
+		for(std::size_t weight : options.mixWeights)
+			totalWeight += weight;
+		if(totalWeight == 0)
+			return mix;
+
+		std::mt19937 random(options.seed);
+		std::uniform_int_distribution<std::size_t> pick(0, totalWeight - 1);
+		for(std::size_t i = 0; i < count; ++i)
+		{
+			std::size_t roll = pick(random);
+			int operation = 0;
+			while(roll >= options.mixWeights[operation])
+				roll -= options.mixWeights[operation++];
+			mix.push_back(static_cast<Operation>(operation));
+		}
+		return mix;
+	}
+
+	template<typename MapType, typename K>
+	void runMix(MapType &map, const KeySet<K> &keys, const std::vector<Operation> &mix, LatencyRecorder &latency)
+	{
+		using V = typename MapType::mapped_type;
+
+		std::vector<K> live = keys.present;
+		std::size_t nextFresh = 0;
+		std::size_t nextLookup = 0;
+		std::size_t checksum = 0;
+
+		latency.reserve(mix.size());
+		for(std::size_t i = 0; i < mix.size(); ++i)
+		{
+			Operation operation = mix[i];
+			if(operation == INSERT && nextFresh == keys.fresh.size())
+				operation = LOOKUP_HIT;
+			if((operation == LOOKUP_HIT || operation == ERASE) && live.empty())
+				operation = LOOKUP_MISS;
+
+			std::size_t slot = live.empty() ? 0 : (nextLookup++ * 7919) % live.size();
+			auto start = Clock::now();
+			switch(operation)
+			{
+			case INSERT:
+				insertKey(map, keys.fresh[nextFresh], V{});
+				break;
+			case LOOKUP_HIT:
+				checksum += containsKey(map, live[slot]);
+				break;
+			case LOOKUP_MISS:
+				checksum += containsKey(map, keys.absent[i % keys.absent.size()]);
+				break;
+			case ERASE:
+				eraseKey(map, live[slot]);
+				break;
+			default:
+				checksum += scan(map, mixScanLength);
+			}
+			latency.record(Clock::now() - start);
+
+			if(operation == INSERT)
+				live.push_back(keys.fresh[nextFresh++]);
+			else if(operation == ERASE)
+			{
+				live[slot] = live.back();
+				live.pop_back();
+			}
+		}
+		sink = checksum;
+	}
+
+	template<typename MapType, typename K>
+	void perfomTest(const std::string &backend, const std::string &keyType, const KeySet<K> &keys,
+	                const Options &options, std::vector<Result> &results)
+	{
+		using V = typename MapType::mapped_type;
 
-	avl<int,int> tree = {{1,5},{2,10},{0,0},{4,4},{7,7},{5,5},{3,3}};
+		const std::size_t size = keys.present.size();
+		LatencyRecorder latency[OPERATION_COUNT];
+		std::vector<Operation> mix = makeMix(options, size);
 
-	tree.print();
+		for(std::size_t repeat = 0; repeat < options.repeatCount; ++repeat)
+		{
+			MapType map;
+			std::size_t checksum = 0;
 
+			latency[INSERT].reserve(size);
+			for(const K &key : keys.present)
+			{
+				auto start = Clock::now();
+				insertKey(map, key, V{});
+				latency[INSERT].record(Clock::now() - start);
+			}
 
+			latency[LOOKUP_HIT].reserve(size);
+			for(const K &key : keys.present)
+			{
+				auto start = Clock::now();
+				checksum += containsKey(map, key);
+				latency[LOOKUP_HIT].record(Clock::now() - start);
+			}
 
+			latency[LOOKUP_MISS].reserve(size);
+			for(const K &key : keys.absent)
+			{
+				auto start = Clock::now();
+				checksum += containsKey(map, key);
+				latency[LOOKUP_MISS].record(Clock::now() - start);
+			}
 
-//tree.root = tree.deleteNode(tree.root, 1);
+			{
+				auto start = Clock::now();
+				checksum += scan(map, size);
+				latency[ITERATE].record(Clock::now() - start, size);
+			}
 
-//tree[int{}] = int{};
+			if(!mix.empty())
+			{
+				MapType mixed = map;
+				runMix(mixed, keys, mix, latency[MIX]);
+			}
 
-	Map<int, int> map;
-	map[int{}] = int{};
+			latency[ERASE].reserve(size);
+			for(const K &key : keys.present)
+			{
+				auto start = Clock::now();
+				eraseKey(map, key);
+				latency[ERASE].record(Clock::now() - start);
+			}
+
+			sink = checksum;
+		}
+
+		for(Operation operation : options.operations)
+			results.push_back(makeResult(latency[operation], backend, keyType, size, operation));
+		if(!mix.empty())
+			results.push_back(makeResult(latency[MIX], backend, keyType, size, MIX));
+	}
+
+	template<typename K>
+	void runKeyType(const std::string &keyType, const Options &options, std::vector<Result> &results)
+	{
+		for(std::size_t size : options.sizes)
+		{
+			KeySet<K> keys = makeKeys<K>(size, options.seed);
+			for(const std::string &backend : options.backends)
+			{
+				withBackend<K>(backend, [&](auto tag)
+				{
+					perfomTest<typename decltype(tag)::Map>(backend, keyType, keys, options, results);
+				});
+			}
+		}
+	}
+
+	double opsPerSecond(const Result &result)
+	{
+		return result.seconds > 0 ? result.ops / result.seconds : 0;
+	}
 
+	void printTable(const std::vector<Result> &results)
+	{
+		std::cout << std::left << std::setw(24) << "backend" << std::setw(8) << "keys" << std::right
+		          << std::setw(10) << "size" << "  " << std::left << std::setw(12) << "operation" << std::right
+		          << std::setw(14) << "ops/sec" << std::setw(10) << "p50 ns" << std::setw(10) << "p99 ns"
+		          << std::setw(10) << "p999 ns" << "\n";
+		for(const Result &result : results)
+		{
+			std::cout << std::left << std::setw(24) << result.backend << std::setw(8) << result.keyType << std::right
+			          << std::setw(10) << result.size << "  " << std::left << std::setw(12)
+			          << operationNames[result.operation] << std::right << std::fixed << std::setprecision(0)
+			          << std::setw(14) << opsPerSecond(result) << std::setw(10) << result.p50
+			          << std::setw(10) << result.p99 << std::setw(10) << result.p999 << "\n";
+		}
+	}
+
+	void printCsv(const std::vector<Result> &results)
+	{
+		std::cout << "backend,key_type,size,operation,ops,seconds,ops_per_sec,p50_ns,p99_ns,p999_ns\n";
+		for(const Result &result : results)
+		{
+			std::cout << result.backend << "," << result.keyType << "," << result.size << ","
+			          << operationNames[result.operation] << "," << result.ops << "," << result.seconds << ","
+			          << opsPerSecond(result) << "," << result.p50 << "," << result.p99 << "," << result.p999 << "\n";
+		}
+	}
+
+	void printJson(const std::vector<Result> &results)
+	{
+		std::cout << "[\n";
+		for(std::size_t i = 0; i < results.size(); ++i)
+		{
+			const Result &result = results[i];
+			std::cout << "  {\"backend\": \"" << result.backend << "\", \"key_type\": \"" << result.keyType
+			          << "\", \"size\": " << result.size << ", \"operation\": \"" << operationNames[result.operation]
+			          << "\", \"ops\": " << result.ops << ", \"seconds\": " << result.seconds
+			          << ", \"ops_per_sec\": " << opsPerSecond(result) << ", \"p50_ns\": " << result.p50
+			          << ", \"p99_ns\": " << result.p99 << ", \"p999_ns\": " << result.p999 << "}"
+			          << (i + 1 < results.size() ? ",\n" : "\n");
+		}
+		std::cout << "]\n";
+	}
+
+	std::vector<std::string> split(const std::string &text, char separator)
+	{
+		std::vector<std::string> parts;
+		std::istringstream in(text);
+		std::string part;
+		while(std::getline(in, part, separator))
+		{
+			if(!part.empty())
+				parts.push_back(part);
+		}
+		return parts;
+	}
+
+	Operation parseOperation(const std::string &name)
+	{
+		for(int i = 0; i < OPERATION_COUNT; ++i)
+		{
+			if(name == operationNames[i])
+				return static_cast<Operation>(i);
+		}
+		throw std::invalid_argument("unknown operation: " + name);
+	}
+
+	void printUsage(const char *program, std::ostream &out)
+	{
+		out << "usage: " << program << " [options]\n"
+		    << "  --keys=int,string           key types to benchmark\n"
+		    << "  --sizes=1000,100000         element counts\n"
+		    << "  --backends=HashMap,TreeMap,std::map,std::unordered_map\n"
+		    << "                              StringHashMap is also available for string keys,\n"
+		    << "                              FlatHashMap for int keys,\n"
+		    << "                              RadixTreeMap, BufferedTreeMap, SpillableHashMap\n"
+		    << "                              and ConcurrentSkipListMap for both key types\n"
+		    << "  --ops=insert,lookup-hit,lookup-miss,iterate,erase\n"
+		    << "  --mix=insert:10,lookup-hit:70,lookup-miss:10,erase:10,iterate:0\n"
+		    << "                              extra mixed workload run on a filled map\n"
+		    << "  --repeat=N                  repetitions of every run\n"
+		    << "  --format=table|csv|json\n"
+		    << "  --seed=N\n"
+		    << "  --help, -h                  print this message\n";
+	}
+
+	Options parseOptions(int argc, char **argv)
+	{
+		Options options;
+		for(int i = 1; i < argc; ++i)
+		{
+			std::string arg = argv[i];
+			auto separator = arg.find('=');
+			std::string name = arg.substr(0, separator);
+			std::string value = separator == std::string::npos ? "" : arg.substr(separator + 1);
+
+			if(arg == "--help" || arg == "-h")
+				options.help = true;
+			else if(name == "--keys")
+				options.keyTypes = split(value, ',');
+			else if(name == "--sizes")
+			{
+				options.sizes.clear();
+				for(const std::string &size : split(value, ','))
+					options.sizes.push_back(std::stoull(size));
+			}
+			else if(name == "--backends")
+				options.backends = split(value, ',');
+			else if(name == "--ops")
+			{
+				options.operations.clear();
+				for(const std::string &entry : split(value, ','))
+				{
+					Operation operation = parseOperation(entry);
+					if(operation == MIX)
+						throw std::invalid_argument("mixed workloads are set up with --mix");
+					options.operations.push_back(operation);
+				}
+			}
+			else if(name == "--mix")
+			{
+				for(const std::string &entry : split(value, ','))
+				{
+					auto colon = entry.find(':');
+					Operation operation = parseOperation(entry.substr(0, colon));
+					if(operation == MIX || colon == std::string::npos)
+						throw std::invalid_argument("bad mix entry: " + entry);
+					options.mixWeights[operation] = std::stoull(entry.substr(colon + 1));
+				}
+			}
+			else if(name == "--repeat")
+				options.repeatCount = std::stoull(value);
+			else if(name == "--format")
+			{
+				if(value != "table" && value != "csv" && value != "json")
+					throw std::invalid_argument("unknown format: " + value);
+				options.format = value;
+			}
+			else if(name == "--seed")
+				options.seed = static_cast<unsigned>(std::stoul(value));
+			else
+				throw std::invalid_argument("unknown option: " + arg);
+		}
+		return options;
+	}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+	Options options;
+	try
+	{
+		options = parseOptions(argc, argv);
+	}
+	catch(const std::exception &e)
+	{
+		std::cerr << e.what() << "\n";
+		printUsage(argv[0], std::cerr);
+		return EXIT_FAILURE;
+	}
+	if(options.help)
+	{
+		printUsage(argv[0], std::cout);
+		return 0;
+	}
+
+	std::vector<Result> results;
+	try
+	{
+		for(const std::string &keyType : options.keyTypes)
+		{
+			if(keyType == "int")
+				runKeyType<int>(keyType, options, results);
+			else if(keyType == "string")
+				runKeyType<std::string>(keyType, options, results);
+			else
+				throw std::invalid_argument("unknown key type: " + keyType);
+		}
+	}
+	catch(const std::exception &e)
+	{
+		std::cerr << e.what() << "\n";
+		return EXIT_FAILURE;
+	}
 
-	(void)argc;
-	(void)argv;
+	if(options.format == "csv")
+		printCsv(results);
+	else if(options.format == "json")
+		printJson(results);
+	else
+		printTable(results);
 
-	perfomTest();
 	return 0;
 }
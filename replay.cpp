@@ -0,0 +1,343 @@
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Benchmark.h"
+#include "MapTrace.h"
+
+namespace
+{
+	using namespace aisdi::benchmark;
+
+	volatile std::size_t sink;
+
+	const char *operationNames[] = {"insert", "find", "remove", "iterate", "all"};
+	const int OPERATION_COUNT = 5;
+	const int ALL = 4;
+
+	struct Options
+	{
+		std::string tracePath;
+		std::vector<std::string> backends{"HashMap", "TreeMap", "std::map", "std::unordered_map"};
+		std::string keyType; // follows the trace unless given
+		std::size_t repeatCount = 1;
+		std::string format = "table";
+		bool help = false;
+	};
+
+	struct Result
+	{
+		std::string backend;
+		int operation;
+		std::size_t ops;
+		double seconds;
+		double p50;
+		double p99;
+		double p999;
+	};
+
+	Result makeResult(LatencyRecorder &latency, const std::string &backend, int operation)
+	{
+		return Result{backend, operation, latency.operations(), latency.seconds(),
+		              latency.percentile(0.50), latency.percentile(0.99), latency.percentile(0.999)};
+	}
+
+	// The trace with its fingerprints turned into keys of type K, built before any
+	// timing starts. Equal fingerprints give equal keys.
+	template<typename K>
+	struct Replay
+	{
+		std::vector<K> keys;                    // one per distinct fingerprint
+		std::vector<std::uint32_t> keyOf;       // index into keys for every record
+		const aisdi::TraceReader *trace;
+	};
+
+	template<typename K>
+	Replay<K> prepare(const aisdi::TraceReader &trace)
+	{
+		Replay<K> replay;
+		replay.trace = &trace;
+		replay.keyOf.reserve(trace.getSize());
+
+		std::unordered_map<std::uint64_t, std::uint32_t> seen;
+		for(const aisdi::TraceRecord &record : trace)
+		{
+			if(record.operation == aisdi::TRACE_ITERATE)
+			{
+				replay.keyOf.push_back(0);
+				continue;
+			}
+			auto inserted = seen.emplace(record.key, static_cast<std::uint32_t>(replay.keys.size()));
+			if(inserted.second)
+				replay.keys.push_back(makeKey<K>(record.key));
+			replay.keyOf.push_back(inserted.first->second);
+		}
+		return replay;
+	}
+
+	// what the traced map took, from the recorded timings
+	void recordedResults(const aisdi::TraceReader &trace, std::vector<Result> &results)
+	{
+		LatencyRecorder latency[OPERATION_COUNT];
+		for(const aisdi::TraceRecord &record : trace)
+		{
+			std::chrono::nanoseconds elapsed(record.nanos);
+			latency[record.operation].record(elapsed);
+			latency[ALL].record(elapsed);
+		}
+		for(int operation = 0; operation < OPERATION_COUNT; ++operation)
+		{
+			if(latency[operation].operations() > 0)
+				results.push_back(makeResult(latency[operation], "recorded", operation));
+		}
+	}
+
+	// Replays every record in order on a map that starts out empty. Removes that
+	// failed when recorded are replayed as lookups, ones that fail now because the
+	// traced map didn't start out empty are ignored. An iteration walks as many
+	// elements as the traced map held.
+	template<typename MapType, typename K>
+	void replayOn(const std::string &backend, const Replay<K> &replay, const Options &options,
+	              std::vector<Result> &results)
+	{
+		using V = typename MapType::mapped_type;
+
+		LatencyRecorder latency[OPERATION_COUNT];
+		for(std::size_t repeat = 0; repeat < options.repeatCount; ++repeat)
+		{
+			MapType map;
+			std::size_t checksum = 0;
+			std::size_t i = 0;
+
+			latency[ALL].reserve(replay.keyOf.size());
+			for(const aisdi::TraceRecord &record : *replay.trace)
+			{
+				std::uint32_t key = replay.keyOf[i++];
+				std::size_t opsInSample = 1;
+				auto start = Clock::now();
+				switch(record.operation)
+				{
+				case aisdi::TRACE_INSERT:
+					insertKey(map, replay.keys[key], V{});
+					break;
+				case aisdi::TRACE_FIND:
+					checksum += containsKey(map, replay.keys[key]);
+					break;
+				case aisdi::TRACE_REMOVE:
+					if(!record.hit)
+					{
+						checksum += containsKey(map, replay.keys[key]);
+						break;
+					}
+					try
+					{
+						eraseKey(map, replay.keys[key]);
+					}
+					catch(const std::out_of_range &)
+					{}
+					break;
+				case aisdi::TRACE_ITERATE:
+					opsInSample = scan(map, static_cast<std::size_t>(record.key));
+					checksum += opsInSample;
+					break;
+				}
+				auto elapsed = Clock::now() - start;
+				latency[record.operation].record(elapsed, opsInSample);
+				latency[ALL].record(elapsed);
+			}
+			sink = checksum;
+		}
+
+		for(int operation = 0; operation < OPERATION_COUNT; ++operation)
+		{
+			if(latency[operation].operations() > 0)
+				results.push_back(makeResult(latency[operation], backend, operation));
+		}
+	}
+
+	template<typename K>
+	void runKeyType(const aisdi::TraceReader &trace, const Options &options, std::vector<Result> &results)
+	{
+		Replay<K> replay = prepare<K>(trace);
+		for(const std::string &backend : options.backends)
+		{
+			withBackend<K>(backend, [&](auto tag)
+			{
+				replayOn<typename decltype(tag)::Map>(backend, replay, options, results);
+			});
+		}
+	}
+
+	double opsPerSecond(const Result &result)
+	{
+		return result.seconds > 0 ? result.ops / result.seconds : 0;
+	}
+
+	void printTable(const std::vector<Result> &results)
+	{
+		std::cout << std::left << std::setw(24) << "backend" << std::setw(10) << "operation" << std::right
+		          << std::setw(12) << "ops" << std::setw(14) << "ops/sec" << std::setw(10) << "p50 ns"
+		          << std::setw(10) << "p99 ns" << std::setw(10) << "p999 ns" << "\n";
+		for(const Result &result : results)
+		{
+			std::cout << std::left << std::setw(24) << result.backend << std::setw(10) << operationNames[result.operation]
+			          << std::right << std::fixed << std::setprecision(0) << std::setw(12) << result.ops
+			          << std::setw(14) << opsPerSecond(result) << std::setw(10) << result.p50
+			          << std::setw(10) << result.p99 << std::setw(10) << result.p999 << "\n";
+		}
+	}
+
+	void printCsv(const std::vector<Result> &results)
+	{
+		std::cout << "backend,operation,ops,seconds,ops_per_sec,p50_ns,p99_ns,p999_ns\n";
+		for(const Result &result : results)
+		{
+			std::cout << result.backend << "," << operationNames[result.operation] << "," << result.ops << ","
+			          << result.seconds << "," << opsPerSecond(result) << "," << result.p50 << "," << result.p99
+			          << "," << result.p999 << "\n";
+		}
+	}
+
+	void printJson(const std::vector<Result> &results)
+	{
+		std::cout << "[\n";
+		for(std::size_t i = 0; i < results.size(); ++i)
+		{
+			const Result &result = results[i];
+			std::cout << "  {\"backend\": \"" << result.backend << "\", \"operation\": \""
+			          << operationNames[result.operation] << "\", \"ops\": " << result.ops
+			          << ", \"seconds\": " << result.seconds << ", \"ops_per_sec\": " << opsPerSecond(result)
+			          << ", \"p50_ns\": " << result.p50 << ", \"p99_ns\": " << result.p99
+			          << ", \"p999_ns\": " << result.p999 << "}" << (i + 1 < results.size() ? ",\n" : "\n");
+		}
+		std::cout << "]\n";
+	}
+
+	std::vector<std::string> split(const std::string &text, char separator)
+	{
+		std::vector<std::string> parts;
+		std::istringstream in(text);
+		std::string part;
+		while(std::getline(in, part, separator))
+		{
+			if(!part.empty())
+				parts.push_back(part);
+		}
+		return parts;
+	}
+
+	void printUsage(const char *program, std::ostream &out)
+	{
+		out << "usage: " << program << " TRACE [options]\n"
+		    << "  TRACE                       file written by RecordingMap (MapTrace.h)\n"
+		    << "  --backends=HashMap,TreeMap,std::map,std::unordered_map\n"
+		    << "                              also StringHashMap for string keys, FlatHashMap\n"
+		    << "                              for int keys, RadixTreeMap,\n"
+		    << "                              BufferedTreeMap, SpillableHashMap and\n"
+		    << "                              ConcurrentSkipListMap\n"
+		    << "  --keys=int|string           key type replayed; by default int for traces of\n"
+		    << "                              integer keys and string for hashed ones\n"
+		    << "  --repeat=N                  repetitions of every replay\n"
+		    << "  --format=table|csv|json\n"
+		    << "  --help, -h                  print this message\n";
+	}
+
+	Options parseOptions(int argc, char **argv)
+	{
+		Options options;
+		for(int i = 1; i < argc; ++i)
+		{
+			std::string arg = argv[i];
+			auto separator = arg.find('=');
+			std::string name = arg.substr(0, separator);
+			std::string value = separator == std::string::npos ? "" : arg.substr(separator + 1);
+
+			if(arg == "--help" || arg == "-h")
+				options.help = true;
+			else if(name.compare(0, 2, "--") != 0)
+			{
+				if(!options.tracePath.empty())
+					throw std::invalid_argument("more than one trace given");
+				options.tracePath = arg;
+			}
+			else if(name == "--backends")
+				options.backends = split(value, ',');
+			else if(name == "--keys")
+				options.keyType = value;
+			else if(name == "--repeat")
+				options.repeatCount = std::stoull(value);
+			else if(name == "--format")
+			{
+				if(value != "table" && value != "csv" && value != "json")
+					throw std::invalid_argument("unknown format: " + value);
+				options.format = value;
+			}
+			else
+				throw std::invalid_argument("unknown option: " + arg);
+		}
+		if(options.tracePath.empty() && !options.help)
+			throw std::invalid_argument("no trace given");
+		return options;
+	}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+	Options options;
+	try
+	{
+		options = parseOptions(argc, argv);
+	}
+	catch(const std::exception &e)
+	{
+		std::cerr << e.what() << "\n";
+		printUsage(argv[0], std::cerr);
+		return EXIT_FAILURE;
+	}
+	if(options.help)
+	{
+		printUsage(argv[0], std::cout);
+		return 0;
+	}
+
+	std::vector<Result> results;
+	try
+	{
+		aisdi::TraceReader trace(options.tracePath);
+		std::string keyType = options.keyType;
+		if(keyType.empty())
+			keyType = trace.keys() == aisdi::TRACE_INTEGER_KEYS ? "int" : "string";
+
+		recordedResults(trace, results);
+		// fingerprints of integer keys are 64 bits wide
+		if(keyType == "int")
+			runKeyType<long>(trace, options, results);
+		else if(keyType == "string")
+			runKeyType<std::string>(trace, options, results);
+		else
+			throw std::invalid_argument("unknown key type: " + keyType);
+	}
+	catch(const std::exception &e)
+	{
+		std::cerr << e.what() << "\n";
+		return EXIT_FAILURE;
+	}
+
+	if(options.format == "csv")
+		printCsv(results);
+	else if(options.format == "json")
+		printJson(results);
+	else
+		printTable(results);
+
+	return 0;
+}
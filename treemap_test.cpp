@@ -0,0 +1,117 @@
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <random>
+#include <stdexcept>
+
+#include "TreeMap.h"
+
+// g++ -std=c++14 -g -fsanitize=address,undefined -pthread treemap_test.cpp -o treemap_test
+
+namespace
+{
+	using Map = aisdi::TreeMap<int, int>;
+
+	// AVL trees are at most about 1.44 log2(n + 2) high
+	void assertBalanced(const Map &map)
+	{
+		auto stats = map.stats();
+		assert(stats.height <= 1.45 * std::log2(stats.size + 2.0));
+	}
+
+	// erase() hands back the successor, whether the iterator came from a walk, from
+	// find() or from an earlier erase()
+	void eraseReturnsSuccessor()
+	{
+		std::mt19937 random(11);
+		for(int round = 0; round < 50; ++round)
+		{
+			Map map;
+			std::map<int, int> expected;
+			for(int i = 0; i < 2000; ++i)
+			{
+				int key = static_cast<int>(random() % 5000);
+				map[key] = i;
+				expected[key] = i;
+			}
+
+			auto it = map.begin();
+			while(!expected.empty())
+			{
+				if(random() % 4 == 0)
+				{
+					int key = static_cast<int>(random() % 5000);
+					if(expected.count(key) == 0)
+						continue;
+					it = map.find(key);
+				}
+				else if(it == map.end())
+					it = map.begin();
+				else if(random() % 3 == 0)
+				{
+					++it;
+					continue;
+				}
+
+				auto next = expected.erase(expected.find(it->first));
+				it = map.erase(it);
+				assert(map.getSize() == expected.size());
+				assert((it == map.end()) == (next == expected.end()));
+				if(next != expected.end())
+					assert(it->first == next->first && it->second == next->second);
+			}
+			assert(map.isEmpty() && map.begin() == map.end());
+		}
+	}
+
+	// removals by key and by iterator keep the tree balanced and ordered
+	void removalsKeepBalance()
+	{
+		Map map;
+		std::map<int, int> expected;
+		std::mt19937 random(3);
+		for(int i = 0; i < 20000; ++i)
+		{
+			int key = static_cast<int>(random() % 20000);
+			map[key] = key;
+			expected[key] = key;
+		}
+		for(int i = 0; i < 30000; ++i)
+		{
+			int key = static_cast<int>(random() % 20000);
+			if(expected.erase(key) == 0)
+				continue;
+			if(i % 2)
+				map.remove(key);
+			else
+				map.remove(map.find(key));
+		}
+		assertBalanced(map);
+
+		auto next = expected.begin();
+		for(auto &element : map)
+		{
+			assert(element.first == next->first);
+			++next;
+		}
+		assert(next == expected.end());
+
+		try
+		{
+			map.erase(map.end());
+			assert(false);
+		}
+		catch(const std::out_of_range &)
+		{}
+	}
+}
+
+int main()
+{
+	eraseReturnsSuccessor();
+	removalsKeepBalance();
+	std::cout << "ok\n";
+	return EXIT_SUCCESS;
+}